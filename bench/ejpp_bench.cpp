@@ -0,0 +1,164 @@
+/**************************************************************************
+**  Copyright (C) 2014 Christian Manning
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include <string>
+#include <vector>
+
+#include <ejpp/bson.hpp>
+#include <ejpp/ejdb.hpp>
+
+#include <benchmark/benchmark.h>
+
+using ejdb::detail::bson_builder;
+
+namespace {
+
+constexpr auto bench_mode =
+    ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create | ejdb::db_mode::truncate;
+
+//! Returns a document of roughly \p size bytes, with numeric field "n" set to \p n.
+std::vector<char> make_document(size_t size, int32_t n) {
+    const auto padding = size > 32 ? size - 32 : 0;
+    return bson_builder{}
+        .append("n", n)
+        .append("k", "key")
+        .append("payload", std::string(padding, 'x'))
+        .finish();
+}
+
+//! A freshly truncated database and collection, optionally populated with \p count documents.
+struct bench_db {
+    explicit bench_db(size_t count = 0, size_t doc_size = 64) {
+        db.open("ejpp_bench_db", bench_mode);
+        coll = db.create_collection("bench");
+        oids.reserve(count);
+        for(size_t i = 0; i < count; ++i)
+            oids.push_back(coll.save_document(make_document(doc_size, static_cast<int32_t>(i))));
+    }
+
+    ~bench_db() {
+        coll = {};
+        db.close();
+    }
+
+    ejdb::db db;
+    ejdb::collection coll;
+    std::vector<std::array<char, 12>> oids;
+};
+
+void BM_Save(benchmark::State& state) {
+    bench_db b;
+    const auto doc = make_document(static_cast<size_t>(state.range(0)), 1);
+    for(auto _ : state)
+        benchmark::DoNotOptimize(b.coll.save_document(doc));
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(doc.size()));
+}
+BENCHMARK(BM_Save)->Arg(64)->Arg(1 << 10)->Arg(16 << 10);
+
+void BM_Load(benchmark::State& state) {
+    bench_db b{1000, static_cast<size_t>(state.range(0))};
+    size_t i{0};
+    for(auto _ : state)
+        benchmark::DoNotOptimize(b.coll.load_document(b.oids[i++ % b.oids.size()]));
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Load)->Arg(64)->Arg(1 << 10)->Arg(16 << 10);
+
+void BM_Remove(benchmark::State& state) {
+    bench_db b;
+    const auto doc = make_document(static_cast<size_t>(state.range(0)), 1);
+    for(auto _ : state) {
+        state.PauseTiming();
+        const auto oid = b.coll.save_document(doc);
+        state.ResumeTiming();
+        b.coll.remove_document(oid);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Remove)->Arg(64)->Arg(1 << 10)->Arg(16 << 10);
+
+//! Queries a range of 1% of 10000 documents, with range(0) selecting the search mode and range(1) indexing.
+template <ejdb::query_search_mode mode> void BM_Query(benchmark::State& state) {
+    bench_db b{10000};
+    if(state.range(0))
+        b.coll.set_index("n", ejdb::index_mode::number);
+    const auto qry = b.db.create_query(bson_builder{}
+                                           .begin_document("n")
+                                           .append("$gte", int32_t{5000})
+                                           .append("$lt", int32_t{5100})
+                                           .end()
+                                           .finish());
+    for(auto _ : state)
+        benchmark::DoNotOptimize(b.coll.execute_query<mode>(qry));
+    state.SetItemsProcessed(state.iterations());
+    state.SetLabel(state.range(0) ? "indexed" : "unindexed");
+}
+BENCHMARK_TEMPLATE(BM_Query, ejdb::query_search_mode::normal)->Arg(0)->Arg(1);
+BENCHMARK_TEMPLATE(BM_Query, ejdb::query_search_mode::count_only)->Arg(0)->Arg(1);
+BENCHMARK_TEMPLATE(BM_Query, ejdb::query_search_mode::first_only)->Arg(0)->Arg(1);
+
+//! Finds the OIDs of a range of 1% of 10000 documents of range(0) bytes, for comparison with BM_Query.
+void BM_FindIds(benchmark::State& state) {
+    bench_db b{10000, static_cast<size_t>(state.range(0))};
+    b.coll.set_index("n", ejdb::index_mode::number);
+    const auto qry = b.db.create_query(bson_builder{}
+                                           .begin_document("n")
+                                           .append("$gte", int32_t{5000})
+                                           .append("$lt", int32_t{5100})
+                                           .end()
+                                           .finish());
+    for(auto _ : state)
+        benchmark::DoNotOptimize(b.coll.find_ids(qry));
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FindIds)->Arg(64)->Arg(16 << 10);
+
+//! Commits transactions of range(0) saves.
+void BM_TransactionCommit(benchmark::State& state) {
+    bench_db b;
+    const auto doc = make_document(64, 1);
+    for(auto _ : state) {
+        ejdb::unique_transaction trans{b.coll.transaction()};
+        for(int64_t i = 0; i < state.range(0); ++i)
+            b.coll.save_document(doc);
+        trans.commit();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_TransactionCommit)->Arg(1)->Arg(10)->Arg(100);
+
+//! Saves batches of range(0) documents given their `_id` up front by an oid_generator, for comparison with
+//! BM_TransactionCommit.
+void BM_SaveDocuments(benchmark::State& state) {
+    bench_db b;
+    ejdb::oid_generator gen;
+    const auto size = static_cast<size_t>(state.range(0));
+    for(auto _ : state) {
+        std::vector<std::vector<char>> docs;
+        docs.reserve(size);
+        for(auto&& oid : gen.generate(size))
+            docs.push_back(bson_builder{}.append_oid("_id", oid.data()).append("n", int32_t{1}).finish());
+        benchmark::DoNotOptimize(b.coll.save_documents(docs));
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SaveDocuments)->Arg(1)->Arg(10)->Arg(100);
+
+} // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,451 @@
+/**************************************************************************
+**  Copyright (C) 2014 Christian Manning
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+// YCSB-style load generator. Runs the YCSB core workloads A-F against a local ejdb::db.
+//
+// Records are documents {key: int64, field0..fieldN: string}, with a numeric index on "key".
+// Operations map onto ejpp as follows:
+//  - read: first_only query on key
+//  - update: {$set} update query on key
+//  - insert: save_document with the next unused key
+//  - scan: query on key >= k, ordered by key, limited to a uniformly chosen length
+//  - read-modify-write: read followed by update of the same key
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <ejpp/bson.hpp>
+#include <ejpp/ejdb.hpp>
+
+using ejdb::detail::bson_builder;
+
+namespace {
+
+enum class operation { read, update, insert, scan, read_modify_write };
+constexpr size_t operation_count = 5;
+constexpr std::array<const char*, operation_count> operation_names{{"READ", "UPDATE", "INSERT", "SCAN", "RMW"}};
+
+enum class distribution { uniform, zipfian, latest };
+
+struct workload {
+    std::array<double, operation_count> proportions;
+    distribution request_distribution;
+};
+
+//! Proportions of read, update, insert, scan and read-modify-write for the YCSB core workloads.
+workload core_workload(char name) {
+    switch(name) {
+        case 'a':
+            return {{{0.5, 0.5, 0, 0, 0}}, distribution::zipfian};
+        case 'b':
+            return {{{0.95, 0.05, 0, 0, 0}}, distribution::zipfian};
+        case 'c':
+            return {{{1, 0, 0, 0, 0}}, distribution::zipfian};
+        case 'd':
+            return {{{0.95, 0, 0.05, 0, 0}}, distribution::latest};
+        case 'e':
+            return {{{0, 0, 0.05, 0.95, 0}}, distribution::zipfian};
+        case 'f':
+            return {{{0.5, 0, 0, 0, 0.5}}, distribution::zipfian};
+        default:
+            throw std::invalid_argument("unknown workload");
+    }
+}
+
+struct options {
+    std::string path{"ejpp_loadgen_db"};
+    char workload{'a'};
+    uint64_t record_count{100000};
+    uint64_t operation_count{100000};
+    unsigned threads{1};
+    std::string distribution;
+    ejdb::db_mode mode{ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create | ejdb::db_mode::truncate};
+    unsigned field_count{10};
+    unsigned field_length{100};
+    unsigned max_scan_length{100};
+    bool load{true};
+};
+
+/*!
+ * \brief Zipfian distribution over [0, items), as described by Gray et al. and used by YCSB.
+ *
+ * Popular items are scattered across the key space by hashing, so that hot records aren't clustered.
+ */
+struct zipfian_generator {
+    explicit zipfian_generator(uint64_t items, double theta = 0.99) : m_items(items), m_theta(theta) {
+        for(uint64_t i = 1; i <= items; ++i)
+            m_zetan += 1 / std::pow(static_cast<double>(i), theta);
+        const auto zeta2 = 1 + 1 / std::pow(2.0, theta);
+        m_alpha = 1 / (1 - theta);
+        m_eta = (1 - std::pow(2.0 / items, 1 - theta)) / (1 - zeta2 / m_zetan);
+    }
+
+    //! Returns the rank of the next item, with 0 most popular.
+    template <typename Rng> uint64_t rank(Rng& rng) const {
+        const auto u = std::uniform_real_distribution<double>{}(rng);
+        const auto uz = u * m_zetan;
+        if(uz < 1)
+            return 0;
+        if(uz < 1 + std::pow(0.5, m_theta))
+            return 1;
+        return std::min(m_items - 1, static_cast<uint64_t>(m_items * std::pow(m_eta * u - m_eta + 1, m_alpha)));
+    }
+
+    //! Returns the next item, scattered over [0, items).
+    template <typename Rng> uint64_t operator()(Rng& rng) const { return fnv1a(rank(rng)) % m_items; }
+
+  private:
+    static uint64_t fnv1a(uint64_t v) noexcept {
+        uint64_t hash{0xcbf29ce484222325};
+        for(int i = 0; i < 8; ++i) {
+            hash ^= v & 0xff;
+            hash *= 0x100000001b3;
+            v >>= 8;
+        }
+        return hash;
+    }
+
+    uint64_t m_items;
+    double m_theta;
+    double m_zetan{0};
+    double m_alpha;
+    double m_eta;
+};
+
+//! Chooses keys to operate on, according to the request distribution.
+struct key_chooser {
+    key_chooser(distribution dist, uint64_t records) : m_dist(dist), m_zipf(records) {}
+
+    template <typename Rng> int64_t operator()(Rng& rng, uint64_t inserted) const {
+        switch(m_dist) {
+            case distribution::uniform:
+                return static_cast<int64_t>(std::uniform_int_distribution<uint64_t>{0, inserted - 1}(rng));
+            case distribution::zipfian:
+                return static_cast<int64_t>(m_zipf(rng) % inserted);
+            case distribution::latest:
+                return static_cast<int64_t>(inserted - 1 - std::min(inserted - 1, m_zipf.rank(rng)));
+        }
+        return 0;
+    }
+
+  private:
+    distribution m_dist;
+    zipfian_generator m_zipf;
+};
+
+std::vector<char> make_record(int64_t key, const options& opts, std::mt19937_64& rng) {
+    bson_builder b;
+    b.append("key", key);
+    std::string value(opts.field_length, '\0');
+    for(unsigned i = 0; i < opts.field_count; ++i) {
+        for(auto& c : value)
+            c = static_cast<char>('a' + rng() % 26);
+        b.append("field" + std::to_string(i), value);
+    }
+    return b.finish();
+}
+
+//! Latencies of each operation type, in nanoseconds.
+using latencies = std::array<std::vector<uint64_t>, operation_count>;
+
+void run_thread(ejdb::db& db, const options& opts, const workload& wl, const key_chooser& choose_key, uint64_t ops,
+                unsigned seed, std::atomic<uint64_t>& next_key, latencies& lat) {
+    auto coll = db.get_collection("usertable");
+    std::mt19937_64 rng{seed};
+    std::discrete_distribution<size_t> choose_op{wl.proportions.begin(), wl.proportions.end()};
+    std::uniform_int_distribution<unsigned> choose_scan_length{1, opts.max_scan_length};
+    std::uniform_int_distribution<unsigned> choose_field{0, opts.field_count - 1};
+
+    const auto read = [&](int64_t key) {
+        coll.execute_query<ejdb::query_search_mode::first_only>(
+            db.create_query(bson_builder{}.append("key", key).finish()));
+    };
+    const auto update = [&](int64_t key) {
+        coll.execute_query<ejdb::query_search_mode::count_only>(db.create_query(
+            bson_builder{}
+                .append("key", key)
+                .begin_document("$set")
+                .append("field" + std::to_string(choose_field(rng)), std::string(opts.field_length, 'u'))
+                .end()
+                .finish()));
+    };
+
+    for(uint64_t i = 0; i < ops; ++i) {
+        const auto op = static_cast<operation>(choose_op(rng));
+        const auto inserted = next_key.load(std::memory_order_relaxed);
+        const auto start = std::chrono::steady_clock::now();
+        switch(op) {
+            case operation::read:
+                read(choose_key(rng, inserted));
+                break;
+            case operation::update:
+                update(choose_key(rng, inserted));
+                break;
+            case operation::insert:
+                coll.save_document(make_record(static_cast<int64_t>(next_key++), opts, rng));
+                break;
+            case operation::scan: {
+                const auto qry = db.create_query(bson_builder{}
+                                                     .begin_document("key")
+                                                     .append("$gte", choose_key(rng, inserted))
+                                                     .end()
+                                                     .finish())
+                                     .set_hints(bson_builder{}
+                                                    .append("$max", static_cast<int32_t>(choose_scan_length(rng)))
+                                                    .begin_document("$orderby")
+                                                    .append("key", int32_t{1})
+                                                    .end()
+                                                    .finish());
+                coll.execute_query(qry);
+                break;
+            }
+            case operation::read_modify_write: {
+                const auto key = choose_key(rng, inserted);
+                read(key);
+                update(key);
+                break;
+            }
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        lat[static_cast<size_t>(op)].push_back(
+            static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+    }
+}
+
+/*!
+ * \brief Runs \p fun in opts.threads threads, dividing \p total between them.
+ *
+ * Exceptions thrown by \p fun are rethrown once all threads have finished.
+ *
+ * \return Elapsed time in seconds.
+ */
+template <typename Fun> double run_threads(const options& opts, uint64_t total, Fun&& fun) {
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> errors(opts.threads);
+    const auto start = std::chrono::steady_clock::now();
+    for(unsigned t = 0; t < opts.threads; ++t) {
+        const auto n = total / opts.threads + (t < total % opts.threads ? 1 : 0);
+        threads.emplace_back([&, t, n]() {
+            try {
+                fun(t, n);
+            } catch(...) {
+                errors[t] = std::current_exception();
+            }
+        });
+    }
+    for(auto&& t : threads)
+        t.join();
+    for(auto&& e : errors)
+        if(e)
+            std::rethrow_exception(e);
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+double percentile(const std::vector<uint64_t>& sorted, double p) {
+    const auto idx = static_cast<size_t>(std::ceil(p / 100 * sorted.size()));
+    return sorted[std::min(sorted.size() - 1, idx == 0 ? 0 : idx - 1)] / 1000.0;
+}
+
+void report(const std::vector<latencies>& per_thread, double seconds) {
+    uint64_t total{0};
+    std::printf("%-8s %10s %10s %10s %10s %10s %10s %10s\n", "op", "count", "avg(us)", "p50(us)", "p95(us)",
+                "p99(us)", "p99.9(us)", "max(us)");
+    for(size_t op = 0; op < operation_count; ++op) {
+        std::vector<uint64_t> all;
+        for(auto&& lat : per_thread)
+            all.insert(all.end(), lat[op].begin(), lat[op].end());
+        if(all.empty())
+            continue;
+        std::sort(all.begin(), all.end());
+        double sum{0};
+        for(auto v : all)
+            sum += v;
+        total += all.size();
+        std::printf("%-8s %10zu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", operation_names[op], all.size(),
+                    sum / all.size() / 1000.0, percentile(all, 50), percentile(all, 95), percentile(all, 99),
+                    percentile(all, 99.9), all.back() / 1000.0);
+    }
+    std::printf("\n%llu operations in %.3fs, %.1f ops/sec\n", static_cast<unsigned long long>(total), seconds,
+                total / seconds);
+}
+
+ejdb::db_mode parse_mode(const std::string& str) {
+    static const std::array<std::pair<const char*, ejdb::db_mode>, 7> modes{{
+        {"read", ejdb::db_mode::read},
+        {"write", ejdb::db_mode::write},
+        {"create", ejdb::db_mode::create},
+        {"truncate", ejdb::db_mode::truncate},
+        {"nolock", ejdb::db_mode::nolock},
+        {"noblock", ejdb::db_mode::noblock},
+        {"trans_sync", ejdb::db_mode::trans_sync},
+    }};
+    ejdb::db_mode mode{};
+    size_t begin{0};
+    while(begin <= str.size()) {
+        const auto end = std::min(str.find(',', begin), str.size());
+        const auto flag = str.substr(begin, end - begin);
+        const auto it = std::find_if(modes.begin(), modes.end(), [&](auto&& m) { return flag == m.first; });
+        if(it == modes.end())
+            throw std::invalid_argument("unknown db_mode flag: " + flag);
+        mode |= it->second;
+        begin = end + 1;
+    }
+    return mode;
+}
+
+void usage(const char* argv0) {
+    std::fprintf(stderr,
+                 "Usage: %s [options]\n"
+                 "  --workload=a|b|c|d|e|f     YCSB core workload (default a)\n"
+                 "  --records=N                records loaded before the run (default 100000)\n"
+                 "  --operations=N             operations in the run (default 100000)\n"
+                 "  --threads=N                client threads (default 1)\n"
+                 "  --distribution=uniform|zipfian|latest\n"
+                 "                             key distribution (default: the workload's)\n"
+                 "  --db=PATH                  database path (default ejpp_loadgen_db)\n"
+                 "  --mode=FLAG[,FLAG...]      db_mode flags: read,write,create,truncate,nolock,noblock,trans_sync\n"
+                 "                             (default read,write,create,truncate, or read,write,create with\n"
+                 "                             --no-load)\n"
+                 "  --fields=N                 fields per record (default 10)\n"
+                 "  --field-length=N           bytes per field (default 100)\n"
+                 "  --max-scan-length=N        maximum records per scan (default 100)\n"
+                 "  --no-load                  skip the load phase, running against an existing database\n"
+                 "  --help                     show this message\n",
+                 argv0);
+}
+
+options parse_options(int argc, char** argv) {
+    options opts;
+    bool mode_set{false};
+    for(int i = 1; i < argc; ++i) {
+        const std::string arg{argv[i]};
+        const auto eq = arg.find('=');
+        const auto name = arg.substr(0, eq);
+        const auto value = eq == std::string::npos ? std::string{} : arg.substr(eq + 1);
+        if(name == "--workload" && value.size() == 1)
+            opts.workload = value[0];
+        else if(name == "--records")
+            opts.record_count = std::stoull(value);
+        else if(name == "--operations")
+            opts.operation_count = std::stoull(value);
+        else if(name == "--threads")
+            opts.threads = static_cast<unsigned>(std::stoul(value));
+        else if(name == "--distribution")
+            opts.distribution = value;
+        else if(name == "--db")
+            opts.path = value;
+        else if(name == "--mode") {
+            opts.mode = parse_mode(value);
+            mode_set = true;
+        }
+        else if(name == "--fields")
+            opts.field_count = static_cast<unsigned>(std::stoul(value));
+        else if(name == "--field-length")
+            opts.field_length = static_cast<unsigned>(std::stoul(value));
+        else if(name == "--max-scan-length")
+            opts.max_scan_length = static_cast<unsigned>(std::stoul(value));
+        else if(name == "--no-load")
+            opts.load = false;
+        else
+            throw std::invalid_argument("unknown option: " + arg);
+    }
+    if(opts.threads == 0 || opts.record_count == 0 || opts.field_count == 0 || opts.max_scan_length == 0)
+        throw std::invalid_argument("threads, records, fields and max-scan-length must be non-zero");
+    if(!opts.load) {
+        // running against an existing database, which truncation would empty
+        using flags = std::underlying_type<ejdb::db_mode>::type;
+        if(mode_set && (static_cast<flags>(opts.mode) & static_cast<flags>(ejdb::db_mode::truncate)))
+            throw std::invalid_argument("--no-load can't be combined with the truncate mode flag");
+        if(!mode_set)
+            opts.mode = ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create;
+    }
+    return opts;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if(std::any_of(argv + 1, argv + argc, [](const char* arg) { return std::strcmp(arg, "--help") == 0; })) {
+        usage(argv[0]);
+        return 0;
+    }
+
+    options opts;
+    workload wl;
+    try {
+        opts = parse_options(argc, argv);
+        wl = core_workload(opts.workload);
+        if(opts.distribution == "uniform")
+            wl.request_distribution = distribution::uniform;
+        else if(opts.distribution == "zipfian")
+            wl.request_distribution = distribution::zipfian;
+        else if(opts.distribution == "latest")
+            wl.request_distribution = distribution::latest;
+        else if(!opts.distribution.empty())
+            throw std::invalid_argument("unknown distribution: " + opts.distribution);
+    } catch(std::exception& e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        usage(argv[0]);
+        return 1;
+    }
+
+    try {
+        ejdb::db db;
+        db.open(opts.path, opts.mode);
+        auto coll = db.create_collection("usertable");
+        coll.set_index("key", ejdb::index_mode::number);
+
+        std::atomic<uint64_t> next_key{opts.record_count};
+        if(opts.load) {
+            std::atomic<uint64_t> load_key{0};
+            const auto seconds = run_threads(opts, opts.record_count, [&](unsigned t, uint64_t n) {
+                auto c = db.get_collection("usertable");
+                std::mt19937_64 rng{t};
+                for(uint64_t i = 0; i < n; ++i)
+                    c.save_document(make_record(static_cast<int64_t>(load_key++), opts, rng));
+            });
+            std::printf("Loaded %llu records in %.3fs, %.1f records/sec\n\n",
+                        static_cast<unsigned long long>(opts.record_count), seconds, opts.record_count / seconds);
+        }
+
+        std::printf("Workload %c, %llu operations, %u threads\n\n", opts.workload,
+                    static_cast<unsigned long long>(opts.operation_count), opts.threads);
+        const key_chooser choose_key{wl.request_distribution, opts.record_count};
+        std::vector<latencies> per_thread(opts.threads);
+        const auto seconds = run_threads(opts, opts.operation_count, [&](unsigned t, uint64_t n) {
+            run_thread(db, opts, wl, choose_key, n, t + 1, next_key, per_thread[t]);
+        });
+        report(per_thread, seconds);
+
+        db.sync();
+        db.close();
+    } catch(std::exception& e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+}
@@ -0,0 +1,229 @@
+/**************************************************************************
+**  Copyright (C) 2014 Christian Manning
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+// Runs identical workloads through ejdb::collection and directly through the EJDB C API.
+// Each BM_<op>_ejpp has a BM_<op>_c_api counterpart; the overhead of the former over the latter is reported after
+// all benchmarks have run.
+
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <tcejdb/ejdb.h>
+
+#include <ejpp/bson.hpp>
+#include <ejpp/ejdb.hpp>
+
+#include <benchmark/benchmark.h>
+
+using ejdb::detail::bson_builder;
+
+namespace {
+
+constexpr size_t doc_count = 1000;
+
+std::vector<char> make_document(int32_t n) { return bson_builder{}.append("n", n).append("k", "key").finish(); }
+
+std::vector<char> make_query() {
+    return bson_builder{}.begin_document("n").append("$gte", int32_t{100}).append("$lt", int32_t{110}).end().finish();
+}
+
+struct ejpp_db {
+    ejpp_db() {
+        db.open("ejpp_overhead_db", ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create |
+                                        ejdb::db_mode::truncate);
+        coll = db.create_collection("bench");
+        coll.set_index("n", ejdb::index_mode::number);
+        for(size_t i = 0; i < doc_count; ++i)
+            oids.push_back(coll.save_document(make_document(static_cast<int32_t>(i))));
+    }
+
+    ejdb::db db;
+    ejdb::collection coll;
+    std::vector<std::array<char, 12>> oids;
+};
+
+struct c_api_db {
+    c_api_db() : db(ejdbnew()) {
+        ejdbopen(db, "ejpp_overhead_c_db", JBOREADER | JBOWRITER | JBOCREAT | JBOTRUNC);
+        coll = ejdbcreatecoll(db, "bench", nullptr);
+        ejdbsetindex(coll, "n", JBIDXNUM);
+        for(size_t i = 0; i < doc_count; ++i) {
+            bson_oid_t oid;
+            ejdbsavebson3(coll, make_document(static_cast<int32_t>(i)).data(), &oid, false);
+            oids.push_back(oid);
+        }
+    }
+
+    ~c_api_db() {
+        ejdbclose(db);
+        ejdbdel(db);
+    }
+
+    EJDB* db;
+    EJCOLL* coll;
+    std::vector<bson_oid_t> oids;
+};
+
+void BM_Save_ejpp(benchmark::State& state) {
+    ejpp_db b;
+    const auto doc = make_document(1);
+    for(auto _ : state)
+        benchmark::DoNotOptimize(b.coll.save_document(doc));
+}
+BENCHMARK(BM_Save_ejpp);
+
+void BM_Save_c_api(benchmark::State& state) {
+    c_api_db b;
+    const auto doc = make_document(1);
+    bson_oid_t oid;
+    for(auto _ : state)
+        benchmark::DoNotOptimize(ejdbsavebson3(b.coll, doc.data(), &oid, false));
+}
+BENCHMARK(BM_Save_c_api);
+
+void BM_Load_ejpp(benchmark::State& state) {
+    ejpp_db b;
+    size_t i{0};
+    for(auto _ : state)
+        benchmark::DoNotOptimize(b.coll.load_document(b.oids[i++ % b.oids.size()]));
+}
+BENCHMARK(BM_Load_ejpp);
+
+void BM_Load_c_api(benchmark::State& state) {
+    c_api_db b;
+    size_t i{0};
+    for(auto _ : state) {
+        auto bs = ejdbloadbson(b.coll, &b.oids[i++ % b.oids.size()]);
+        benchmark::DoNotOptimize(bs->data);
+        bson_del(bs);
+    }
+}
+BENCHMARK(BM_Load_c_api);
+
+void BM_Remove_ejpp(benchmark::State& state) {
+    ejpp_db b;
+    const auto doc = make_document(1);
+    for(auto _ : state) {
+        state.PauseTiming();
+        const auto oid = b.coll.save_document(doc);
+        state.ResumeTiming();
+        b.coll.remove_document(oid);
+    }
+}
+BENCHMARK(BM_Remove_ejpp);
+
+void BM_Remove_c_api(benchmark::State& state) {
+    c_api_db b;
+    const auto doc = make_document(1);
+    bson_oid_t oid;
+    for(auto _ : state) {
+        state.PauseTiming();
+        ejdbsavebson3(b.coll, doc.data(), &oid, false);
+        state.ResumeTiming();
+        ejdbrmbson(b.coll, &oid);
+    }
+}
+BENCHMARK(BM_Remove_c_api);
+
+void BM_Query_ejpp(benchmark::State& state) {
+    ejpp_db b;
+    const auto qry = b.db.create_query(make_query());
+    for(auto _ : state)
+        benchmark::DoNotOptimize(b.coll.execute_query(qry));
+}
+BENCHMARK(BM_Query_ejpp);
+
+void BM_Query_c_api(benchmark::State& state) {
+    c_api_db b;
+    const auto qdoc = make_query();
+    auto qry = ejdbcreatequery2(b.db, qdoc.data());
+    for(auto _ : state) {
+        uint32_t count{0};
+        auto res = ejdbqryexecute(b.coll, qry, &count, 0, nullptr);
+        for(int i = 0, n = ejdbqresultnum(res); i < n; ++i) {
+            int size{0};
+            benchmark::DoNotOptimize(ejdbqresultbsondata(res, i, &size));
+        }
+        ejdbqresultdispose(res);
+    }
+    ejdbquerydel(qry);
+}
+BENCHMARK(BM_Query_c_api);
+
+void BM_QueryCount_ejpp(benchmark::State& state) {
+    ejpp_db b;
+    const auto qry = b.db.create_query(make_query());
+    for(auto _ : state)
+        benchmark::DoNotOptimize(b.coll.execute_query<ejdb::query_search_mode::count_only>(qry));
+}
+BENCHMARK(BM_QueryCount_ejpp);
+
+void BM_QueryCount_c_api(benchmark::State& state) {
+    c_api_db b;
+    const auto qdoc = make_query();
+    auto qry = ejdbcreatequery2(b.db, qdoc.data());
+    for(auto _ : state) {
+        uint32_t count{0};
+        ejdbqresultdispose(ejdbqryexecute(b.coll, qry, &count, JBQRYCOUNT, nullptr));
+        benchmark::DoNotOptimize(count);
+    }
+    ejdbquerydel(qry);
+}
+BENCHMARK(BM_QueryCount_c_api);
+
+//! Console reporter which additionally prints the overhead of each *_ejpp benchmark over its *_c_api counterpart.
+struct overhead_reporter : benchmark::ConsoleReporter {
+    void ReportRuns(const std::vector<Run>& reports) override {
+        for(auto&& run : reports)
+            if(run.run_type == Run::RT_Iteration && !run.error_occurred)
+                m_times[run.benchmark_name()] = run.GetAdjustedRealTime();
+        benchmark::ConsoleReporter::ReportRuns(reports);
+    }
+
+    void Finalize() override {
+        static const std::string ejpp_suffix{"_ejpp"};
+        std::printf("\n%-24s %14s %14s %14s %9s\n", "Operation", "ejpp", "C API", "Overhead", "Ratio");
+        for(auto&& t : m_times) {
+            const auto pos = t.first.find(ejpp_suffix);
+            if(pos == std::string::npos)
+                continue;
+            auto c_name = t.first;
+            c_name.replace(pos, ejpp_suffix.size(), "_c_api");
+            const auto c = m_times.find(c_name);
+            if(c == m_times.end() || c->second <= 0)
+                continue;
+            std::printf("%-24s %14.1f %14.1f %14.1f %8.2fx\n", t.first.substr(0, pos).c_str(), t.second, c->second,
+                        t.second - c->second, t.second / c->second);
+        }
+        benchmark::ConsoleReporter::Finalize();
+    }
+
+  private:
+    std::map<std::string, double> m_times;
+};
+
+} // namespace
+
+int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+    if(benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    overhead_reporter reporter;
+    benchmark::RunSpecifiedBenchmarks(&reporter);
+}
@@ -0,0 +1,427 @@
+/******************************************************************************
+ *
+ * C++11 wrapper for EJDB (http://ejdb.org)
+ * Copyright (C) 2013 Christian Manning
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+ * USA
+ *****************************************************************************/
+
+#ifndef EJDB_BSON_HPP
+#define EJDB_BSON_HPP
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <experimental/optional>
+#include <experimental/string_view>
+
+namespace ejdb {
+namespace detail {
+
+/*!
+ * \brief BSON element types.
+ *
+ * ejpp does not depend on a BSON library, though it occasionally needs to generate or inspect small documents itself,
+ * e.g. query hints. The facilities in this header are the bare minimum to do so and are not intended as a general
+ * purpose BSON library.
+ */
+enum class bson_type : uint8_t {
+    double_ = 0x01,
+    string = 0x02,
+    document = 0x03,
+    array = 0x04,
+    binary = 0x05,
+    undefined = 0x06,
+    oid = 0x07,
+    boolean = 0x08,
+    date = 0x09,
+    null = 0x0A,
+    regex = 0x0B,
+    db_pointer = 0x0C,
+    javascript = 0x0D,
+    symbol = 0x0E,
+    scoped_javascript = 0x0F,
+    int32 = 0x10,
+    timestamp = 0x11,
+    int64 = 0x12,
+    max_key = 0x7F,
+    min_key = 0xFF
+};
+
+//! Reads a little-endian 32-bit integer from \p data.
+inline int32_t bson_read_int32(const char* data) noexcept {
+    uint32_t v{0};
+    for(int i = 3; i >= 0; --i)
+        v = (v << 8) | static_cast<uint8_t>(data[i]);
+    return static_cast<int32_t>(v);
+}
+
+//! Reads a little-endian 64-bit integer from \p data.
+inline int64_t bson_read_int64(const char* data) noexcept {
+    uint64_t v{0};
+    for(int i = 7; i >= 0; --i)
+        v = (v << 8) | static_cast<uint8_t>(data[i]);
+    return static_cast<int64_t>(v);
+}
+
+//! Reads a little-endian IEEE 754 double from \p data.
+inline double bson_read_double(const char* data) noexcept {
+    const auto i = bson_read_int64(data);
+    double d;
+    std::memcpy(&d, &i, sizeof(d));
+    return d;
+}
+
+//! Writes \p v to \p data as a little-endian 32-bit integer.
+inline void bson_write_int32(char* data, int32_t v) noexcept {
+    const auto u = static_cast<uint32_t>(v);
+    for(int i = 0; i < 4; ++i)
+        data[i] = static_cast<char>((u >> (8 * i)) & 0xff);
+}
+
+//! Writes \p v to \p data as a little-endian 64-bit integer.
+inline void bson_write_int64(char* data, int64_t v) noexcept {
+    const auto u = static_cast<uint64_t>(v);
+    for(int i = 0; i < 8; ++i)
+        data[i] = static_cast<char>((u >> (8 * i)) & 0xff);
+}
+
+//! Writes \p v to \p data as a little-endian IEEE 754 double.
+inline void bson_write_double(char* data, double v) noexcept {
+    int64_t i;
+    std::memcpy(&i, &v, sizeof(i));
+    bson_write_int64(data, i);
+}
+
+/*!
+ * \brief Returns the size of an element's value of type \p type, beginning at \p value.
+ *
+ * \return Size in bytes, or zero when the value is malformed or would exceed \p remaining bytes.
+ */
+inline size_t bson_value_size(bson_type type, const char* value, size_t remaining) noexcept {
+    size_t s{0};
+    switch(type) {
+        case bson_type::double_:
+        case bson_type::date:
+        case bson_type::timestamp:
+        case bson_type::int64:
+            s = 8;
+            break;
+        case bson_type::int32:
+            s = 4;
+            break;
+        case bson_type::boolean:
+            s = 1;
+            break;
+        case bson_type::oid:
+            s = 12;
+            break;
+        case bson_type::undefined:
+        case bson_type::null:
+        case bson_type::min_key:
+        case bson_type::max_key:
+            return 0;
+        case bson_type::string:
+        case bson_type::javascript:
+        case bson_type::symbol:
+            if(remaining < 4)
+                return 0;
+            s = 4 + static_cast<size_t>(bson_read_int32(value));
+            break;
+        case bson_type::document:
+        case bson_type::array:
+        case bson_type::scoped_javascript:
+            if(remaining < 4)
+                return 0;
+            s = static_cast<size_t>(bson_read_int32(value));
+            break;
+        case bson_type::binary:
+            if(remaining < 4)
+                return 0;
+            s = 5 + static_cast<size_t>(bson_read_int32(value));
+            break;
+        case bson_type::regex: {
+            const auto pattern = ::strnlen(value, remaining);
+            if(pattern >= remaining)
+                return 0;
+            const auto opts = ::strnlen(value + pattern + 1, remaining - pattern - 1);
+            s = pattern + opts + 2;
+            break;
+        }
+        case bson_type::db_pointer:
+            if(remaining < 4)
+                return 0;
+            s = 4 + static_cast<size_t>(bson_read_int32(value)) + 12;
+            break;
+        default:
+            return 0;
+    }
+    return s <= remaining ? s : 0;
+}
+
+//! Returns whether elements of type \p type have an empty value.
+constexpr bool bson_is_empty_type(bson_type type) noexcept {
+    return type == bson_type::undefined || type == bson_type::null || type == bson_type::min_key ||
+           type == bson_type::max_key;
+}
+
+/*!
+ * \brief Non-owning view of a single BSON element.
+ */
+struct bson_element {
+    //! Type of the element.
+    bson_type type;
+    //! Name of the element.
+    std::experimental::string_view name;
+    //! Beginning of the element's value.
+    const char* value;
+    //! Size of the element's value.
+    size_t size;
+
+    //! Returns the raw element, i.e. type, name and value, as a contiguous range.
+    std::experimental::string_view raw() const noexcept {
+        const auto begin = name.data() - 1;
+        return {begin, static_cast<size_t>(value + size - begin)};
+    }
+
+    //! Returns the value of a numeric element as a double, or nullopt if the element is not numeric.
+    std::experimental::optional<double> as_number() const noexcept {
+        switch(type) {
+            case bson_type::double_:
+                return bson_read_double(value);
+            case bson_type::int32:
+                return static_cast<double>(bson_read_int32(value));
+            case bson_type::int64:
+                return static_cast<double>(bson_read_int64(value));
+            default:
+                return std::experimental::nullopt;
+        }
+    }
+
+    //! Returns the value of a string element, excluding its terminator, or nullopt if the element is not a string.
+    std::experimental::optional<std::experimental::string_view> as_string() const noexcept {
+        if(type != bson_type::string || size < 5)
+            return std::experimental::nullopt;
+        return std::experimental::string_view{value + 4, size - 5};
+    }
+
+    //! Returns whether both elements have the same type and value. Names are not compared.
+    bool value_equals(const bson_element& other) const noexcept {
+        return type == other.type && size == other.size && std::memcmp(value, other.value, size) == 0;
+    }
+};
+
+/*!
+ * \brief Calls \p fun for each element of the BSON document \p data, of \p size bytes.
+ *
+ * Iteration stops early if \p fun returns false.
+ *
+ * \return false when the document is malformed, true otherwise.
+ */
+template <typename Fun> bool bson_for_each(const char* data, size_t size, Fun&& fun) {
+    if(data == nullptr || size < 5)
+        return false;
+    const auto doc_size = static_cast<size_t>(bson_read_int32(data));
+    if(doc_size < 5 || doc_size > size || data[doc_size - 1] != '\0')
+        return false;
+    auto it = data + 4;
+    const auto end = data + doc_size - 1;
+    while(it < end) {
+        const auto type = static_cast<bson_type>(*it++);
+        const auto name_size = ::strnlen(it, static_cast<size_t>(end - it));
+        if(it + name_size >= end)
+            return false;
+        const auto value = it + name_size + 1;
+        const auto value_size = bson_value_size(type, value, static_cast<size_t>(end - value));
+        if(value_size == 0 && !bson_is_empty_type(type))
+            return false;
+        if(!fun(bson_element{type, {it, name_size}, value, value_size}))
+            return true;
+        it = value + value_size;
+    }
+    return it == end;
+}
+
+/*!
+ * \brief Finds an element in a BSON document by its dotted field path, e.g. `"a.b.c"`.
+ *
+ * \return The matching element, or nullopt if no element was found or the document is malformed.
+ */
+inline std::experimental::optional<bson_element> bson_find(const char* data, size_t size,
+                                                            std::experimental::string_view path) {
+    const auto dot = path.find('.');
+    const auto head = path.substr(0, dot);
+    std::experimental::optional<bson_element> ret;
+    bson_for_each(data, size, [&](const bson_element& e) {
+        if(e.name != head)
+            return true;
+        if(dot == std::experimental::string_view::npos)
+            ret = e;
+        else if(e.type == bson_type::document || e.type == bson_type::array)
+            ret = bson_find(e.value, e.size, path.substr(dot + 1));
+        return false;
+    });
+    return ret;
+}
+
+//! \copybrief bson_find(const char*,size_t,std::experimental::string_view)
+inline std::experimental::optional<bson_element> bson_find(const std::vector<char>& doc,
+                                                            std::experimental::string_view path) {
+    return bson_find(doc.data(), doc.size(), path);
+}
+
+/*!
+ * \brief Appends BSON elements to a byte vector.
+ *
+ * Documents and arrays are opened with begin_document/begin_array and must be closed with end.
+ * The outermost document is opened on construction and closed by finish.
+ */
+struct bson_builder {
+    //! Starts a new document.
+    bson_builder() { begin(); }
+
+    //! Appends a double element.
+    bson_builder& append(std::experimental::string_view name, double v) {
+        put_header(bson_type::double_, name);
+        m_data.resize(m_data.size() + 8);
+        bson_write_double(m_data.data() + m_data.size() - 8, v);
+        return *this;
+    }
+    //! Appends a 32-bit integer element.
+    bson_builder& append(std::experimental::string_view name, int32_t v) {
+        put_header(bson_type::int32, name);
+        put_int32(v);
+        return *this;
+    }
+    //! Appends a 64-bit integer element.
+    bson_builder& append(std::experimental::string_view name, int64_t v) {
+        put_header(bson_type::int64, name);
+        put_int64(v);
+        return *this;
+    }
+    //! Appends a boolean element.
+    bson_builder& append(std::experimental::string_view name, bool v) {
+        put_header(bson_type::boolean, name);
+        m_data.push_back(v ? 1 : 0);
+        return *this;
+    }
+    //! Appends a UTF-8 string element.
+    bson_builder& append(std::experimental::string_view name, std::experimental::string_view v) {
+        put_header(bson_type::string, name);
+        put_int32(static_cast<int32_t>(v.size() + 1));
+        put_cstring(v);
+        return *this;
+    }
+    //! Appends a UTF-8 string element.
+    bson_builder& append(std::experimental::string_view name, const char* v) {
+        return append(name, std::experimental::string_view{v});
+    }
+    //! Appends an ObjectId element.
+    bson_builder& append_oid(std::experimental::string_view name, const char* oid) {
+        put_header(bson_type::oid, name);
+        m_data.insert(m_data.end(), oid, oid + 12);
+        return *this;
+    }
+    //! Appends a UTC datetime element, of milliseconds since the Unix epoch.
+    bson_builder& append_date(std::experimental::string_view name, int64_t ms) {
+        put_header(bson_type::date, name);
+        put_int64(ms);
+        return *this;
+    }
+    //! Appends a null element.
+    bson_builder& append_null(std::experimental::string_view name) {
+        put_header(bson_type::null, name);
+        return *this;
+    }
+    //! Appends a copy of \p e, renamed to \p name.
+    bson_builder& append(std::experimental::string_view name, const bson_element& e) {
+        put_header(e.type, name);
+        m_data.insert(m_data.end(), e.value, e.value + e.size);
+        return *this;
+    }
+    //! Appends a copy of \p e.
+    bson_builder& append(const bson_element& e) { return append(e.name, e); }
+    //! Appends a complete BSON document as an embedded document.
+    bson_builder& append_document(std::experimental::string_view name, const char* data, size_t size) {
+        put_header(bson_type::document, name);
+        m_data.insert(m_data.end(), data, data + size);
+        return *this;
+    }
+
+    //! Opens an embedded document.
+    bson_builder& begin_document(std::experimental::string_view name) {
+        put_header(bson_type::document, name);
+        begin();
+        return *this;
+    }
+    //! Opens an embedded array. Elements should be named "0", "1", etc.
+    bson_builder& begin_array(std::experimental::string_view name) {
+        put_header(bson_type::array, name);
+        begin();
+        return *this;
+    }
+    //! Closes the most recently opened embedded document or array.
+    bson_builder& end() {
+        assert(m_stack.size() > 1);
+        close();
+        return *this;
+    }
+
+    //! Closes the outermost document and returns it.
+    std::vector<char> finish() {
+        assert(m_stack.size() == 1);
+        close();
+        return std::move(m_data);
+    }
+
+  private:
+    void begin() {
+        m_stack.push_back(m_data.size());
+        put_int32(0);
+    }
+    void close() {
+        m_data.push_back('\0');
+        const auto begin = m_stack.back();
+        m_stack.pop_back();
+        bson_write_int32(m_data.data() + begin, static_cast<int32_t>(m_data.size() - begin));
+    }
+    void put_header(bson_type type, std::experimental::string_view name) {
+        m_data.push_back(static_cast<char>(type));
+        put_cstring(name);
+    }
+    void put_cstring(std::experimental::string_view str) {
+        m_data.insert(m_data.end(), str.begin(), str.end());
+        m_data.push_back('\0');
+    }
+    void put_int32(int32_t v) {
+        m_data.resize(m_data.size() + 4);
+        bson_write_int32(m_data.data() + m_data.size() - 4, v);
+    }
+    void put_int64(int64_t v) {
+        m_data.resize(m_data.size() + 8);
+        bson_write_int64(m_data.data() + m_data.size() - 8, v);
+    }
+
+    std::vector<char> m_data;
+    std::vector<size_t> m_stack;
+};
+
+} // namespace detail
+} // namespace ejdb
+
+#endif // EJDB_BSON_HPP
@@ -25,6 +25,7 @@
 #include <tcejdb/tcutil.h>
 #include <string>
 #include <vector>
+#include <experimental/string_view>
 
 extern "C" {
 
@@ -113,6 +114,9 @@ bool setindex(EJCOLL* coll, const char* ipath, int flags);
 //! Returns ejdbqryexecute(jcoll, q, count, qflags, nullptr)
 EJQRESULT qryexecute(EJCOLL* jcoll, const EJQ* q, uint32_t* count, int qflags);
 
+//! Returns ejdbqryexecute(jcoll, q, count, qflags, log), appending the execution log to \p log if not null
+EJQRESULT qryexecute(EJCOLL* jcoll, const EJQ* q, uint32_t* count, int qflags, std::string* log);
+
 //! Returns ejdbqresultnum(qr)
 int qresultnum(EJQRESULT qr);
 
@@ -146,9 +150,36 @@ bool transtatus(EJCOLL* jcoll, bool* txactive);
 //! Returns transformation of ejdbmeta(jb)
 std::vector<char> metadb(EJDB* jb);
 
+//! Returns ejdbexport(jb, path, cnames, flags, nullptr), with all collections exported when \p cnames is empty
+bool exportdb(EJDB* jb, const char* path, const std::vector<std::string>& cnames, int flags);
+
+//! Returns ejdbimport(jb, path, cnames, flags, nullptr), with all collections imported when \p cnames is empty
+bool importdb(EJDB* jb, const char* path, const std::vector<std::string>& cnames, int flags);
+
+//! Returns the path of the database's metadata file, which prefixes the paths of its collection and index files.
+std::string dbpath(EJDB* jb);
+
+//! Flushes the database's metadata to disk.
+bool syncmeta(EJDB* jb);
+
+//! Acquires the write lock EJDB takes on \p coll for modifications, blocking all other operations on \p coll.
+bool lockcoll(EJCOLL* coll);
+
+//! Releases the lock acquired by lockcoll.
+void unlockcoll(EJCOLL* coll);
+
+//! Returns whether a transaction is in progress on \p coll, which must be locked with lockcoll.
+bool intran_locked(EJCOLL* coll);
+
+//! Flushes \p coll, including its indexes, to disk. \p coll must be locked with lockcoll.
+bool synccoll_locked(EJCOLL* coll);
+
 //! Returns name of a collection.
 std::string collection_name(EJCOLL* coll);
 
+//! Returns name of a collection, referring to EJDB's copy, which is valid for the lifetime of \p coll.
+std::experimental::string_view collection_name_view(EJCOLL* coll) noexcept;
+
 } // namespace c_ejdb
 
 #endif // EJDB_C_EJDB_HPP
@@ -22,12 +22,18 @@
 #ifndef EJDB_HPP
 #define EJDB_HPP
 
+#include <iosfwd>
 #include <memory>
 #include <string>
 #include <system_error>
 #include <vector>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <initializer_list>
 #include <experimental/optional>
+#include <experimental/string_view>
 
 #include <boost/config.hpp>
 
@@ -55,7 +61,10 @@ struct EJQ;
  */
 namespace ejdb {
 struct collection;
+struct pinned_collection;
 struct query;
+struct paged_query;
+struct db_state;
 
 //! Database open modes
 enum class db_mode {
@@ -125,6 +134,18 @@ constexpr inline query_search_mode& operator&=(query_search_mode& lhs, query_sea
     return lhs = lhs & rhs;
 }
 
+//! Format of files written by db::export_to and read by db::import_from.
+enum class export_format {
+    bson = 0,     //!< BSON.
+    json = 1 << 0 //!< JSON.
+};
+
+//! How db::import_from treats existing collections.
+enum class import_mode {
+    update = 1 << 1, //!< Update existing documents with imported ones, keeping all others.
+    replace = 1 << 2 //!< Replace existing collections, including their documents, options and indexes.
+};
+
 //! Error codes. Tokyo Cabinet errors up to errc::miscellaneous.
 enum class errc {
     // Tokyo cabinet error codes
@@ -187,6 +208,323 @@ template <> struct is_error_code_enum<ejdb::errc> : public true_type {};
 
 namespace ejdb {
 
+/*!
+ * \brief Distribution of operation latencies, in nanoseconds.
+ *
+ * Buckets are log-linear, as in HdrHistogram: each power of two is divided into 2^sub_bucket_bits linear
+ * sub-buckets, giving a relative error of at most 1/2^sub_bucket_bits across the whole range.
+ * Latencies of 2^max_magnitude nanoseconds or more are counted in a separate overflow bucket, the last.
+ */
+struct EJPP_EXPORT latency_histogram final {
+    //! log2 of the number of linear sub-buckets per power of two.
+    static constexpr size_t sub_bucket_bits = 4;
+    //! log2 of the smallest latency counted in the overflow bucket.
+    static constexpr size_t max_magnitude = 40;
+    //! Number of buckets, including the overflow bucket.
+    static constexpr size_t bucket_count = ((max_magnitude - sub_bucket_bits + 1) << sub_bucket_bits) + 1;
+
+    //! Returns the index of the bucket counting \p ns.
+    static size_t bucket_index(uint64_t ns) noexcept;
+    //! Returns the largest latency counted in the bucket at \p index.
+    static uint64_t bucket_upper_bound(size_t index) noexcept;
+
+    //! Returns the number of recorded latencies.
+    uint64_t count() const noexcept;
+    //! Returns the mean recorded latency, or zero if none are recorded.
+    double mean() const noexcept;
+    //! Returns an upper bound of the \p p th percentile latency, where \p p is in [0, 100].
+    uint64_t percentile(double p) const noexcept;
+
+    //! Number of latencies counted in each bucket.
+    std::array<uint64_t, bucket_count> buckets{{}};
+    //! Sum of all recorded latencies.
+    uint64_t total_ns{0};
+    //! Largest recorded latency.
+    uint64_t max_ns{0};
+};
+
+/*!
+ * \brief Operation statistics of a db, as returned by db::stats.
+ *
+ * Statistics are only recorded when ejpp is built with `EJPP_STATS` defined (see the `EJPP_ENABLE_STATS` CMake
+ * option), otherwise all are zero.
+ */
+struct db_stats final {
+    //! collection::save_document latencies.
+    latency_histogram save;
+    //! collection::load_document latencies.
+    latency_histogram load;
+    //! collection::remove_document latencies.
+    latency_histogram remove;
+    //! Query execution latencies, including collection::execute_query and collection::for_each.
+    latency_histogram query;
+    //! db::sync and collection::sync latencies.
+    latency_histogram sync;
+    //! collection::transaction_t::commit latencies.
+    latency_histogram commit;
+
+    //! Total size of documents loaded or returned by queries.
+    uint64_t bytes_read{0};
+    //! Total size of documents saved.
+    uint64_t bytes_written{0};
+};
+
+/*!
+ * \brief A query which took longer than the threshold set by db::set_slow_query_threshold.
+ */
+struct slow_query final {
+    //! Name of the queried collection.
+    std::string collection;
+    //! BSON query document.
+    std::vector<char> query;
+    //! BSON documents of `$or` clauses added to the query.
+    std::vector<std::vector<char>> ors;
+    //! BSON hints document, or empty if the query has no hints.
+    std::vector<char> hints;
+    //! Execution time of the query.
+    std::chrono::nanoseconds elapsed;
+    //! Number of documents returned, or matched when counting.
+    uint32_t result_count;
+    //! EJDB's execution log, describing the query plan, including any indexes used.
+    std::string log;
+};
+
+//! Kinds of change recorded in the change log.
+enum class change_op {
+    save,   //!< Document saved, replacing any existing document with the same OID.
+    merge,  //!< Document merged into any existing document with the same OID.
+    remove, //!< Document removed.
+    update  //!< Documents modified by a query with update operators, e.g. `$set`.
+};
+
+/*!
+ * \brief A change to a collection, recorded in the change log.
+ *
+ * \sa db::set_change_log_capacity, db::changes_since
+ */
+struct change final {
+    /*!
+     * \brief Sequence number, increasing by one for each change to the db.
+     *
+     * Assigned after the change is made, so concurrent changes to the same document from different threads may be
+     * numbered in the opposite order to the one they were applied in.
+     */
+    uint64_t seq;
+    //! Kind of change.
+    change_op op;
+    //! Name of the changed collection.
+    std::string collection;
+    //! OID of the saved, merged or removed document. Zeroed for change_op::update.
+    std::array<char, 12> oid;
+    //! Saved or merged document, or for change_op::update, the BSON query document, including its update operators.
+    std::vector<char> document;
+    //! For change_op::update, BSON documents of `$or` clauses added to the query.
+    std::vector<std::vector<char>> ors;
+    //! For change_op::update, the mode the query was executed with.
+    query_search_mode mode;
+    //! For change_op::update, BSON hints the query was executed with, e.g. `$max` or `$orderby`. Empty for none.
+    std::vector<char> hints;
+};
+
+//! Operations reported to a tracer.
+enum class trace_op {
+    close,              //!< db::close
+    sync,               //!< db::sync and collection::sync
+    create_collection,  //!< db::create_collection
+    remove_collection,  //!< db::remove_collection
+    compile_query,      //!< db::create_query, and recompilation by query composition
+    save,               //!< collection::save_document
+    load,               //!< collection::load_document
+    remove,             //!< collection::remove_document
+    set_index,          //!< collection::set_index
+    query,              //!< collection::execute_query, for_each and find_ids, and paged_query::fetch
+    begin_transaction,  //!< collection::transaction_t::start
+    commit_transaction, //!< collection::transaction_t::commit
+    abort_transaction   //!< collection::transaction_t::abort
+};
+
+/*!
+ * \brief Describes an operation passed to tracer::begin and tracer::end.
+ *
+ * The same object is passed to both calls, with bytes, results and error filled in before tracer::end.
+ */
+struct trace_event final {
+    //! Kind of operation.
+    trace_op op;
+    //! Name of the collection operated on, or empty for db operations. Only valid until tracer::end returns.
+    std::experimental::string_view collection;
+    //! Size of documents written (save) or read (load and query).
+    size_t bytes{0};
+    //! Number of documents returned or matched by a query.
+    uint32_t results{0};
+    //! Error resulting from the operation, if any.
+    std::error_code error;
+    //! Set by the tracer in tracer::begin, e.g. to a span, for use in tracer::end.
+    void* context{nullptr};
+};
+
+/*!
+ * \brief Receives begin and end notifications of operations on a db, its collections, queries and transactions.
+ *
+ * Set with db::set_tracer.
+ * Called from the thread performing the operation, so implementations must be thread-safe when the db is shared
+ * between threads.
+ */
+struct EJPP_EXPORT tracer {
+    virtual ~tracer();
+
+    //! Called before an operation is performed.
+    virtual void begin(trace_event& event) noexcept = 0;
+    //! Called after an operation is performed.
+    virtual void end(trace_event& event) noexcept = 0;
+};
+
+//! Description of an index, as returned by db::info.
+struct index_info final {
+    //! Path of the indexed field.
+    std::string field;
+    //! EJDB's internal name for the index.
+    std::string name;
+    //! Type of the index, one of index_mode::number, string, istring or array.
+    index_mode type;
+    //! Number of entries in the index.
+    int64_t records{0};
+    //! Path of the index file.
+    std::string file;
+    //! Size of the index file in bytes.
+    uint64_t file_size{0};
+};
+
+//! Storage options of a collection, as returned by db::info.
+struct collection_options final {
+    //! Number of hash buckets in the collection's table.
+    int64_t buckets{0};
+    //! Maximum number of records cached in memory.
+    int64_t cached_records{0};
+    //! Whether the collection may exceed 2GB.
+    bool large{false};
+    //! Whether records are compressed.
+    bool compressed{false};
+};
+
+//! Description of a collection, as returned by db::info.
+struct collection_info final {
+    //! Name of the collection.
+    std::string name;
+    //! Path of the collection's data file.
+    std::string file;
+    //! Size of the collection's data file in bytes.
+    uint64_t file_size{0};
+    //! Number of documents in the collection.
+    int64_t records{0};
+    //! Storage options.
+    collection_options options;
+    //! Indexes of the collection.
+    std::vector<index_info> indexes;
+};
+
+//! Description of a database, as returned by db::info.
+struct db_info final {
+    //! Path of the database's metadata file.
+    std::string file;
+    //! Size of the metadata file in bytes.
+    uint64_t file_size{0};
+    //! Collections of the database.
+    std::vector<collection_info> collections;
+};
+
+//! Progress of db::export_to or db::import_from, reported after each collection.
+struct transfer_progress final {
+    //! Name of the collection just processed.
+    std::string collection;
+    //! Number of collections processed so far, including this one.
+    size_t completed;
+    //! Number of collections to be processed.
+    size_t total;
+    //! Error processing this collection, if any.
+    std::error_code error;
+};
+
+//! Options of db::export_to.
+struct export_options final {
+    //! Format of the exported files.
+    export_format format{export_format::bson};
+    //! Maximum number of collections exported concurrently, or zero for std::thread::hardware_concurrency.
+    unsigned threads{0};
+    //! Called on the calling thread after each collection is exported.
+    std::function<void(const transfer_progress&)> progress;
+};
+
+//! Options of db::import_from.
+struct import_options final {
+    //! Format of the files to import.
+    export_format format{export_format::bson};
+    //! How to treat collections which already exist.
+    import_mode mode{import_mode::update};
+    //! Called after each collection is imported.
+    std::function<void(const transfer_progress&)> progress;
+};
+
+//! Options of db::replicate_to.
+struct replicate_options final {
+    //! Maximum number of changes applied, or documents copied when catching up, in each transaction.
+    size_t batch_size{1000};
+};
+
+//! Options of collection::set_ttl, pacing the removal of expired documents.
+struct ttl_options final {
+    //! Interval between sweeps of the collection for expired documents.
+    std::chrono::milliseconds sweep_interval{std::chrono::seconds{60}};
+    //! Maximum number of documents removed in each transaction.
+    uint32_t batch_size{100};
+    //! Pause between transactions within a sweep, leaving the collection free for other operations.
+    std::chrono::milliseconds batch_interval{10};
+};
+
+//! Result of collection::upsert.
+struct upsert_result final {
+    //! OID of the saved document.
+    std::array<char, 12> oid;
+    //! Whether the document was inserted, as no document matched, rather than updating a matching document.
+    bool inserted;
+};
+
+//! Limits of a capped collection. \sa collection::set_cap
+struct cap_options final {
+    //! Maximum number of documents, or zero for no limit.
+    uint64_t max_documents{0};
+    //! Maximum total size of documents in bytes, or zero for no limit.
+    uint64_t max_bytes{0};
+    //! Number of documents evicted at once when max_documents is exceeded, so that eviction isn't needed on every save.
+    uint32_t eviction_batch{1};
+};
+
+/*!
+ * \brief Generator of BSON ObjectIds, without a round trip to EJDB.
+ *
+ * Lets documents be given their `_id` before they are saved, e.g. so that documents referring to each other can be
+ * built up front and saved together with collection::save_documents.
+ *
+ * OIDs follow the BSON ObjectId layout: a 4 byte big-endian timestamp in seconds, 5 bytes random to each generator,
+ * and a 3 byte big-endian counter starting at a random value. Generation is lock-free, and thread-safe.
+ */
+struct EJPP_EXPORT oid_generator final {
+    //! Constructs a generator with random unique bytes and counter.
+    oid_generator();
+
+    oid_generator(const oid_generator&) = delete;
+    oid_generator& operator=(const oid_generator&) = delete;
+
+    //! Returns a new OID.
+    std::array<char, 12> next() noexcept;
+    //! Returns \p n new OIDs, reserving their counter values at once.
+    std::vector<std::array<char, 12>> generate(size_t n);
+
+  private:
+    std::array<char, 5> m_unique;
+    std::atomic<uint32_t> m_counter;
+};
+
 /*!
  * \brief Main point of access to EJDB.
  *
@@ -217,7 +555,7 @@ struct EJPP_EXPORT db final {
     //! \copybrief close
     void close();
 
-    //! Returns an existing collection named \p name, or a default constructed ejdb::collection.
+    //! Returns an existing collection named \p name, or a default constructed ejdb::collection. Constant time.
     collection get_collection(const std::string& name, std::error_code& ec) const;
     //! \copybrief get_collection
     collection get_collection(const std::string& name) const;
@@ -250,7 +588,80 @@ struct EJPP_EXPORT db final {
     //! \copybrief metadata
     std::vector<char> metadata();
 
+    //! Returns a typed description of the database, cached until collections, indexes or documents change.
+    std::shared_ptr<const db_info> info(std::error_code& ec) const;
+    //! \copybrief info
+    std::shared_ptr<const db_info> info() const;
+
+    //! Exports \p collections, or all collections when empty, to files in the directory \p path.
+    bool export_to(const std::string& path, const std::vector<std::string>& collections,
+                   const export_options& options, std::error_code& ec) const;
+    //! \copybrief export_to
+    void export_to(const std::string& path, const std::vector<std::string>& collections = {},
+                   const export_options& options = {}) const;
+
+    //! Writes a consistent copy of the database's files to the directory \p dest_dir.
+    bool snapshot(const std::string& dest_dir, std::error_code& ec) const;
+    //! \copybrief snapshot
+    void snapshot(const std::string& dest_dir) const;
+
+    //! Brings the database at \p replica_path up to date with this database, applying changes from the change log.
+    bool replicate_to(const std::string& replica_path, const replicate_options& options, std::error_code& ec) const;
+    //! \copybrief replicate_to
+    void replicate_to(const std::string& replica_path, const replicate_options& options = {}) const;
+
+    //! Imports \p collections, or all collections found when empty, from files in the directory \p path.
+    bool import_from(const std::string& path, const std::vector<std::string>& collections,
+                     const import_options& options, std::error_code& ec);
+    //! \copybrief import_from
+    void import_from(const std::string& path, const std::vector<std::string>& collections = {},
+                     const import_options& options = {});
+
+    //! Sets the maximum total size of results of queries without a `$fields` projection.
+    void set_unprojected_result_limit(size_t bytes) noexcept;
+    //! Returns the maximum total size of results of queries without a `$fields` projection.
+    size_t unprojected_result_limit() const noexcept;
+
+    //! Returns operation statistics, merged from all threads.
+    db_stats stats() const;
+
+    //! Sets the execution time above which queries are recorded in the slow query log.
+    void set_slow_query_threshold(std::chrono::nanoseconds threshold) noexcept;
+    //! Returns the execution time above which queries are recorded in the slow query log.
+    std::chrono::nanoseconds slow_query_threshold() const noexcept;
+    //! Sets the maximum number of queries retained in the slow query log.
+    void set_slow_query_capacity(size_t capacity);
+    //! Sets a function to be passed slow queries, instead of retaining them in the slow query log.
+    void set_slow_query_handler(std::function<void(const slow_query&)> handler);
+    //! Returns the queries retained in the slow query log, oldest first.
+    std::vector<slow_query> slow_queries() const;
+
+    //! Sets the maximum number of changes retained in the change log. Zero disables the change log.
+    void set_change_log_capacity(size_t capacity);
+    //! Returns the changes recorded after sequence number \p seq, oldest first.
+    std::vector<change> changes_since(uint64_t seq, std::error_code& ec) const;
+    //! \copybrief changes_since
+    std::vector<change> changes_since(uint64_t seq) const;
+    //! Returns the sequence number of the most recent change, or zero if none have been recorded.
+    uint64_t last_change_seq() const noexcept;
+
+    //! Sets the tracer to be notified of operations on this db.
+    void set_tracer(std::shared_ptr<tracer> t);
+    //! Returns the tracer notified of operations on this db, if any.
+    std::shared_ptr<tracer> get_tracer() const;
+
+    //! Writes metrics of this db to \p os in the Prometheus text exposition format.
+    bool export_metrics(std::ostream& os, std::error_code& ec) const;
+    //! \copybrief export_metrics
+    void export_metrics(std::ostream& os) const;
+
   private:
+    EJPP_LOCAL static bool copy_collections(db source, db& replica, size_t batch_size,
+                                            std::vector<std::pair<std::string, uint64_t>>& copied,
+                                            std::error_code& ec);
+    EJPP_LOCAL static bool apply_changes(db& replica, std::vector<change>::const_iterator first,
+                                         std::vector<change>::const_iterator last, std::error_code& ec);
+
     std::shared_ptr<EJDB> m_db;
 };
 
@@ -284,6 +695,11 @@ struct EJPP_EXPORT collection final {
     //! Default constructor. Results in an invalid collection, not associated with a db.
     collection() noexcept = default;
 
+    //! Copy constructor. The copy has its own transaction_t, referring to the same EJDB collection.
+    collection(const collection&) noexcept;
+    //! Copy assignment. \copydetails collection(const collection&)
+    collection& operator=(const collection&) noexcept;
+
     //! Returns whether the associated ejdb::db and represented EJDB collection are both valid.
     explicit operator bool() const noexcept;
 
@@ -295,6 +711,18 @@ struct EJPP_EXPORT collection final {
     //! \copybrief save_document(const jbson::document&,bool,std::error_code&)
     std::array<char, 12> save_document(const std::vector<char>& data, bool merge = false);
 
+    //! Saves documents to the collection in a single transaction, returning their OIDs in order.
+    std::vector<std::array<char, 12>> save_documents(const std::vector<std::vector<char>>& docs, bool merge,
+                                                     std::error_code& ec);
+    //! \copybrief save_documents
+    std::vector<std::array<char, 12>> save_documents(const std::vector<std::vector<char>>& docs, bool merge = false);
+
+    //! Saves a document over the first document matching \p match, or as a new document if none match.
+    std::experimental::optional<upsert_result> upsert(const query& match, const std::vector<char>& data, bool merge,
+                                                      std::error_code& ec);
+    //! \copybrief upsert
+    upsert_result upsert(const query& match, const std::vector<char>& data, bool merge = false);
+
     //! Loads a matching document from the collection.
     std::vector<char> load_document(std::array<char, 12> oid, std::error_code& ec) const;
     //! \copybrief load_document
@@ -305,16 +733,36 @@ struct EJPP_EXPORT collection final {
     //! \copybrief remove_document
     void remove_document(std::array<char, 12>);
 
+    //! Removes every document matching \p qry, reading only their OIDs, returning the number removed.
+    uint64_t remove_where(const query& qry, uint32_t batch_size, std::error_code& ec);
+    //! \copybrief remove_where
+    uint64_t remove_where(const query& qry, uint32_t batch_size = 1000);
+
     //! Sets the index for a BSON field in the collection.
     bool set_index(const std::string& ipath, index_mode flags, std::error_code& ec);
     //! \copybrief set_index
     void set_index(const std::string& ipath, index_mode flags);
 
+    //! Removes documents in the background once the date in field \p ipath is more than \p ttl in the past.
+    bool set_ttl(const std::string& ipath, std::chrono::seconds ttl, const ttl_options& options,
+                 std::error_code& ec);
+    //! \copybrief set_ttl
+    void set_ttl(const std::string& ipath, std::chrono::seconds ttl, const ttl_options& options = {});
+    //! Stops removing expired documents, as set by set_ttl, once any batch in progress is removed.
+    void clear_ttl() noexcept;
+
+    //! Limits the collection's size, evicting the oldest documents when saves exceed the limits.
+    bool set_cap(const cap_options& options, std::error_code& ec);
+    //! \copybrief set_cap
+    void set_cap(const cap_options& options);
+    //! Removes the limits set by set_cap.
+    void clear_cap() noexcept;
+
     /*!
      * \brief Executes a query on the collection.
      *
      * \tparam flags The mode by which to execute the query. Determines return type.
-     * \sa detail::query_return_type
+     * \sa detail::query_return_type, db::set_unprojected_result_limit
      */
     template <query_search_mode flags = query_search_mode::normal>
     detail::query_return_type<flags> execute_query(const query&);
@@ -322,6 +770,16 @@ struct EJPP_EXPORT collection final {
     //! Returns all documents in the collection.
     std::vector<std::vector<char>> get_all();
 
+    //! Executes a query on the collection, passing each matching document to \p visitor without copying it.
+    uint32_t for_each(const query& qry, const std::function<bool(const char* data, size_t size)>& visitor);
+
+    //! Executes a query on the collection, returning only the OIDs of matching documents.
+    std::vector<std::array<char, 12>> find_ids(const query& qry);
+
+    //! Creates a paged_query over documents matching \p filter, ordered by the numeric field \p sort_key.
+    paged_query paginate(const std::vector<char>& filter, const std::string& sort_key, uint32_t page_size,
+                         bool descending = false) const;
+
     //! Synchronises the EJDB database to disk.
     bool sync(std::error_code& ec) noexcept;
     //! \copybrief sync
@@ -329,6 +787,11 @@ struct EJPP_EXPORT collection final {
 
     //! Returns the name of the collection.
     std::string name() const;
+    //! Returns the name of the collection, without copying it.
+    std::experimental::string_view name_view() const noexcept;
+
+    //! Returns a pinned_collection, holding the parent db alive until it's destroyed.
+    pinned_collection pin() const noexcept;
 
     struct transaction_t;
 
@@ -337,10 +800,12 @@ struct EJPP_EXPORT collection final {
 
   private:
     friend struct db;
-    EJPP_LOCAL collection(std::weak_ptr<EJDB> m_db, EJCOLL* m_coll) noexcept;
+    EJPP_LOCAL collection(std::weak_ptr<EJDB> m_db, EJCOLL* m_coll, std::experimental::string_view m_name) noexcept;
 
     std::weak_ptr<EJDB> m_db;
     EJCOLL* m_coll{nullptr};
+    std::experimental::string_view m_name;
+    std::shared_ptr<db_state> m_state;
 
   public:
     /*!
@@ -400,6 +865,72 @@ extern template EJPP_EXPORT detail::query_return_type<query_search_mode::count_o
 collection::execute_query<query_search_mode::count_only | query_search_mode::first_only>(const query& qry);
 #endif // DOXYGEN_SHOULD_SKIP_THIS
 
+/*!
+ * \brief A collection with a strong reference to its parent db.
+ *
+ * Obtained via collection::pin.
+ * ejdb::collection only holds a weak reference to its parent db, which is locked by operations that need it alive,
+ * at the cost of atomic reference count updates shared by every thread using the db.
+ * A pinned_collection locks the parent db once, on creation, so its operations perform no reference counting.
+ * Intended to be held for the duration of a unit of work, e.g. a request, rather than for the lifetime of a program.
+ *
+ * Operations are performed as part of the collection's transaction, if one is in progress.
+ */
+struct EJPP_EXPORT pinned_collection final {
+    //! Default constructor. Results in an invalid pinned_collection, not associated with a db.
+    pinned_collection() noexcept = default;
+
+    //! Returns whether the pinned collection is valid.
+    explicit operator bool() const noexcept;
+
+    //! \copydoc collection::save_document(const std::vector<char>&,std::error_code&)
+    std::experimental::optional<std::array<char, 12>> save_document(const std::vector<char>& data, std::error_code& ec);
+    //! \copydoc collection::save_document(const std::vector<char>&,bool,std::error_code&)
+    std::experimental::optional<std::array<char, 12>> save_document(const std::vector<char>& data, bool merge,
+                                                                    std::error_code& ec);
+    //! \copydoc collection::save_document(const std::vector<char>&,bool)
+    std::array<char, 12> save_document(const std::vector<char>& data, bool merge = false);
+
+    //! \copydoc collection::load_document(std::array<char, 12>,std::error_code&) const
+    std::vector<char> load_document(std::array<char, 12> oid, std::error_code& ec) const;
+    //! \copydoc collection::load_document(std::array<char, 12>) const
+    std::vector<char> load_document(std::array<char, 12> oid) const;
+
+    //! \copydoc collection::remove_document(std::array<char, 12>,std::error_code&)
+    bool remove_document(std::array<char, 12>, std::error_code& ec) noexcept;
+    //! \copydoc collection::remove_document(std::array<char, 12>)
+    void remove_document(std::array<char, 12>);
+
+    //! \copydoc collection::execute_query
+    template <query_search_mode flags = query_search_mode::normal>
+    detail::query_return_type<flags> execute_query(const query&);
+
+    //! \copydoc collection::for_each
+    uint32_t for_each(const query& qry, const std::function<bool(const char* data, size_t size)>& visitor);
+
+    //! \copydoc collection::find_ids
+    std::vector<std::array<char, 12>> find_ids(const query& qry);
+
+  private:
+    friend struct collection;
+    EJPP_LOCAL pinned_collection(std::shared_ptr<EJDB> m_db, EJCOLL* m_coll, db_state* m_state) noexcept;
+
+    std::shared_ptr<EJDB> m_db;
+    EJCOLL* m_coll{nullptr};
+    db_state* m_state{nullptr};
+};
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+extern template EJPP_EXPORT detail::query_return_type<query_search_mode::normal>
+pinned_collection::execute_query<query_search_mode::normal>(const query& qry);
+extern template EJPP_EXPORT detail::query_return_type<query_search_mode::count_only>
+pinned_collection::execute_query<query_search_mode::count_only>(const query& qry);
+extern template EJPP_EXPORT detail::query_return_type<query_search_mode::first_only>
+pinned_collection::execute_query<query_search_mode::first_only>(const query& qry);
+extern template EJPP_EXPORT detail::query_return_type<query_search_mode::count_only | query_search_mode::first_only>
+pinned_collection::execute_query<query_search_mode::count_only | query_search_mode::first_only>(const query& qry);
+#endif // DOXYGEN_SHOULD_SKIP_THIS
+
 /*!
  * \brief Class representing an EJDB query.
  *
@@ -416,32 +947,46 @@ struct EJPP_EXPORT query final {
     //! Returns whether the associated ejdb::db and represented EJDB query are both valid.
     explicit operator bool() const noexcept;
 
-    //! In-place `$and` operator. \warning Unimplemented.
+    //! In-place `$and` operator with BSON document as operand.
     query& operator&=(const std::vector<char>&)&;
-    //! In-place `$and` operator. \warning Unimplemented.
+    //! In-place `$and` operator with BSON document as operand. Rvalue overload.
     query&& operator&=(const std::vector<char>&)&&;
-    //! In-place `$and` operator. \warning Unimplemented.
-    query& operator&=(query) & noexcept;
-    //! In-place `$and` operator. \warning Unimplemented.
-    query&& operator&=(query) && noexcept;
+    //! In-place `$and` operator with ejdb::query as operand.
+    query& operator&=(query)&;
+    //! In-place `$and` operator with ejdb::query as operand. Rvalue overload.
+    query&& operator&=(query)&&;
 
     //! In-place `$or` operator with BSON document as operand.
     query& operator|=(const std::vector<char>&)&;
     //! In-place `$or` operator with BSON document as operand. Rvalue overload.
     query&& operator|=(const std::vector<char>&)&&;
-    //! In-place `$or` operator with ejdb::query as operand. \warning Unimplemented.
-    query& operator|=(query) & noexcept;
-    //! In-place `$or` operator with ejdb::query as operand. Rvalue overload. \warning Unimplemented.
-    query&& operator|=(query) && noexcept;
+    //! In-place `$or` operator with ejdb::query as operand.
+    query& operator|=(query)&;
+    //! In-place `$or` operator with ejdb::query as operand. Rvalue overload.
+    query&& operator|=(query)&&;
 
     //! Sets hints for a query.
     query& set_hints(const std::vector<char>&)&;
     //! \copydoc set_hints
     query&& set_hints(const std::vector<char>&)&&;
 
+    //! Restricts the fields of matching documents, via the `$fields` hint.
+    query& project(const std::vector<std::string>& fields)&;
+    //! \copybrief project(const std::vector<std::string>&)&
+    query&& project(const std::vector<std::string>& fields)&&;
+    //! \copybrief project(const std::vector<std::string>&)&
+    query& project(std::initializer_list<std::string> fields)&;
+    //! \copybrief project(const std::vector<std::string>&)&
+    query&& project(std::initializer_list<std::string> fields)&&;
+
+    //! Returns whether results are restricted by a `$fields` hint.
+    bool is_projected() const noexcept;
+
   private:
     friend struct db;
     friend struct collection;
+    friend struct pinned_collection;
+    friend struct paged_query;
     EJPP_LOCAL query(std::weak_ptr<EJDB> m_db, EJQ* m_qry) noexcept;
 
     std::weak_ptr<EJDB> m_db;
@@ -450,6 +995,90 @@ struct EJPP_EXPORT query final {
         void operator()(EJQ* ptr) const noexcept;
     };
     std::unique_ptr<EJQ, eqry_deleter> m_qry;
+
+    EJPP_LOCAL void apply_hints();
+    EJPP_LOCAL void recompile(std::vector<char> source);
+
+    std::vector<char> m_source;
+    std::vector<std::vector<char>> m_ors;
+    std::vector<char> m_hints;
+    //! m_hints with m_projection as `$fields`, as given to EJDB.
+    std::vector<char> m_applied_hints;
+    std::vector<std::string> m_projection;
+    bool m_projected{false};
+    bool m_updates{false};
+};
+
+/*!
+ * \brief Opaque position within the results of a paged_query.
+ *
+ * Holds the sort key value and OID of the last document of a page, so that the following page can be fetched with a
+ * range predicate rather than `$skip`.
+ * Tokens can be stored via data() and later restored, allowing a client to resume paging across requests.
+ */
+struct EJPP_EXPORT page_token final {
+    //! Default constructor. Refers to the first page.
+    page_token() noexcept = default;
+    //! Restores a token previously obtained from data().
+    explicit page_token(std::vector<char> data) noexcept;
+
+    //! Returns whether the token refers to a page other than the first.
+    explicit operator bool() const noexcept;
+
+    //! Returns the serialised token.
+    const std::vector<char>& data() const noexcept;
+
+  private:
+    friend struct paged_query;
+    std::vector<char> m_data;
+};
+
+/*!
+ * \brief Class representing a query whose results are fetched one page at a time, using keyset pagination.
+ *
+ * Valid paged queries can only be created via ejdb::collection::paginate.
+ *
+ * Each page is fetched with a predicate on the sort key and OID, continuing after the position held by a
+ * page_token, so that every page costs the same to fetch regardless of its depth. For this to hold, the sort key
+ * should be indexed with ejdb::index_mode::number.
+ *
+ * Documents are ordered by the sort key, then by OID, so that documents sharing a sort key value are never skipped or
+ * repeated across pages.
+ *
+ * Should the parent ejdb::db object expire before the paged query, all operations performed on or with the paged query
+ * will fail, with any `std::error_code`s set to `std::errc::operation_not_permitted` (`EPERM`).
+ */
+struct EJPP_EXPORT paged_query final {
+    //! Default constructor. Results in an invalid paged query, not associated with a db.
+    paged_query() noexcept = default;
+
+    //! Returns whether the associated ejdb::db and ejdb::collection are both valid.
+    explicit operator bool() const noexcept;
+
+    //! A single page of results.
+    struct page {
+        //! Matching documents, no more than the page size.
+        std::vector<std::vector<char>> documents;
+        //! Position of the following page. Evaluates to false when this is the last page.
+        page_token next;
+    };
+
+    //! Fetches the page beginning at \p from.
+    page fetch(const page_token& from, std::error_code& ec) const;
+    //! \copybrief fetch
+    page fetch(const page_token& from = {}) const;
+
+  private:
+    friend struct collection;
+    EJPP_LOCAL paged_query(std::weak_ptr<EJDB> db, EJCOLL* coll, std::vector<char> filter, std::string sort_key,
+                           uint32_t page_size, bool descending);
+
+    std::weak_ptr<EJDB> m_db;
+    EJCOLL* m_coll{nullptr};
+    std::vector<char> m_filter;
+    std::string m_sort_key;
+    uint32_t m_page_size{0};
+    bool m_descending{false};
 };
 
 //! Tag type for expressing an adopted transaction.
@@ -0,0 +1,398 @@
+/******************************************************************************
+ *
+ * C++11 wrapper for EJDB (http://ejdb.org)
+ * Copyright (C) 2013 Christian Manning
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+ * USA
+ *****************************************************************************/
+
+#ifndef EJDB_STATIC_QUERY_HPP
+#define EJDB_STATIC_QUERY_HPP
+
+#include <array>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <ejpp/bson.hpp>
+
+/*!
+ * \brief Compile-time query builder.
+ * \namespace ejdb::q
+ *
+ * Queries are expressed as conditions on fields, joined with `&&`. The BSON layout of the query, including all field
+ * names, operators and offsets of values, is computed at compile time. Building the query document at runtime only
+ * copies the precomputed layout and writes values into it.
+ *
+ * \code
+ * using namespace ejdb::q::literals;
+ * auto expr = "age"_f > 30 && "score"_f <= 2.5 && "active"_f == true;
+ * ejdb::query qry = my_db.create_query(expr.bson());
+ * \endcode
+ *
+ * Values must have a fixed size: booleans, integers, floating point numbers, or OIDs (`std::array<char, 12>`).
+ * Each field may only appear once per query; use between() for ranges.
+ */
+namespace ejdb {
+namespace q {
+
+//! Compile-time string, used for field names and operators.
+template <char... Cs> struct chars {
+    //! Length of the string, excluding null terminator.
+    static constexpr size_t size = sizeof...(Cs);
+};
+
+/*!
+ * \brief Implementation details of the compile-time query builder.
+ * \namespace ejdb::q::detail
+ */
+namespace detail {
+
+//! Fixed-size byte array, writable in constant expressions.
+template <size_t N> struct byte_array {
+    char data[N];
+
+    //! Writable element access.
+    constexpr char& operator[](size_t i) noexcept { return data[i]; }
+    //! Element access.
+    constexpr const char& operator[](size_t i) const noexcept { return data[i]; }
+};
+
+//! Writes \p v as a little-endian 32-bit integer at \p pos.
+template <size_t N> constexpr void put_int32(byte_array<N>& b, size_t pos, uint32_t v) noexcept {
+    for(size_t i = 0; i < 4; ++i)
+        b[pos + i] = static_cast<char>((v >> (8 * i)) & 0xff);
+}
+
+//! Writes a null terminated string at \p pos. Returns the position following the terminator.
+template <size_t N, char... Cs> constexpr size_t put_cstring(byte_array<N>& b, size_t pos, chars<Cs...>) noexcept {
+    const char str[] = {Cs..., '\0'};
+    for(size_t i = 0; i < sizeof...(Cs) + 1; ++i)
+        b[pos + i] = str[i];
+    return pos + sizeof...(Cs) + 1;
+}
+
+//! BSON representation of value types.
+template <typename T, typename Enable = void> struct value_traits;
+
+//! Booleans are stored as BSON booleans.
+template <> struct value_traits<bool> {
+    using type = bool;
+    static constexpr ejdb::detail::bson_type bson_type = ejdb::detail::bson_type::boolean;
+    static constexpr size_t size = 1;
+    static void write(char* out, bool v) noexcept { *out = v ? 1 : 0; }
+};
+
+//! Integers of up to 32 bits are stored as BSON int32s.
+template <typename T>
+struct value_traits<T, std::enable_if_t<std::is_integral<T>::value && !std::is_same<T, bool>::value &&
+                                        (sizeof(T) < 4 || (sizeof(T) == 4 && std::is_signed<T>::value))>> {
+    using type = int32_t;
+    static constexpr ejdb::detail::bson_type bson_type = ejdb::detail::bson_type::int32;
+    static constexpr size_t size = 4;
+    static void write(char* out, int32_t v) noexcept { ejdb::detail::bson_write_int32(out, v); }
+};
+
+//! Larger integers, and unsigned 32-bit integers, are stored as BSON int64s.
+template <typename T>
+struct value_traits<T, std::enable_if_t<std::is_integral<T>::value && !std::is_same<T, bool>::value &&
+                                        (sizeof(T) > 4 || (sizeof(T) == 4 && std::is_unsigned<T>::value))>> {
+    using type = int64_t;
+    static constexpr ejdb::detail::bson_type bson_type = ejdb::detail::bson_type::int64;
+    static constexpr size_t size = 8;
+    static void write(char* out, int64_t v) noexcept { ejdb::detail::bson_write_int64(out, v); }
+};
+
+//! Floating point numbers are stored as BSON doubles.
+template <typename T> struct value_traits<T, std::enable_if_t<std::is_floating_point<T>::value>> {
+    using type = double;
+    static constexpr ejdb::detail::bson_type bson_type = ejdb::detail::bson_type::double_;
+    static constexpr size_t size = 8;
+    static void write(char* out, double v) noexcept { ejdb::detail::bson_write_double(out, v); }
+};
+
+//! OIDs are stored as BSON ObjectIds.
+template <> struct value_traits<std::array<char, 12>> {
+    using type = std::array<char, 12>;
+    static constexpr ejdb::detail::bson_type bson_type = ejdb::detail::bson_type::oid;
+    static constexpr size_t size = 12;
+    static void write(char* out, const std::array<char, 12>& v) noexcept { std::memcpy(out, v.data(), 12); }
+};
+
+//! Normalised value type for \p T.
+template <typename T> using value_type = typename value_traits<std::decay_t<T>>::type;
+
+//! Marker for equality, which is expressed without an operator.
+struct no_op {};
+
+/*!
+ * \brief Condition on field \p Name, with operator \p Op and a single value of type \p T.
+ *
+ * Element layout: `{Name: value}`, or `{Name: {Op: value}}`.
+ */
+template <typename Name, typename Op, typename T> struct condition {
+    using name = Name;
+    using traits = value_traits<T>;
+
+    T value;
+
+    //! Size of the element, excluding the operator document.
+    static constexpr size_t head_size = 1 + Name::size + 1;
+
+    //! Size of the whole element.
+    static constexpr size_t size() noexcept { return head_size + op_size(Op{}); }
+
+    //! Writes the element skeleton, i.e. everything but the value, at \p pos.
+    template <size_t N> static constexpr void layout(byte_array<N>& b, size_t pos) noexcept {
+        layout(b, pos, Op{});
+    }
+
+    //! Writes the value into a buffer laid out by layout, where \p out points to the beginning of the element.
+    void patch(char* out) const noexcept { traits::write(out + value_offset(Op{}), value); }
+
+  private:
+    static constexpr size_t op_size(no_op) noexcept { return traits::size; }
+    template <typename O> static constexpr size_t op_size(O) noexcept {
+        return 4 + 1 + O::size + 1 + traits::size + 1;
+    }
+
+    static constexpr size_t value_offset(no_op) noexcept { return head_size; }
+    template <typename O> static constexpr size_t value_offset(O) noexcept { return head_size + 4 + 1 + O::size + 1; }
+
+    template <size_t N> static constexpr void layout(byte_array<N>& b, size_t pos, no_op) noexcept {
+        b[pos] = static_cast<char>(traits::bson_type);
+        put_cstring(b, pos + 1, Name{});
+    }
+    template <size_t N, typename O> static constexpr void layout(byte_array<N>& b, size_t pos, O) noexcept {
+        b[pos] = static_cast<char>(ejdb::detail::bson_type::document);
+        pos = put_cstring(b, pos + 1, Name{});
+        put_int32(b, pos, static_cast<uint32_t>(op_size(O{})));
+        b[pos + 4] = static_cast<char>(traits::bson_type);
+        pos = put_cstring(b, pos + 5, O{}) + traits::size;
+        b[pos] = '\0';
+    }
+};
+
+/*!
+ * \brief Range condition on field \p Name, with two values of type \p T.
+ *
+ * Element layout: `{Name: {"$bt": [lower, upper]}}`.
+ */
+template <typename Name, typename T> struct between_condition {
+    using name = Name;
+    using traits = value_traits<T>;
+
+    T lower;
+    T upper;
+
+    static constexpr size_t head_size = 1 + Name::size + 1;
+    // {"$bt": [lower, upper]}
+    static constexpr size_t array_size = 4 + 2 * (1 + 2 + traits::size) + 1;
+    static constexpr size_t op_size = 4 + 1 + 4 + array_size + 1;
+
+    //! Size of the whole element.
+    static constexpr size_t size() noexcept { return head_size + op_size; }
+
+    //! Writes the element skeleton, i.e. everything but the values, at \p pos.
+    template <size_t N> static constexpr void layout(byte_array<N>& b, size_t pos) noexcept {
+        b[pos] = static_cast<char>(ejdb::detail::bson_type::document);
+        pos = put_cstring(b, pos + 1, Name{});
+        put_int32(b, pos, static_cast<uint32_t>(op_size));
+        b[pos + 4] = static_cast<char>(ejdb::detail::bson_type::array);
+        pos = put_cstring(b, pos + 5, chars<'$', 'b', 't'>{});
+        put_int32(b, pos, static_cast<uint32_t>(array_size));
+        pos += 4;
+        b[pos] = static_cast<char>(traits::bson_type);
+        pos = put_cstring(b, pos + 1, chars<'0'>{}) + traits::size;
+        b[pos] = static_cast<char>(traits::bson_type);
+        pos = put_cstring(b, pos + 1, chars<'1'>{}) + traits::size;
+        b[pos] = '\0';
+        b[pos + 1] = '\0';
+    }
+
+    //! Writes the values into a buffer laid out by layout, where \p out points to the beginning of the element.
+    void patch(char* out) const noexcept {
+        const auto first = head_size + 4 + 1 + 4 + 4 + 1 + 2;
+        traits::write(out + first, lower);
+        traits::write(out + first + 3 + traits::size, upper);
+    }
+};
+
+//! Whether \p T is the same type as any of \p Ts.
+template <typename T, typename... Ts> struct contains : std::false_type {};
+template <typename T, typename U, typename... Ts>
+struct contains<T, U, Ts...> : std::integral_constant<bool, std::is_same<T, U>::value || contains<T, Ts...>::value> {};
+
+//! Whether all of \p Ts are distinct types.
+template <typename... Ts> struct all_unique : std::true_type {};
+template <typename T, typename... Ts>
+struct all_unique<T, Ts...>
+    : std::integral_constant<bool, !contains<T, Ts...>::value && all_unique<Ts...>::value> {};
+
+//! Returns the total size of the elements of conditions \p Conds.
+template <typename... Conds> constexpr size_t elements_size() noexcept {
+    const size_t sizes[] = {Conds::size()..., 0};
+    size_t ret{0};
+    for(auto s : sizes)
+        ret += s;
+    return ret;
+}
+
+//! Returns the offset of the element of the \p I th condition of \p Conds, within the whole document.
+template <size_t I, typename... Conds> constexpr size_t element_offset() noexcept {
+    const size_t sizes[] = {Conds::size()..., 0};
+    size_t pos{4};
+    for(size_t i = 0; i < I; ++i)
+        pos += sizes[i];
+    return pos;
+}
+
+//! Returns the document layout of conditions \p Conds, with all values zeroed.
+template <typename... Conds> constexpr byte_array<4 + elements_size<Conds...>() + 1> make_layout() noexcept {
+    constexpr auto size = 4 + elements_size<Conds...>() + 1;
+    byte_array<size> b{};
+    put_int32(b, 0, static_cast<uint32_t>(size));
+    const size_t sizes[] = {Conds::size()..., 0};
+    size_t pos{4};
+    size_t i{0};
+    const int expand[] = {(Conds::layout(b, pos), pos += sizes[i++], 0)..., 0};
+    (void)expand;
+    b[size - 1] = '\0';
+    return b;
+}
+
+} // namespace detail
+
+/*!
+ * \brief A query document made up of conditions \p Conds, with a layout fixed at compile time.
+ *
+ * Produced by conditions on ejdb::q::field, joined with `&&`.
+ */
+template <typename... Conds> struct expression {
+    static_assert(detail::all_unique<typename Conds::name...>::value,
+                  "each field may only appear once in an expression, use between() for ranges");
+
+    //! Total size of the query document.
+    static constexpr size_t size = 4 + detail::elements_size<Conds...>() + 1;
+
+    //! Conditions, holding their values.
+    std::tuple<Conds...> conditions;
+
+    //! Returns the query document in a fixed-size buffer.
+    std::array<char, size> buffer() const noexcept {
+        std::array<char, size> ret;
+        std::memcpy(ret.data(), layout.data, size);
+        patch(ret.data(), std::index_sequence_for<Conds...>{});
+        return ret;
+    }
+
+    //! Returns the query document, e.g. for use with db::create_query.
+    std::vector<char> bson() const {
+        std::vector<char> ret(size);
+        std::memcpy(ret.data(), layout.data, size);
+        patch(ret.data(), std::index_sequence_for<Conds...>{});
+        return ret;
+    }
+
+    //! Precomputed document layout, with values zeroed.
+    static constexpr detail::byte_array<size> layout = detail::make_layout<Conds...>();
+
+  private:
+    template <size_t... Is> void patch(char* out, std::index_sequence<Is...>) const noexcept {
+        const int expand[] = {(std::get<Is>(conditions).patch(out + detail::element_offset<Is, Conds...>()), 0)..., 0};
+        (void)expand;
+    }
+};
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+template <typename... Conds> constexpr detail::byte_array<expression<Conds...>::size> expression<Conds...>::layout;
+#endif // DOXYGEN_SHOULD_SKIP_THIS
+
+//! Joins two expressions. The resulting document matches only when both do.
+template <typename... Lhs, typename... Rhs>
+expression<Lhs..., Rhs...> operator&&(expression<Lhs...> lhs, expression<Rhs...> rhs) {
+    return {std::tuple_cat(std::move(lhs.conditions), std::move(rhs.conditions))};
+}
+
+/*!
+ * \brief A document field, named by \p Cs, to build conditions on.
+ *
+ * Field paths may be dotted, e.g. `field<'a', '.', 'b'>`.
+ */
+template <char... Cs> struct field {
+    using name = chars<Cs...>;
+
+    //! Field equals \p v.
+    template <typename T>
+    expression<detail::condition<name, detail::no_op, detail::value_type<T>>> operator==(T v) const {
+        return {std::make_tuple(detail::condition<name, detail::no_op, detail::value_type<T>>{v})};
+    }
+    //! Field does not equal \p v. `{field: {"$not": v}}`
+    template <typename T> auto operator!=(T v) const { return make<'$', 'n', 'o', 't'>(v); }
+    //! Field is greater than \p v. `{field: {"$gt": v}}`
+    template <typename T> auto operator>(T v) const { return make<'$', 'g', 't'>(v); }
+    //! Field is greater than or equal to \p v. `{field: {"$gte": v}}`
+    template <typename T> auto operator>=(T v) const { return make<'$', 'g', 't', 'e'>(v); }
+    //! Field is less than \p v. `{field: {"$lt": v}}`
+    template <typename T> auto operator<(T v) const { return make<'$', 'l', 't'>(v); }
+    //! Field is less than or equal to \p v. `{field: {"$lte": v}}`
+    template <typename T> auto operator<=(T v) const { return make<'$', 'l', 't', 'e'>(v); }
+
+    //! Field is between \p lower and \p upper, inclusive. `{field: {"$bt": [lower, upper]}}`
+    template <typename T>
+    expression<detail::between_condition<name, detail::value_type<T>>> between(T lower, T upper) const {
+        return {std::make_tuple(detail::between_condition<name, detail::value_type<T>>{lower, upper})};
+    }
+
+  private:
+    template <char... Op, typename T>
+    expression<detail::condition<name, chars<Op...>, detail::value_type<T>>> make(T v) const {
+        return {std::make_tuple(detail::condition<name, chars<Op...>, detail::value_type<T>>{v})};
+    }
+};
+
+/*!
+ * \brief User-defined literals for ejdb::q.
+ * \namespace ejdb::q::literals
+ */
+namespace literals {
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#if defined(__clang__)
+#pragma GCC diagnostic ignored "-Wgnu-string-literal-operator-template"
+#endif
+/*!
+ * \brief Creates an ejdb::q::field from a string literal, e.g. `"age"_f`.
+ *
+ * Relies on string literal operator templates, a GNU extension supported by GCC and Clang.
+ */
+template <typename CharT, CharT... Cs> constexpr field<Cs...> operator""_f() noexcept {
+    static_assert(std::is_same<CharT, char>::value, "field names must be narrow strings");
+    return {};
+}
+#pragma GCC diagnostic pop
+#endif
+
+} // namespace literals
+
+} // namespace q
+} // namespace ejdb
+
+#endif // EJDB_STATIC_QUERY_HPP
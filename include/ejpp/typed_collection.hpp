@@ -0,0 +1,525 @@
+/******************************************************************************
+ *
+ * C++11 wrapper for EJDB (http://ejdb.org)
+ * Copyright (C) 2013 Christian Manning
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+ * USA
+ *****************************************************************************/
+
+#ifndef EJDB_TYPED_COLLECTION_HPP
+#define EJDB_TYPED_COLLECTION_HPP
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <experimental/optional>
+#include <experimental/string_view>
+
+#include <boost/preprocessor/punctuation/comma_if.hpp>
+#include <boost/preprocessor/seq/for_each_i.hpp>
+#include <boost/preprocessor/stringize.hpp>
+#include <boost/preprocessor/variadic/to_seq.hpp>
+
+#include <ejpp/bson.hpp>
+#include <ejpp/ejdb.hpp>
+
+namespace ejdb {
+
+/*!
+ * \brief Describes how a type maps to a BSON document.
+ *
+ * Specialisations must define a static function `fields()`, returning a tuple of fields created with ejdb::make_field.
+ * EJPP_DOCUMENT can be used to define a specialisation mapping members to fields of the same name.
+ *
+ * \code
+ * struct person {
+ *     std::array<char, 12> id;
+ *     std::string name;
+ *     int age;
+ * };
+ *
+ * namespace ejdb {
+ * template <> struct document_traits<person> {
+ *     static auto fields() {
+ *         return std::make_tuple(make_field("_id", &person::id), make_field("name", &person::name),
+ *                                make_field("age", &person::age));
+ *     }
+ * };
+ * }
+ * \endcode
+ */
+template <typename T> struct document_traits;
+
+//! A data member \p member of \p C, mapped to the BSON field \p name.
+template <typename C, typename M> struct member_field {
+    //! Type of the data member.
+    using member_type = M;
+
+    //! Name of the BSON field.
+    std::experimental::string_view name;
+    //! Pointer to the data member.
+    M C::*member;
+};
+
+//! Maps the data member \p member to the BSON field \p name.
+template <typename C, typename M, size_t N>
+constexpr member_field<C, M> make_field(const char (&name)[N], M C::*member) noexcept {
+    return {{name, N - 1}, member};
+}
+
+namespace detail {
+
+template <typename...> struct make_void { using type = void; };
+
+//! Whether document_traits is specialised for \p T.
+template <typename T, typename = void> struct is_document : std::false_type {};
+template <typename T>
+struct is_document<T, typename make_void<decltype(document_traits<T>::fields())>::type> : std::true_type {};
+
+//! Calls \p fun with each element of \p tup.
+template <typename Tuple, typename Fun, size_t... Is>
+void for_each_field(Tuple&& tup, Fun&& fun, std::index_sequence<Is...>) {
+    const int expand[] = {(fun(std::get<Is>(tup)), 0)..., 0};
+    (void)expand;
+}
+
+//! \copydoc for_each_field
+template <typename Tuple, typename Fun> void for_each_field(Tuple&& tup, Fun&& fun) {
+    for_each_field(std::forward<Tuple>(tup), std::forward<Fun>(fun),
+                   std::make_index_sequence<std::tuple_size<std::decay_t<Tuple>>::value>{});
+}
+
+/*!
+ * \brief Encodes and decodes values of type \p T as BSON element values.
+ *
+ * Specialisations define:
+ *  - `bson_type type()`
+ *  - `bool present(const T&)`, whether the element should be written at all.
+ *  - `size_t size(const T&)`, size of the encoded value.
+ *  - `char* write(char* out, const T&)`, returning the end of the written value.
+ *  - `bool read(const bson_element&, T&)`
+ */
+template <typename T, typename Enable = void> struct value_codec;
+
+//! Returns whether \p e is numeric and, if so, its value converted to \p T in \p out.
+template <typename T> bool read_number(const bson_element& e, T& out) noexcept {
+    switch(e.type) {
+        case bson_type::int32:
+            out = static_cast<T>(bson_read_int32(e.value));
+            return true;
+        case bson_type::int64:
+            out = static_cast<T>(bson_read_int64(e.value));
+            return true;
+        case bson_type::double_:
+            out = static_cast<T>(bson_read_double(e.value));
+            return true;
+        default:
+            return false;
+    }
+}
+
+template <> struct value_codec<bool> {
+    static constexpr bson_type type(const bool&) noexcept { return bson_type::boolean; }
+    static constexpr bool present(const bool&) noexcept { return true; }
+    static constexpr size_t size(const bool&) noexcept { return 1; }
+    static char* write(char* out, bool v) noexcept {
+        *out = v ? 1 : 0;
+        return out + 1;
+    }
+    static bool read(const bson_element& e, bool& out) noexcept {
+        if(e.type != bson_type::boolean)
+            return false;
+        out = *e.value != 0;
+        return true;
+    }
+};
+
+template <typename T>
+struct value_codec<T, std::enable_if_t<std::is_integral<T>::value && !std::is_same<T, bool>::value>> {
+    static constexpr bool wide = sizeof(T) > 4 || (sizeof(T) == 4 && std::is_unsigned<T>::value);
+
+    static constexpr bson_type type(const T&) noexcept { return wide ? bson_type::int64 : bson_type::int32; }
+    static constexpr bool present(const T&) noexcept { return true; }
+    static constexpr size_t size(const T&) noexcept { return wide ? 8 : 4; }
+    static char* write(char* out, T v) noexcept {
+        if(wide)
+            bson_write_int64(out, static_cast<int64_t>(v));
+        else
+            bson_write_int32(out, static_cast<int32_t>(v));
+        return out + size(v);
+    }
+    static bool read(const bson_element& e, T& out) noexcept { return read_number(e, out); }
+};
+
+template <typename T> struct value_codec<T, std::enable_if_t<std::is_floating_point<T>::value>> {
+    static constexpr bson_type type(const T&) noexcept { return bson_type::double_; }
+    static constexpr bool present(const T&) noexcept { return true; }
+    static constexpr size_t size(const T&) noexcept { return 8; }
+    static char* write(char* out, T v) noexcept {
+        bson_write_double(out, static_cast<double>(v));
+        return out + 8;
+    }
+    static bool read(const bson_element& e, T& out) noexcept { return read_number(e, out); }
+};
+
+template <> struct value_codec<std::string> {
+    static constexpr bson_type type(const std::string&) noexcept { return bson_type::string; }
+    static constexpr bool present(const std::string&) noexcept { return true; }
+    static size_t size(const std::string& v) noexcept { return 4 + v.size() + 1; }
+    static char* write(char* out, const std::string& v) noexcept {
+        bson_write_int32(out, static_cast<int32_t>(v.size() + 1));
+        std::memcpy(out + 4, v.data(), v.size());
+        out[4 + v.size()] = '\0';
+        return out + size(v);
+    }
+    static bool read(const bson_element& e, std::string& out) {
+        if(e.type != bson_type::string || e.size < 5)
+            return false;
+        out.assign(e.value + 4, e.size - 5);
+        return true;
+    }
+};
+
+//! All-zero OIDs are omitted from documents, so that objects with a value-initialised `_id` are saved as new documents.
+template <> struct value_codec<std::array<char, 12>> {
+    static constexpr bson_type type(const std::array<char, 12>&) noexcept { return bson_type::oid; }
+    static bool present(const std::array<char, 12>& v) noexcept {
+        return std::any_of(v.begin(), v.end(), [](char c) { return c != 0; });
+    }
+    static constexpr size_t size(const std::array<char, 12>&) noexcept { return 12; }
+    static char* write(char* out, const std::array<char, 12>& v) noexcept {
+        std::memcpy(out, v.data(), 12);
+        return out + 12;
+    }
+    static bool read(const bson_element& e, std::array<char, 12>& out) noexcept {
+        if(e.type != bson_type::oid)
+            return false;
+        std::memcpy(out.data(), e.value, 12);
+        return true;
+    }
+};
+
+//! Disengaged optionals are omitted from documents, and null or absent fields decode as disengaged.
+template <typename T> struct value_codec<std::experimental::optional<T>> {
+    using codec = value_codec<T>;
+
+    static constexpr bson_type type(const std::experimental::optional<T>& v) noexcept { return codec::type(*v); }
+    static bool present(const std::experimental::optional<T>& v) noexcept { return v && codec::present(*v); }
+    static size_t size(const std::experimental::optional<T>& v) noexcept { return codec::size(*v); }
+    static char* write(char* out, const std::experimental::optional<T>& v) { return codec::write(out, *v); }
+    static bool read(const bson_element& e, std::experimental::optional<T>& out) {
+        if(e.type == bson_type::null || e.type == bson_type::undefined) {
+            out = std::experimental::nullopt;
+            return true;
+        }
+        T v{};
+        if(!codec::read(e, v))
+            return false;
+        out = std::move(v);
+        return true;
+    }
+};
+
+//! Writes the decimal representation of \p i, an array index, to \p out. Returns the number of characters written.
+inline size_t write_index(char* out, size_t i) noexcept {
+    char buf[20];
+    size_t n{0};
+    do {
+        buf[n++] = static_cast<char>('0' + i % 10);
+        i /= 10;
+    } while(i != 0);
+    for(size_t j = 0; j < n; ++j)
+        out[j] = buf[n - j - 1];
+    return n;
+}
+
+//! Returns the number of decimal digits of \p i.
+constexpr size_t index_size(size_t i) noexcept { return i < 10 ? 1 : 1 + index_size(i / 10); }
+
+//! Vectors are stored as BSON arrays.
+template <typename T, typename A> struct value_codec<std::vector<T, A>> {
+    using codec = value_codec<T>;
+
+    static constexpr bson_type type(const std::vector<T, A>&) noexcept { return bson_type::array; }
+    static constexpr bool present(const std::vector<T, A>&) noexcept { return true; }
+    static size_t size(const std::vector<T, A>& v) noexcept {
+        size_t ret{4 + 1};
+        for(size_t i = 0; i < v.size(); ++i)
+            if(codec::present(v[i]))
+                ret += 1 + index_size(i) + 1 + codec::size(v[i]);
+        return ret;
+    }
+    static char* write(char* out, const std::vector<T, A>& v) {
+        const auto begin = out;
+        out += 4;
+        for(size_t i = 0; i < v.size(); ++i) {
+            if(!codec::present(v[i]))
+                continue;
+            *out++ = static_cast<char>(codec::type(v[i]));
+            out += write_index(out, i);
+            *out++ = '\0';
+            out = codec::write(out, v[i]);
+        }
+        *out++ = '\0';
+        bson_write_int32(begin, static_cast<int32_t>(out - begin));
+        return out;
+    }
+    static bool read(const bson_element& e, std::vector<T, A>& out) {
+        if(e.type != bson_type::array)
+            return false;
+        out.clear();
+        bool ok{true};
+        const auto valid = bson_for_each(e.value, e.size, [&](const bson_element& item) {
+            T v{};
+            ok = codec::read(item, v);
+            if(ok)
+                out.push_back(std::move(v));
+            return ok;
+        });
+        return valid && ok;
+    }
+};
+
+template <typename T> size_t encoded_size(const T& obj);
+template <typename T> char* encode(char* out, const T& obj);
+template <typename T> bool decode(const char* data, size_t size, T& out);
+
+//! Types with document_traits are stored as embedded documents.
+template <typename T> struct value_codec<T, std::enable_if_t<is_document<T>::value>> {
+    static constexpr bson_type type(const T&) noexcept { return bson_type::document; }
+    static constexpr bool present(const T&) noexcept { return true; }
+    static size_t size(const T& v) { return encoded_size(v); }
+    static char* write(char* out, const T& v) { return encode(out, v); }
+    static bool read(const bson_element& e, T& out) {
+        return e.type == bson_type::document && decode(e.value, e.size, out);
+    }
+};
+
+/*!
+ * \brief Returns the size of \p obj once encoded as a BSON document.
+ */
+template <typename T> size_t encoded_size(const T& obj) {
+    size_t ret{4 + 1};
+    for_each_field(document_traits<T>::fields(), [&](const auto& field) {
+        using codec = value_codec<typename std::decay_t<decltype(field)>::member_type>;
+        const auto& v = obj.*field.member;
+        if(codec::present(v))
+            ret += 1 + field.name.size() + 1 + codec::size(v);
+    });
+    return ret;
+}
+
+/*!
+ * \brief Encodes \p obj as a BSON document to \p out, which must have room for encoded_size(obj) bytes.
+ *
+ * \return End of the written document.
+ */
+template <typename T> char* encode(char* out, const T& obj) {
+    const auto begin = out;
+    out += 4;
+    for_each_field(document_traits<T>::fields(), [&](const auto& field) {
+        using codec = value_codec<typename std::decay_t<decltype(field)>::member_type>;
+        const auto& v = obj.*field.member;
+        if(!codec::present(v))
+            return;
+        *out++ = static_cast<char>(codec::type(v));
+        std::memcpy(out, field.name.data(), field.name.size());
+        out += field.name.size();
+        *out++ = '\0';
+        out = codec::write(out, v);
+    });
+    *out++ = '\0';
+    bson_write_int32(begin, static_cast<int32_t>(out - begin));
+    return out;
+}
+
+/*!
+ * \brief Decodes the BSON document \p data into \p out.
+ *
+ * Fields of \p out with no corresponding element in \p data are left untouched, and elements with no corresponding
+ * field are ignored. Numeric elements are converted to the type of their field.
+ *
+ * \return false if \p data is malformed or an element's type does not match its field, true otherwise.
+ */
+template <typename T> bool decode(const char* data, size_t size, T& out) {
+    const auto fields = document_traits<T>::fields();
+    bool ok{true};
+    const auto valid = bson_for_each(data, size, [&](const bson_element& e) {
+        bool matched{false};
+        for_each_field(fields, [&](const auto& field) {
+            if(matched || field.name != e.name)
+                return;
+            using codec = value_codec<typename std::decay_t<decltype(field)>::member_type>;
+            matched = true;
+            ok = codec::read(e, out.*field.member);
+        });
+        return ok;
+    });
+    return valid && ok;
+}
+
+} // namespace detail
+
+/*!
+ * \brief Encodes \p obj, of a type with document_traits, as a BSON document.
+ */
+template <typename T> std::vector<char> to_bson(const T& obj) {
+    std::vector<char> ret(detail::encoded_size(obj));
+    const auto end = detail::encode(ret.data(), obj);
+    (void)end;
+    assert(end == ret.data() + ret.size());
+    return ret;
+}
+
+/*!
+ * \brief Decodes the BSON document \p data, of \p size bytes, into a \p T, a type with document_traits.
+ *
+ * \throws std::system_error with errc::invalid_bson when \p data is malformed or doesn't match \p T.
+ */
+template <typename T> T from_bson(const char* data, size_t size) {
+    T ret{};
+    if(!detail::decode(data, size, ret))
+        throw std::system_error(errc::invalid_bson, "could not decode document");
+    return ret;
+}
+
+//! \copydoc from_bson(const char*,size_t)
+template <typename T> T from_bson(const std::vector<char>& doc) { return from_bson<T>(doc.data(), doc.size()); }
+
+/*!
+ * \brief Wraps an ejdb::collection, storing and retrieving objects of type \p T rather than raw BSON.
+ *
+ * \p T must have a specialisation of ejdb::document_traits, e.g. via EJPP_DOCUMENT.
+ * Objects are encoded directly into a buffer of exactly the required size, and decoded directly from query results,
+ * without an intermediate DOM or copy.
+ */
+template <typename T> struct typed_collection {
+    static_assert(detail::is_document<T>::value, "T must have a specialisation of ejdb::document_traits");
+
+    //! Default constructor. Results in an invalid typed_collection.
+    typed_collection() noexcept = default;
+    //! Wraps \p coll.
+    explicit typed_collection(collection coll) noexcept : m_coll(std::move(coll)) {}
+
+    //! Returns whether the wrapped collection is valid.
+    explicit operator bool() const noexcept { return static_cast<bool>(m_coll); }
+
+    /*!
+     * \brief Saves \p obj to the collection, optionally merging with an existing, matching document.
+     *
+     * An object whose `_id` is all zeros, e.g. value-initialised, is saved as a new document, with an OID assigned
+     * by EJDB and returned.
+     */
+    std::experimental::optional<std::array<char, 12>> save(const T& obj, bool merge, std::error_code& ec) {
+        return m_coll.save_document(to_bson(obj), merge, ec);
+    }
+    //! \copybrief save(const T&,bool,std::error_code&)
+    std::array<char, 12> save(const T& obj, bool merge = false) { return m_coll.save_document(to_bson(obj), merge); }
+
+    //! Loads the object with OID \p oid, or nullopt if there is none.
+    std::experimental::optional<T> load(std::array<char, 12> oid, std::error_code& ec) const {
+        const auto doc = m_coll.load_document(oid, ec);
+        T ret{};
+        if(doc.empty())
+            return std::experimental::nullopt;
+        if(!detail::decode(doc.data(), doc.size(), ret)) {
+            ec = errc::invalid_bson;
+            return std::experimental::nullopt;
+        }
+        return std::move(ret);
+    }
+    //! \copybrief load(std::array<char,12>,std::error_code&) const
+    std::experimental::optional<T> load(std::array<char, 12> oid) const {
+        std::error_code ec;
+        auto ret = load(oid, ec);
+        if(ec)
+            throw std::system_error(ec, "could not load document");
+        return ret;
+    }
+
+    //! Removes the object with OID \p oid.
+    bool remove(std::array<char, 12> oid, std::error_code& ec) noexcept { return m_coll.remove_document(oid, ec); }
+    //! \copybrief remove(std::array<char,12>,std::error_code&)
+    void remove(std::array<char, 12> oid) { m_coll.remove_document(oid); }
+
+    /*!
+     * \brief Executes a query, decoding matching documents directly from the query result.
+     *
+     * \throws std::system_error with errc::invalid_bson when a document doesn't match \p T.
+     */
+    std::vector<T> find(const query& qry) {
+        std::vector<T> ret;
+        m_coll.for_each(qry, [&](const char* data, size_t size) {
+            ret.push_back(from_bson<T>(data, size));
+            return true;
+        });
+        return ret;
+    }
+
+    //! Executes a query, decoding only the first matching document, or returning nullopt if none match.
+    std::experimental::optional<T> find_first(const query& qry) {
+        std::experimental::optional<T> ret;
+        m_coll.for_each(qry, [&](const char* data, size_t size) {
+            ret = from_bson<T>(data, size);
+            return false;
+        });
+        return ret;
+    }
+
+    //! Returns the wrapped collection.
+    collection& base() noexcept { return m_coll; }
+    //! \copydoc base()
+    const collection& base() const noexcept { return m_coll; }
+
+  private:
+    collection m_coll;
+};
+
+} // namespace ejdb
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+#define EJPP_DOCUMENT_FIELD(r, type, i, member)                                                                        \
+    BOOST_PP_COMMA_IF(i)::ejdb::make_field(BOOST_PP_STRINGIZE(member), &type::member)
+#endif // DOXYGEN_SHOULD_SKIP_THIS
+
+/*!
+ * \brief Specialises ejdb::document_traits for \p type, mapping each listed member to a field of the same name.
+ *
+ * Must be used at global namespace scope.
+ *
+ * \code
+ * struct point { double x; double y; };
+ * EJPP_DOCUMENT(point, x, y)
+ * \endcode
+ */
+#define EJPP_DOCUMENT(type, ...)                                                                                       \
+    namespace ejdb {                                                                                                   \
+    template <> struct document_traits<type> {                                                                         \
+        static auto fields() {                                                                                         \
+            return std::make_tuple(                                                                                    \
+                BOOST_PP_SEQ_FOR_EACH_I(EJPP_DOCUMENT_FIELD, type, BOOST_PP_VARIADIC_TO_SEQ(__VA_ARGS__)));            \
+        }                                                                                                              \
+    };                                                                                                                 \
+    }
+
+#endif // EJDB_TYPED_COLLECTION_HPP
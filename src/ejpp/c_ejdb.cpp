@@ -19,8 +19,11 @@
  * USA
 **************************************************************************/
 
+#include <memory>
 #include <system_error>
 
+#include <pthread.h>
+
 #include <tcejdb/ejdb.h>
 #include <tcejdb/ejdb_private.h>
 
@@ -100,6 +103,16 @@ EJQRESULT qryexecute(EJCOLL* jcoll, const EJQ* q, uint32_t* count, int qflags) {
     return ejdbqryexecute(jcoll, q, count, qflags, nullptr);
 }
 
+EJQRESULT qryexecute(EJCOLL* jcoll, const EJQ* q, uint32_t* count, int qflags, std::string* log) {
+    if(log == nullptr)
+        return qryexecute(jcoll, q, count, qflags);
+    const auto xstr = tcxstrnew();
+    const auto ret = ejdbqryexecute(jcoll, q, count, qflags, xstr);
+    log->append(static_cast<const char*>(tcxstrptr(xstr)), static_cast<size_t>(tcxstrsize(xstr)));
+    tcxstrdel(xstr);
+    return ret;
+}
+
 int qresultnum(EJQRESULT qr) { return ejdbqresultnum(qr); }
 
 const void* qresultbsondata(EJQRESULT qr, int pos, int* size) { return ejdbqresultbsondata(qr, pos, size); }
@@ -127,9 +140,55 @@ std::vector<char> metadb(EJDB* jb) {
     return std::move(ret);
 }
 
+//! Functor allowing for the disposal of a TCLIST.
+struct tclist_deleter {
+    //! Function call operator.
+    void operator()(TCLIST* ptr) const noexcept { tclistdel(ptr); }
+};
+
+//! Returns a TCLIST of \p strs, or nullptr when \p strs is empty.
+static std::unique_ptr<TCLIST, tclist_deleter> make_tclist(const std::vector<std::string>& strs) {
+    if(strs.empty())
+        return nullptr;
+    std::unique_ptr<TCLIST, tclist_deleter> list{tclistnew2(static_cast<int>(strs.size()))};
+    for(auto&& str : strs)
+        tclistpush2(list.get(), str.c_str());
+    return list;
+}
+
+bool exportdb(EJDB* jb, const char* path, const std::vector<std::string>& cnames, int flags) {
+    return ejdbexport(jb, path, make_tclist(cnames).get(), flags, nullptr);
+}
+
+bool importdb(EJDB* jb, const char* path, const std::vector<std::string>& cnames, int flags) {
+    return ejdbimport(jb, path, make_tclist(cnames).get(), flags, nullptr);
+}
+
+std::string dbpath(EJDB* jb) {
+    const auto path = tctdbpath(jb->metadb);
+    return path != nullptr ? path : "";
+}
+
+bool syncmeta(EJDB* jb) { return tctdbsync(jb->metadb); }
+
+bool lockcoll(EJCOLL* coll) {
+    return coll->mmtx != nullptr && pthread_rwlock_wrlock(static_cast<pthread_rwlock_t*>(coll->mmtx)) == 0;
+}
+
+void unlockcoll(EJCOLL* coll) { pthread_rwlock_unlock(static_cast<pthread_rwlock_t*>(coll->mmtx)); }
+
+bool intran_locked(EJCOLL* coll) { return coll->tdb->tran; }
+
+bool synccoll_locked(EJCOLL* coll) { return tctdbmemsync(coll->tdb, true); }
+
 std::string collection_name(EJCOLL* coll) {
     assert(coll->cnamesz >= 0);
     return {coll->cname, static_cast<size_t>(coll->cnamesz)};
 }
 
+std::experimental::string_view collection_name_view(EJCOLL* coll) noexcept {
+    assert(coll->cnamesz >= 0);
+    return {coll->cname, static_cast<size_t>(coll->cnamesz)};
+}
+
 } // namespace c_ejdb
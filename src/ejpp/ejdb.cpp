@@ -19,22 +19,845 @@
  * USA
  *****************************************************************************/
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <limits>
+#include <locale>
+#include <mutex>
+#include <ostream>
+#include <random>
+#include <shared_mutex>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
-#include <boost/range/adaptor/transformed.hpp>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
 
+#include <ejpp/bson.hpp>
 #include <ejpp/c_ejdb.hpp>
 #include <ejpp/ejdb.hpp>
 
 namespace ejdb {
 
-//! Functor allowing for the deletion of opaque `EJDB` pointers.
+//! Operations timed by db::stats.
+enum class stat_op : size_t { save, load, remove, query, sync, commit };
+
+//! Number of stat_op values.
+static constexpr size_t stat_op_count = 6;
+
+#ifdef EJPP_STATS
+/*!
+ * \brief Statistics recorded by a single thread.
+ *
+ * Only written by the owning thread, so updates are relaxed loads and stores rather than read-modify-writes.
+ * Atomics allow db::stats to read while the owner writes.
+ */
+struct thread_stats {
+    //! Records an operation taking \p ns nanoseconds.
+    void record(stat_op op, uint64_t ns) noexcept {
+        const auto i = static_cast<size_t>(op);
+        increment(buckets[i][latency_histogram::bucket_index(ns)], 1);
+        increment(total_ns[i], ns);
+        if(ns > max_ns[i].load(std::memory_order_relaxed))
+            max_ns[i].store(ns, std::memory_order_relaxed);
+    }
+
+    static void increment(std::atomic<uint64_t>& counter, uint64_t n) noexcept {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    std::array<std::array<std::atomic<uint64_t>, latency_histogram::bucket_count>, stat_op_count> buckets;
+    std::array<std::atomic<uint64_t>, stat_op_count> total_ns;
+    std::array<std::atomic<uint64_t>, stat_op_count> max_ns;
+    std::atomic<uint64_t> bytes_read;
+    std::atomic<uint64_t> bytes_written;
+};
+#endif // EJPP_STATS
+
+//! State shared by all objects referring to the same `EJDB` handle.
+struct db_state {
+    //! \sa db::set_unprojected_result_limit
+    std::atomic<size_t> unprojected_result_limit{0};
+
+    //! Slow query threshold in nanoseconds, or zero if disabled. \sa db::set_slow_query_threshold
+    std::atomic<int64_t> slow_query_threshold{0};
+    //! Guards slow_queries, slow_query_capacity and slow_query_handler.
+    std::mutex slow_query_mutex;
+    //! Slow query log, oldest first.
+    std::deque<slow_query> slow_queries;
+    //! \sa db::set_slow_query_capacity
+    size_t slow_query_capacity{64};
+    //! \sa db::set_slow_query_handler
+    std::function<void(const slow_query&)> slow_query_handler;
+
+    //! Whether changes are recorded, i.e. change_capacity is non-zero. \sa db::set_change_log_capacity
+    std::atomic<bool> change_log_enabled{false};
+    //! Guards changes, change_capacity, pending_changes and transactions, and serialises writes to last_change_seq.
+    std::mutex change_mutex;
+    //! Change log, oldest first, with contiguous sequence numbers.
+    std::deque<change> changes;
+    //! \sa db::set_change_log_capacity
+    size_t change_capacity{0};
+    //! \sa db::last_change_seq
+    std::atomic<uint64_t> last_change_seq{0};
+    /*!
+     * \brief Identifies the sequence numbers of changes, which restart whenever the db is opened.
+     *
+     * Changed whenever the change log is enabled, as changes made while disabled are missing, and by db::import_from,
+     * whose imports aren't recorded.
+     * Persisted with replication checkpoints, so that db::replicate_to can tell whether a checkpoint's sequence number
+     * refers to this change log.
+     */
+    uint64_t change_log_epoch{0};
+    //! Serialises db::replicate_to.
+    std::mutex replication_mutex;
+    //! Changes made within each collection's transaction in progress, appended to changes on commit.
+    std::unordered_map<EJCOLL*, std::vector<change>> pending_changes;
+    //! Collections with a transaction in progress, started with begin_transaction, and their threads.
+    std::unordered_map<EJCOLL*, std::thread::id> transactions;
+    /*!
+     * \brief Held while a transaction is begun or ended together with its entry in transactions.
+     *
+     * Taken before change_mutex and capped_mutex.
+     */
+    std::mutex transaction_mutex;
+    //! Notified, with transaction_mutex, as transactions end and as collections are no longer being copied.
+    std::condition_variable transaction_cv;
+    //! Collection being copied by db::replicate_to, on which transactions wait to begin. Guarded by transaction_mutex.
+    EJCOLL* copying{nullptr};
+    /*!
+     * \brief Held shared by each write to a collection until it's recorded in the change log, and exclusively by
+     *        db::replicate_to while copying the collection, so that the copy reflects exactly the changes recorded.
+     *
+     * Striped by collection, see write_mutex. Neither held recursively, nor while taking transaction_mutex.
+     */
+    std::array<std::shared_timed_mutex, 16> write_mutexes;
+
+    //! Returns the mutex of write_mutexes guarding writes to \p coll.
+    std::shared_timed_mutex& write_mutex(EJCOLL* coll) noexcept {
+        return write_mutexes[std::hash<EJCOLL*>{}(coll) % write_mutexes.size()];
+    }
+
+    //! Locks writes to \p coll, to be held from making a change until it's recorded. \sa write_mutexes
+    std::shared_lock<std::shared_timed_mutex> lock_writes(EJCOLL* coll) {
+        return std::shared_lock<std::shared_timed_mutex>{write_mutex(coll)};
+    }
+
+    /*!
+     * \brief Records a change to \p coll in the change log, if enabled.
+     *
+     * Changes made within a transaction are held back until it is committed, and discarded if it is aborted.
+     * \p document is only invoked when the change log is enabled, so that callers pay for nothing more than a relaxed
+     * load otherwise.
+     *
+     * Callers record a change after making it, so the sequence number is assigned outside of EJDB's own locking:
+     * concurrent writes to the same document may be logged in the opposite order to the one EJDB applied them in.
+     */
+    template <typename DocumentFn>
+    void record_change(EJCOLL* coll, change_op op, const char* oid, DocumentFn&& document,
+                       const std::vector<std::vector<char>>& ors = {},
+                       query_search_mode mode = query_search_mode::normal,
+                       const std::vector<char>& hints = {}) noexcept {
+        if(!change_log_enabled.load(std::memory_order_relaxed))
+            return;
+        try {
+            change entry{0, op, c_ejdb::collection_name(coll), {}, document(), ors, mode, hints};
+            if(oid != nullptr)
+                std::copy_n(oid, entry.oid.size(), entry.oid.begin());
+
+            std::lock_guard<std::mutex> lock{change_mutex};
+            if(transactions.count(coll))
+                pending_changes[coll].push_back(std::move(entry));
+            else
+                append_change(std::move(entry));
+        } catch(...) {
+            lose_change();
+        }
+    }
+
+    /*!
+     * \brief Returns whether the calling thread started the transaction in progress on \p coll, if any.
+     *
+     * EJDB's transactions are per collection, not per thread, so operations that would otherwise begin their own
+     * transaction join one in progress only when it's the calling thread's. Another thread's transaction could be
+     * committed or aborted midway through the operation.
+     */
+    bool owns_transaction(EJCOLL* coll) {
+        std::lock_guard<std::mutex> lock{change_mutex};
+        const auto it = transactions.find(coll);
+        return it != transactions.end() && it->second == std::this_thread::get_id();
+    }
+
+    /*!
+     * \brief Begins a transaction on \p coll for the calling thread, once any other thread's has ended, and \p coll
+     *        is no longer being copied.
+     *
+     * The transaction and its bookkeeping begin under transaction_mutex, and end under it in end_transaction, so
+     * that ending one thread's transaction can't end the bookkeeping of another thread's, begun in between.
+     */
+    bool begin_transaction(EJCOLL* coll) noexcept {
+        std::unique_lock<std::mutex> lock{transaction_mutex};
+        // EJDB's own wait would hold transaction_mutex, which the transaction in progress needs to end
+        transaction_cv.wait(lock, [&] {
+            std::lock_guard<std::mutex> changes_lock{change_mutex};
+            return transactions.count(coll) == 0 && copying != coll;
+        });
+        if(!c_ejdb::tranbegin(coll))
+            return false;
+        if(!begin_changes(coll)) {
+            c_ejdb::tranabort(coll);
+            return false;
+        }
+        return true;
+    }
+
+    /*!
+     * \brief Commits or aborts the transaction on \p coll begun by begin_transaction.
+     *
+     * Its bookkeeping is ended unless EJDB reports the transaction still in progress, having failed to end it.
+     */
+    bool end_transaction(EJCOLL* coll, bool commit) noexcept {
+        bool r;
+        {
+            std::lock_guard<std::mutex> lock{transaction_mutex};
+            r = commit ? c_ejdb::trancommit(coll) : c_ejdb::tranabort(coll);
+            bool in_progress{false};
+            if(r || !c_ejdb::transtatus(coll, &in_progress) || !in_progress)
+                end_changes(coll, commit && r);
+        }
+        transaction_cv.notify_all();
+        return r;
+    }
+
+    /*!
+     * \brief Holds back changes to \p coll until end_changes, as a transaction has started.
+     *
+     * Changes to \p coll's capped_collection are noted from now on, to be undone should the transaction be aborted.
+     * \return false when out of memory, in which case the transaction mustn't proceed.
+     */
+    bool begin_changes(EJCOLL* coll) noexcept {
+        try {
+            std::lock_guard<std::mutex> lock{change_mutex};
+            transactions[coll] = std::this_thread::get_id();
+        } catch(...) {
+            return false;
+        }
+        if(!any_capped.load(std::memory_order_relaxed))
+            return true;
+        std::lock_guard<std::mutex> lock{capped_mutex};
+        const auto it = capped.find(coll);
+        if(it != capped.end()) {
+            it->second.in_transaction = true;
+            it->second.undo.clear();
+        }
+        return true;
+    }
+
+    /*!
+     * \brief Ends a transaction on \p coll, appending its held back changes to the change log when \p committed.
+     *
+     * Otherwise, changes to \p coll's capped_collection made within the transaction are undone.
+     */
+    void end_changes(EJCOLL* coll, bool committed) noexcept {
+        if(any_capped.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock{capped_mutex};
+            const auto it = capped.find(coll);
+            if(it != capped.end()) {
+                try {
+                    if(!committed)
+                        it->second.rollback();
+                } catch(...) {
+                    // out of memory, left partially rolled back
+                }
+                it->second.in_transaction = false;
+                it->second.undo.clear();
+            }
+        }
+        try {
+            std::lock_guard<std::mutex> lock{change_mutex};
+            transactions.erase(coll);
+            const auto it = pending_changes.find(coll);
+            if(it == pending_changes.end())
+                return;
+            auto entries = std::move(it->second);
+            pending_changes.erase(it);
+            if(committed)
+                for(auto&& entry : entries)
+                    append_change(std::move(entry));
+        } catch(...) {
+            lose_change();
+        }
+    }
+
+    //! Changes change_log_epoch, so that replicas catch up by copying. Requires change_mutex to be held.
+    void renew_change_log_epoch() {
+        std::random_device rd;
+        change_log_epoch = (uint64_t{rd()} << 32 | rd()) ^
+                           static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+    }
+
+    //! Assigns \p entry the next sequence number and appends it to changes. Requires change_mutex to be held.
+    void append_change(change entry) {
+        if(change_capacity == 0)
+            return;
+        entry.seq = last_change_seq.load(std::memory_order_relaxed) + 1;
+        while(changes.size() >= change_capacity)
+            changes.pop_front();
+        changes.push_back(std::move(entry));
+        last_change_seq.store(changes.back().seq, std::memory_order_release);
+    }
+
+    /*!
+     * \brief Accounts for a change which couldn't be recorded, e.g. for lack of memory.
+     *
+     * Clears the change log and skips a sequence number, so that every consumer sees a gap from db::changes_since
+     * rather than silently missing the change.
+     */
+    void lose_change() noexcept {
+        std::lock_guard<std::mutex> lock{change_mutex};
+        if(change_capacity == 0)
+            return;
+        changes.clear();
+        last_change_seq.store(last_change_seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    //! Current tracer, or nullptr. \sa db::set_tracer
+    std::atomic<tracer*> active_tracer{nullptr};
+    //! Guards tracers.
+    std::mutex tracer_mutex;
+    /*!
+     * \brief Every tracer set on the db.
+     *
+     * Replaced tracers are kept alive, as operations in progress on other threads may still be using them.
+     */
+    std::vector<std::shared_ptr<tracer>> tracers;
+
+    //! Guards collections and collection_names.
+    std::shared_timed_mutex registry_mutex;
+    //! Open collections by name. Keys refer to collection_names. \sa db::get_collection
+    std::unordered_map<std::experimental::string_view, EJCOLL*> collections;
+    /*!
+     * \brief Names of every collection opened or created.
+     *
+     * Kept for the lifetime of the db, even once a collection is removed, so that views returned by
+     * collection::name_view remain valid.
+     */
+    std::unordered_set<std::string> collection_names;
+
+    //! Adds \p coll to collections, returning its interned name. Requires registry_mutex to be held exclusively.
+    std::experimental::string_view register_collection(EJCOLL* coll) {
+        const std::experimental::string_view name = *collection_names.insert(c_ejdb::collection_name(coll)).first;
+        collections[name] = coll;
+        return name;
+    }
+
+    //! A collection whose expired documents are removed by the sweeper thread. \sa collection::set_ttl
+    struct ttl_collection {
+        //! Name of the collection.
+        std::string collection;
+        //! Date field compared against ttl.
+        std::string field;
+        //! Age of documents to remove.
+        std::chrono::seconds ttl;
+        //! Pacing of sweeps.
+        ttl_options options;
+        //! When the collection is next due to be swept.
+        std::chrono::steady_clock::time_point next_sweep;
+    };
+
+    //! Guards ttl_collections, sweeping, sweeper and sweeper_stopping.
+    std::mutex sweeper_mutex;
+    //! Notified on changes to ttl_collections, sweeping and sweeper_stopping.
+    std::condition_variable sweeper_cv;
+    //! Collections swept by sweeper.
+    std::vector<ttl_collection> ttl_collections;
+    //! Name of the collection the sweeper is removing documents from, empty between batches.
+    std::string sweeping;
+    //! Set once the sweeper is to exit, as the db is closed.
+    bool sweeper_stopping{false};
+    //! Thread removing expired documents, started by the first call to collection::set_ttl.
+    std::thread sweeper;
+
+    /*!
+     * \brief Stops and joins the sweeper thread.
+     *
+     * The sweeper is detached instead when called from itself, i.e. when it held the last reference to the db.
+     * It doesn't touch this state once it has released the db.
+     */
+    void stop_sweeper() noexcept {
+        {
+            std::lock_guard<std::mutex> lock{sweeper_mutex};
+            sweeper_stopping = true;
+        }
+        sweeper_cv.notify_all();
+        if(!sweeper.joinable())
+            return;
+        if(sweeper.get_id() == std::this_thread::get_id())
+            sweeper.detach();
+        else
+            sweeper.join();
+    }
+
+    //! Hashes OIDs, which are already well distributed.
+    struct oid_hash {
+        size_t operator()(const std::array<char, 12>& oid) const noexcept {
+            // FNV-1a
+            uint64_t h{14695981039346656037ull};
+            for(auto c : oid)
+                h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+            return static_cast<size_t>(h);
+        }
+    };
+
+    //! Insertion order and sizes of a capped collection's documents. \sa collection::set_cap
+    struct capped_collection {
+        //! Limits.
+        cap_options options;
+        /*!
+         * \brief OIDs of documents, oldest first.
+         *
+         * Removed documents are left until they reach the front, or are compacted away, so that removal is O(1).
+         */
+        std::deque<std::array<char, 12>> order;
+        //! Sizes of documents in the collection.
+        std::unordered_map<std::array<char, 12>, uint64_t, oid_hash> sizes;
+        //! Total of sizes.
+        uint64_t bytes{0};
+
+        //! How a change moved a document within order.
+        enum class order_change { none, pushed_back, pushed_front, popped_front };
+
+        //! A change made within a transaction, undone should the transaction be aborted.
+        struct undo_entry {
+            //! Changed document.
+            std::array<char, 12> oid;
+            //! Size of the document before the change, or std::experimental::nullopt if it was absent.
+            std::experimental::optional<uint64_t> size;
+            //! Change to order.
+            order_change moved;
+        };
+
+        //! Whether a transaction is in progress on the collection, so that changes are noted in undo.
+        bool in_transaction{false};
+        //! Changes made within the transaction in progress, oldest first.
+        std::vector<undo_entry> undo;
+
+        /*!
+         * \brief Sets the size of document \p oid, removing it when \p size is std::experimental::nullopt, and moves it
+         *        within order as given by \p moved.
+         *
+         * Noted in undo first within a transaction, so that a failure to do so leaves the collection unchanged.
+         */
+        void change(const std::array<char, 12>& oid, std::experimental::optional<uint64_t> size,
+                    order_change moved = order_change::none) {
+            if(in_transaction) {
+                const auto it = sizes.find(oid);
+                undo.push_back({oid, it != sizes.end() ? std::experimental::make_optional(it->second)
+                                                       : std::experimental::nullopt,
+                                moved});
+            }
+            switch(moved) {
+                case order_change::none:
+                    break;
+                case order_change::pushed_back:
+                    order.push_back(oid);
+                    break;
+                case order_change::pushed_front:
+                    order.push_front(oid);
+                    break;
+                case order_change::popped_front:
+                    order.pop_front();
+                    break;
+            }
+            set_size(oid, size);
+        }
+
+        //! Undoes the changes made within an aborted transaction, in reverse.
+        void rollback() {
+            for(auto it = undo.rbegin(); it != undo.rend(); ++it) {
+                switch(it->moved) {
+                    case order_change::none:
+                        break;
+                    case order_change::pushed_back:
+                        order.pop_back();
+                        break;
+                    case order_change::pushed_front:
+                        order.pop_front();
+                        break;
+                    case order_change::popped_front:
+                        order.push_front(it->oid);
+                        break;
+                }
+                set_size(it->oid, it->size);
+            }
+        }
+
+        //! Sets the size of document \p oid, removing it when \p size is std::experimental::nullopt, unnoted in undo.
+        void set_size(const std::array<char, 12>& oid, std::experimental::optional<uint64_t> size) {
+            const auto it = sizes.find(oid);
+            if(it != sizes.end())
+                bytes -= it->second;
+            if(!size) {
+                if(it != sizes.end())
+                    sizes.erase(it);
+                return;
+            }
+            bytes += *size;
+            if(it != sizes.end())
+                it->second = *size;
+            else
+                sizes.emplace(oid, *size);
+        }
+    };
+
+    //! Whether capped is non-empty, so that saves to other collections needn't take capped_mutex.
+    std::atomic<bool> any_capped{false};
+    //! Guards capped.
+    std::mutex capped_mutex;
+    //! Capped collections.
+    std::unordered_map<EJCOLL*, capped_collection> capped;
+
+    //! Set when collections, indexes or documents may have changed since db_info was cached. \sa db::info
+    std::atomic<bool> info_stale{true};
+    //! Guards db_info.
+    std::mutex info_mutex;
+    //! Cached result of db::info.
+    std::shared_ptr<const ejdb::db_info> db_info;
+
+    //! Marks db_info as stale. Only stores when not already stale, so frequent writers don't contend on the flag.
+    void invalidate_info() noexcept {
+        if(!info_stale.load(std::memory_order_relaxed))
+            info_stale.store(true);
+    }
+
+#ifdef EJPP_STATS
+    //! Returns the calling thread's statistics, creating them if necessary.
+    thread_stats& local_stats() {
+        struct cache_entry {
+            uint64_t id;
+            thread_stats* stats;
+        };
+        static thread_local cache_entry cache{0, nullptr};
+        if(cache.id == id)
+            return *cache.stats;
+
+        std::lock_guard<std::mutex> lock{stats_mutex};
+        const auto tid = std::this_thread::get_id();
+        auto it = std::find_if(threads.begin(), threads.end(), [&](auto&& t) { return t.first == tid; });
+        if(it == threads.end()) {
+            // value-initialised, zeroing all counters
+            threads.emplace_back(tid, std::unique_ptr<thread_stats>(new thread_stats()));
+            it = std::prev(threads.end());
+        }
+        cache = {id, it->second.get()};
+        return *it->second;
+    }
+
+    //! Uniquely identifies this state, for the per-thread cache in local_stats.
+    const uint64_t id{next_id()};
+    //! Guards threads.
+    std::mutex stats_mutex;
+    /*!
+     * \brief Statistics of each thread to have used the db.
+     *
+     * Keyed by thread id, so that statistics of finished threads are reused by new ones rather than accumulating.
+     */
+    std::vector<std::pair<std::thread::id, std::unique_ptr<thread_stats>>> threads;
+
+  private:
+    static uint64_t next_id() noexcept {
+        static std::atomic<uint64_t> ids{1};
+        return ids++;
+    }
+#endif // EJPP_STATS
+};
+
+/*!
+ * \brief Functor allowing for the deletion of opaque `EJDB` pointers.
+ *
+ * Also carries the db_state of the handle, so that it lives exactly as long as the handle itself and can be reached
+ * from any `std::shared_ptr<EJDB>` via state_of.
+ */
 struct ejdb_deleter {
-    //! Function call operator.
-    void operator()(EJDB* ptr) const noexcept { c_ejdb::del(ptr); }
+    //! Function call operator. Stops the TTL sweeper before deleting the handle.
+    void operator()(EJDB* ptr) const noexcept {
+        state->stop_sweeper();
+        c_ejdb::del(ptr);
+    }
+
+    //! State of the deleted handle. Shared, as deleters must be copyable.
+    std::shared_ptr<db_state> state{std::make_shared<db_state>()};
+};
+
+//! Returns the db_state associated with \p db, or nullptr if \p db is null.
+static db_state* state_of(const std::shared_ptr<EJDB>& db) noexcept {
+    const auto deleter = std::get_deleter<ejdb_deleter>(db);
+    return deleter != nullptr ? deleter->state.get() : nullptr;
+}
+
+//! Returns shared ownership of the db_state associated with \p db, or nullptr if \p db is null.
+static std::shared_ptr<db_state> shared_state_of(const std::shared_ptr<EJDB>& db) noexcept {
+    const auto deleter = std::get_deleter<ejdb_deleter>(db);
+    return deleter != nullptr ? deleter->state : nullptr;
+}
+
+/*!
+ * \brief Times an operation for db::stats, recording it on destruction.
+ *
+ * Does nothing unless built with `EJPP_STATS` defined.
+ */
+struct op_timer {
+#ifdef EJPP_STATS
+    //! \p state must outlive the op_timer.
+    op_timer(db_state* state, stat_op op) noexcept
+        : m_state(state), m_op(op), m_start(std::chrono::steady_clock::now()) {}
+
+    op_timer(const op_timer&) = delete;
+    op_timer& operator=(const op_timer&) = delete;
+
+    ~op_timer() {
+        if(m_state == nullptr)
+            return;
+        const auto elapsed = std::chrono::steady_clock::now() - m_start;
+        try {
+            auto& stats = m_state->local_stats();
+            stats.record(m_op, static_cast<uint64_t>(
+                                   std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+            thread_stats::increment(stats.bytes_read, m_read);
+            thread_stats::increment(stats.bytes_written, m_written);
+        } catch(...) {
+            // failure to allocate statistics shouldn't affect the operation
+        }
+    }
+
+    //! Adds \p bytes to the bytes read by the operation.
+    void read(size_t bytes) noexcept { m_read += bytes; }
+    //! Adds \p bytes to the bytes written by the operation.
+    void written(size_t bytes) noexcept { m_written += bytes; }
+
+  private:
+    db_state* m_state;
+    stat_op m_op;
+    std::chrono::steady_clock::time_point m_start;
+    size_t m_read{0};
+    size_t m_written{0};
+#else
+    op_timer(db_state*, stat_op) noexcept {}
+    void read(size_t) noexcept {}
+    void written(size_t) noexcept {}
+#endif // EJPP_STATS
+};
+
+tracer::~tracer() {}
+
+/*!
+ * \brief Notifies the tracer of a db, if any, of the beginning and end of an operation.
+ *
+ * When no tracer is set, construction is a single load and branch, and destruction a single branch.
+ */
+struct trace_scope {
+    //! \p state must outlive the trace_scope. \p ec, if not null, is reported as the error of the operation.
+    trace_scope(db_state* state, trace_op op, const std::error_code* ec = nullptr) noexcept
+        : m_tracer(state ? state->active_tracer.load(std::memory_order_acquire) : nullptr), m_ec(ec) {
+        if(m_tracer) {
+            m_event.op = op;
+            m_tracer->begin(m_event);
+        }
+    }
+
+    //! \copydoc trace_scope(db_state*,trace_op,const std::error_code*)
+    trace_scope(db_state* state, trace_op op, EJCOLL* coll, const std::error_code* ec = nullptr) noexcept
+        : m_tracer(state ? state->active_tracer.load(std::memory_order_acquire) : nullptr), m_ec(ec) {
+        if(m_tracer) {
+            m_event.op = op;
+            if(coll != nullptr)
+                m_event.collection = c_ejdb::collection_name_view(coll);
+            m_tracer->begin(m_event);
+        }
+    }
+
+    //! \copydoc trace_scope(db_state*,trace_op,const std::error_code*)
+    trace_scope(db_state* state, trace_op op, std::experimental::string_view collection,
+                const std::error_code* ec = nullptr) noexcept
+        : m_tracer(state ? state->active_tracer.load(std::memory_order_acquire) : nullptr), m_ec(ec) {
+        if(m_tracer) {
+            m_event.op = op;
+            m_event.collection = collection;
+            m_tracer->begin(m_event);
+        }
+    }
+
+    trace_scope(const trace_scope&) = delete;
+    trace_scope& operator=(const trace_scope&) = delete;
+
+    ~trace_scope() {
+        if(m_tracer) {
+            if(m_ec != nullptr && !m_event.error)
+                m_event.error = *m_ec;
+            m_tracer->end(m_event);
+        }
+    }
+
+    //! Adds \p bytes to the size of documents read or written.
+    void bytes(size_t bytes) noexcept { m_event.bytes += bytes; }
+    //! Sets the number of documents returned or matched.
+    void results(uint32_t results) noexcept { m_event.results = results; }
+    //! Sets the error resulting from the operation.
+    void error(std::error_code ec) noexcept { m_event.error = ec; }
+    //! Returns whether a tracer is being notified.
+    explicit operator bool() const noexcept { return m_tracer != nullptr; }
+
+  private:
+    tracer* m_tracer;
+    const std::error_code* m_ec;
+    trace_event m_event;
+};
+
+/*!
+ * \brief Times a query execution for the slow query log.
+ *
+ * Constructed by friends of query, which can see its source documents, and started once the executing function has
+ * locked the db. When the slow query log is disabled, start does nothing beyond checking the threshold.
+ */
+struct slow_query_context {
+    slow_query_context(EJCOLL* coll, const std::vector<char>& qry, const std::vector<std::vector<char>>& ors,
+                       const std::vector<char>& hints) noexcept
+        : m_coll(coll), m_query(qry), m_ors(ors), m_hints(hints) {}
+
+    //! Starts timing if \p state has the slow query log enabled.
+    void start(db_state* state) noexcept {
+        if(state == nullptr || state->slow_query_threshold.load(std::memory_order_relaxed) <= 0)
+            return;
+        m_state = state;
+        m_start = std::chrono::steady_clock::now();
+    }
+
+    /*!
+     * \brief Returns where EJDB's execution log should be written, or nullptr if not timing.
+     *
+     * EJDB only produces the log when asked before execution, so it is captured for every query while the slow query
+     * log is enabled, but only retained for slow queries.
+     */
+    std::string* log() noexcept { return m_state ? &m_log : nullptr; }
+
+    //! Records the query in the slow query log if it took longer than the threshold.
+    void finish(uint32_t result_count) noexcept {
+        if(m_state == nullptr)
+            return;
+        const auto elapsed = std::chrono::steady_clock::now() - m_start;
+        if(elapsed.count() <= 0 ||
+           std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() <=
+               m_state->slow_query_threshold.load(std::memory_order_relaxed))
+            return;
+        try {
+            slow_query entry{c_ejdb::collection_name(m_coll),
+                             m_query,
+                             m_ors,
+                             m_hints,
+                             std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed),
+                             result_count,
+                             std::move(m_log)};
+            std::unique_lock<std::mutex> lock{m_state->slow_query_mutex};
+            if(m_state->slow_query_handler) {
+                const auto handler = m_state->slow_query_handler;
+                lock.unlock();
+                handler(entry);
+                return;
+            }
+            if(m_state->slow_query_capacity == 0)
+                return;
+            while(m_state->slow_queries.size() >= m_state->slow_query_capacity)
+                m_state->slow_queries.pop_front();
+            m_state->slow_queries.push_back(std::move(entry));
+        } catch(...) {
+            // failure to log shouldn't affect the query
+        }
+    }
+
+  private:
+    EJCOLL* m_coll;
+    const std::vector<char>& m_query;
+    const std::vector<std::vector<char>>& m_ors;
+    const std::vector<char>& m_hints;
+    db_state* m_state{nullptr};
+    std::chrono::steady_clock::time_point m_start;
+    std::string m_log;
 };
 
+constexpr size_t latency_histogram::sub_bucket_bits;
+constexpr size_t latency_histogram::max_magnitude;
+constexpr size_t latency_histogram::bucket_count;
+
+size_t latency_histogram::bucket_index(uint64_t ns) noexcept {
+    if(ns < (1u << sub_bucket_bits))
+        return static_cast<size_t>(ns);
+    const auto magnitude = static_cast<size_t>(63 - __builtin_clzll(ns));
+    if(magnitude >= max_magnitude)
+        return bucket_count - 1;
+    const auto shift = magnitude - sub_bucket_bits;
+    return ((shift + 1) << sub_bucket_bits) + static_cast<size_t>((ns >> shift) - (1u << sub_bucket_bits));
+}
+
+/*!
+ * \return The largest latency counted in the bucket at \p index, or the maximum value of uint64_t for the overflow
+ *         bucket.
+ */
+uint64_t latency_histogram::bucket_upper_bound(size_t index) noexcept {
+    if(index < (1u << sub_bucket_bits))
+        return index;
+    if(index >= bucket_count - 1)
+        return std::numeric_limits<uint64_t>::max();
+    const auto shift = (index >> sub_bucket_bits) - 1;
+    const auto sub_bucket = index & ((1u << sub_bucket_bits) - 1);
+    return (((uint64_t{1} << sub_bucket_bits) + sub_bucket + 1) << shift) - 1;
+}
+
+uint64_t latency_histogram::count() const noexcept {
+    uint64_t ret{0};
+    for(auto n : buckets)
+        ret += n;
+    return ret;
+}
+
+double latency_histogram::mean() const noexcept {
+    const auto n = count();
+    return n ? static_cast<double>(total_ns) / n : 0.0;
+}
+
+/*!
+ * \return The upper bound of the bucket containing the \p p th percentile, capped at max_ns.
+ *         Zero if no latencies are recorded.
+ */
+uint64_t latency_histogram::percentile(double p) const noexcept {
+    const auto n = count();
+    if(n == 0)
+        return 0;
+    const auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(std::min(p, 100.0) / 100 * n)));
+    uint64_t seen{0};
+    for(size_t i = 0; i < bucket_count; ++i) {
+        seen += buckets[i];
+        if(seen >= rank)
+            return std::min(bucket_upper_bound(i), max_ns);
+    }
+    return max_ns;
+}
+
 void query::eqry_deleter::operator()(EJQ* ptr) const noexcept { c_ejdb::querydel(ptr); }
 
 db::operator bool() const noexcept { return static_cast<bool>(m_db); }
@@ -70,8 +893,14 @@ std::error_code db::error(std::weak_ptr<EJDB> db) noexcept {
 bool db::open(const std::string& path, db_mode mode, std::error_code& ec) {
     m_db = {c_ejdb::newdb(), ejdb_deleter()};
     const auto r = m_db && c_ejdb::open(m_db.get(), path.c_str(), (std::underlying_type<db_mode>::type)mode);
-    if(!r)
+    if(!r) {
         ec = error();
+        return r;
+    }
+    const auto state = state_of(m_db);
+    std::lock_guard<std::shared_timed_mutex> lock{state->registry_mutex};
+    for(auto coll : c_ejdb::getcolls(m_db.get()))
+        state->register_collection(coll);
     return r;
 }
 
@@ -99,7 +928,33 @@ bool db::is_open() const noexcept { return m_db && c_ejdb::isopen(m_db.get()); }
  * \return true on success, false on failure.
  */
 bool db::close(std::error_code& ec) noexcept {
-    const auto r = m_db && c_ejdb::closedb(m_db.get());
+    // keep state alive beyond releasing the handle, for the tracer
+    const auto state = shared_state_of(m_db);
+    trace_scope trace{state.get(), trace_op::close, &ec};
+    if(state)
+        state->stop_sweeper();
+    bool r{false};
+    if(m_db) {
+        // copies of this db share the registry, whose collections are invalidated by closing
+        std::lock_guard<std::shared_timed_mutex> lock{state->registry_mutex};
+        r = c_ejdb::closedb(m_db.get());
+        if(r) {
+            state->collections.clear();
+            std::lock_guard<std::mutex> capped_lock{state->capped_mutex};
+            state->capped.clear();
+            state->any_capped.store(false, std::memory_order_relaxed);
+        }
+    }
+    if(r) {
+        // closing ended any transactions in progress, so threads waiting to begin one fail rather than wait forever
+        {
+            std::lock_guard<std::mutex> transaction_lock{state->transaction_mutex};
+            std::lock_guard<std::mutex> change_lock{state->change_mutex};
+            state->transactions.clear();
+            state->pending_changes.clear();
+        }
+        state->transaction_cv.notify_all();
+    }
     if(!r)
         ec = error();
     m_db.reset();
@@ -121,19 +976,24 @@ void db::close() {
 }
 
 /*!
+ * Collections are looked up in a hash table maintained by db::open, db::create_collection and db::remove_collection,
+ * rather than by EJDB's linear search.
+ *
  * \param name Name of collection to fetch.
  * \param[out] ec Set to an appropriate error code on failure.
- * \return Valid collection on success, default collection on failure.
+ * \return Valid collection on success, default collection on failure or when none matching \p name found.
  */
 collection db::get_collection(const std::string& name, std::error_code& ec) const {
     if(!m_db) {
         ec = error();
         return {};
     }
-    const auto r = c_ejdb::getcoll(m_db.get(), name.c_str());
-    if(r == nullptr)
-        ec = error();
-    return {m_db, r};
+    const auto state = state_of(m_db);
+    std::shared_lock<std::shared_timed_mutex> lock{state->registry_mutex};
+    const auto it = state->collections.find(name);
+    if(it == state->collections.end())
+        return {};
+    return {m_db, it->second, it->first};
 }
 
 /*!
@@ -161,10 +1021,16 @@ collection db::create_collection(const std::string& name, std::error_code& ec) {
         ec = error();
         return {};
     }
+    const auto state = state_of(m_db);
+    trace_scope trace{state, trace_op::create_collection, name, &ec};
+    std::lock_guard<std::shared_timed_mutex> lock{state->registry_mutex};
     const auto r = c_ejdb::createcoll(m_db.get(), name.c_str(), nullptr);
-    if(r == nullptr)
+    if(r == nullptr) {
         ec = error();
-    return {m_db, r};
+        return {};
+    }
+    state->invalidate_info();
+    return {m_db, r, state->register_collection(r)};
 }
 
 /*!
@@ -183,15 +1049,39 @@ collection db::create_collection(const std::string& name) {
 }
 
 /*!
+ * The collection registry is locked exclusively while EJDB removes the collection, including unlinking its files when
+ * \p unlink_file is set, so lookups of other collections wait for the unlink to finish. EJDB removes and unlinks in
+ * one call, which can't be split without a concurrent create_collection of the same name registering the collection
+ * being removed.
+ *
  * \param name Name of collection to remove.
  * \param unlink_file Whether to remove associated files, i.e. db collection file, indexes, etc.
  * \param[out] ec Set to an appropriate error code on failure.
  * \return true on success, false on failure.
  */
 bool db::remove_collection(const std::string& name, bool unlink_file, std::error_code& ec) {
-    const auto r = m_db && c_ejdb::rmcoll(m_db.get(), name.c_str(), unlink_file);
-    if(!r)
+    if(!m_db) {
+        ec = error();
+        return false;
+    }
+    const auto state = state_of(m_db);
+    trace_scope trace{state, trace_op::remove_collection, name, &ec};
+    std::lock_guard<std::shared_timed_mutex> lock{state->registry_mutex};
+    const auto it = state->collections.find(name);
+    const auto coll = it != state->collections.end() ? it->second : nullptr;
+    const auto r = c_ejdb::rmcoll(m_db.get(), name.c_str(), unlink_file);
+    if(!r) {
         ec = error();
+        return r;
+    }
+    state->collections.erase(name);
+    state->invalidate_info();
+    if(coll != nullptr) {
+        // its address may be reused by a new collection
+        std::lock_guard<std::mutex> capped_lock{state->capped_mutex};
+        state->capped.erase(coll);
+        state->any_capped.store(!state->capped.empty(), std::memory_order_relaxed);
+    }
     return r;
 }
 
@@ -211,9 +1101,31 @@ void db::remove_collection(const std::string& name, bool unlink_file) {
 const std::vector<collection> db::get_collections() const {
     if(!m_db)
         return {};
-    auto colls = c_ejdb::getcolls(m_db.get());
-    auto range = boost::adaptors::transform(colls, [this](EJCOLL* c) -> collection { return collection{m_db, c}; });
-    return {range.begin(), range.end()};
+    const auto state = state_of(m_db);
+    std::shared_lock<std::shared_timed_mutex> lock{state->registry_mutex};
+    std::vector<collection> colls;
+    colls.reserve(state->collections.size());
+    for(auto&& c : state->collections)
+        colls.push_back(collection{m_db, c.second, c.first});
+    return colls;
+}
+
+//! Returns whether \p name is that of an update operator, e.g. `$set` or `$dropall`.
+static bool is_update_operator(std::experimental::string_view name) noexcept {
+    static constexpr std::array<const char*, 12> operators{{"$set", "$unset", "$inc", "$dropall", "$addToSet",
+                                                            "$addToSetAll", "$pull", "$pullAll", "$push",
+                                                            "$pushAll", "$upsert", "$rename"}};
+    return std::any_of(operators.begin(), operators.end(), [&](const char* op) { return name == op; });
+}
+
+//! Returns whether the query object \p source contains update operators, e.g. `$set` or `$dropall`.
+static bool has_update_operators(const std::vector<char>& source) noexcept {
+    bool found{false};
+    detail::bson_for_each(source.data(), source.size(), [&](const detail::bson_element& e) {
+        found = is_update_operator(e.name);
+        return !found;
+    });
+    return found;
 }
 
 /*!
@@ -307,12 +1219,16 @@ query db::create_query(const std::vector<char>& doc, std::error_code& ec) {
         ec = error();
         return {};
     }
+    trace_scope trace{state_of(m_db), trace_op::compile_query, &ec};
     const auto r = c_ejdb::createquery(m_db.get(), doc.data());
     if(!r) {
         ec = error();
         return query{};
     }
-    return query{m_db, r};
+    query qry{m_db, r};
+    qry.m_source = doc;
+    qry.m_updates = has_update_operators(doc);
+    return qry;
 }
 
 /*!
@@ -337,6 +1253,9 @@ query db::create_query(const std::vector<char>& doc) {
  * \return true on success, false on failure.
  */
 bool db::sync(std::error_code& ec) noexcept {
+    const auto state = state_of(m_db);
+    op_timer timer{state, stat_op::sync};
+    trace_scope trace{state, trace_op::sync, &ec};
     const auto r = m_db && c_ejdb::syncdb(m_db.get());
     if(!r)
         ec = error();
@@ -383,110 +1302,1917 @@ std::vector<char> db::metadata() {
     return meta;
 }
 
-collection::collection(std::weak_ptr<EJDB> db, EJCOLL* coll) noexcept : m_db(db), m_coll(coll) {}
+//! Returns the size of the file at \p path, or zero if it doesn't exist.
+static uint64_t file_size(const std::string& path) noexcept {
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0u;
+}
 
-collection::operator bool() const noexcept { return !m_db.expired() && m_coll != nullptr; }
+//! Returns the string value of the field \p name in the BSON document at \p data, or an empty string.
+static std::string string_field(const char* data, size_t size, std::experimental::string_view name) {
+    const auto e = detail::bson_find(data, size, name);
+    const auto str = e ? e->as_string() : std::experimental::nullopt;
+    return str ? str->to_string() : std::string{};
+}
 
-/*!
- * \brief collection::save_document
- * \param data BSON document to be saved.
- * \param[out] ec Set to an appropriate error code on failure.
- * \return OID of saved document on success, std::experimental::nullopt on failure.
- */
-std::experimental::optional<std::array<char, 12>> collection::save_document(const std::vector<char>& data,
-                                                                            std::error_code& ec) {
-    return save_document(data, false, ec);
+//! Returns the numeric value of the field \p name in the BSON document at \p data, or zero.
+static int64_t number_field(const char* data, size_t size, std::experimental::string_view name) noexcept {
+    const auto e = detail::bson_find(data, size, name);
+    const auto num = e ? e->as_number() : std::experimental::nullopt;
+    return num ? static_cast<int64_t>(*num) : 0;
+}
+
+//! Returns the boolean value of the field \p name in the BSON document at \p data, or false.
+static bool bool_field(const char* data, size_t size, std::experimental::string_view name) noexcept {
+    const auto e = detail::bson_find(data, size, name);
+    return e && e->type == detail::bson_type::boolean && e->value[0] != 0;
 }
 
 /*!
- * \param doc BSON document to be saved.
- * \param merge Whether or not to merge with an existing, matching document.
- * \param[out] ec Set to an appropriate error code on failure.
- * \return OID of saved document on success, std::experimental::nullopt on failure.
+ * \brief Returns the type of an index from its EJDB internal name, which is prefixed by a character denoting its type.
  */
-std::experimental::optional<std::array<char, 12>> collection::save_document(const std::vector<char>& doc, bool merge,
-                                                                            std::error_code& ec) {
-    if(m_coll == nullptr) {
-        ec = std::make_error_code(std::errc::operation_not_permitted);
-        return std::experimental::nullopt;
-    }
-
-    std::array<char, 12> oid;
-    int err{0};
-    const auto r = c_ejdb::savebson(m_coll, doc, oid.data(), merge, &err);
-    if(!r) {
-        if(err)
-            ec = make_error_code((ejdb::errc)err);
-        else
-            ec = db::error(m_db);
-        return std::experimental::nullopt;
+static index_mode index_type(const std::string& iname) noexcept {
+    switch(iname.empty() ? '\0' : iname.front()) {
+        case 'n':
+            return index_mode::number;
+        case 'i':
+            return index_mode::istring;
+        case 'a':
+            return index_mode::array;
+        default:
+            return index_mode::string;
     }
-    return oid;
 }
 
 /*!
- * \param data BSON document to be saved.
- * \param merge Whether or not to merge with an existing, matching document. Default = false.
- * \return OID of saved document.
+ * \brief Reads a db_info from the BSON returned by `ejdbmeta`, including the sizes of the files described.
  *
- * \throws std::system_error with appropriate error code and message on failure.
+ * \return nullptr if \p meta is malformed.
  */
-std::array<char, 12> collection::save_document(const std::vector<char>& data, bool merge) {
-    std::error_code ec;
-    auto oid = save_document(data, merge, ec);
-    assert(static_cast<bool>(oid) == !ec);
-    if(ec)
-        throw std::system_error(ec, "could not save document");
-    return *oid;
+static std::shared_ptr<db_info> read_info(const std::vector<char>& meta) {
+    using detail::bson_element;
+    using detail::bson_type;
+    auto info = std::make_shared<db_info>();
+    info->file = string_field(meta.data(), meta.size(), "file");
+    info->file_size = file_size(info->file);
+
+    const auto colls = detail::bson_find(meta, "collections");
+    if(!colls || colls->type != bson_type::array)
+        return nullptr;
+    const auto valid = detail::bson_for_each(colls->value, colls->size, [&](const bson_element& c) {
+        if(c.type != bson_type::document)
+            return false;
+        collection_info coll;
+        coll.name = string_field(c.value, c.size, "name");
+        coll.file = string_field(c.value, c.size, "file");
+        coll.file_size = file_size(coll.file);
+        coll.records = number_field(c.value, c.size, "records");
+        if(auto opts = detail::bson_find(c.value, c.size, "options")) {
+            coll.options.buckets = number_field(opts->value, opts->size, "buckets");
+            coll.options.cached_records = number_field(opts->value, opts->size, "cachedrecords");
+            coll.options.large = bool_field(opts->value, opts->size, "large");
+            coll.options.compressed = bool_field(opts->value, opts->size, "compressed");
+        }
+        const auto indexes = detail::bson_find(c.value, c.size, "indexes");
+        if(indexes && indexes->type == bson_type::array &&
+           !detail::bson_for_each(indexes->value, indexes->size, [&](const bson_element& i) {
+               if(i.type != bson_type::document)
+                   return false;
+               index_info idx;
+               idx.field = string_field(i.value, i.size, "field");
+               idx.name = string_field(i.value, i.size, "iname");
+               idx.type = index_type(idx.name);
+               idx.records = number_field(i.value, i.size, "records");
+               idx.file = string_field(i.value, i.size, "file");
+               idx.file_size = file_size(idx.file);
+               coll.indexes.push_back(std::move(idx));
+               return true;
+           }))
+            return false;
+        info->collections.push_back(std::move(coll));
+        return true;
+    });
+    return valid ? info : nullptr;
 }
 
 /*!
- * \param oid OID of the document to fetch.
+ * The description is read from `ejdbmeta` on first call, then cached until a collection is created or removed, an
+ * index is set, or documents are saved, removed or updated through this library.
+ * Repeated calls on an unchanged database are therefore cheap, and return the same object.
+ *
+ * Changes made by other processes are not detected.
+ *
  * \param[out] ec Set to an appropriate error code on failure.
- * \return Document corresponding to \p oid on success, empty vector on failure or if \p oid has no match.
+ * \return Description of the database on success, nullptr on failure.
  */
-std::vector<char> collection::load_document(std::array<char, 12> oid, std::error_code& ec) const {
-    if(m_coll == nullptr) {
-        ec = std::make_error_code(std::errc::operation_not_permitted);
-        return {};
+std::shared_ptr<const db_info> db::info(std::error_code& ec) const {
+    const auto state = state_of(m_db);
+    if(state == nullptr) {
+        ec = error();
+        return nullptr;
     }
+    std::lock_guard<std::mutex> lock{state->info_mutex};
+    // cleared before reading, so that concurrent changes mark the new description stale
+    if(!state->info_stale.exchange(false) && state->db_info)
+        return state->db_info;
 
-    auto vec = c_ejdb::loadbson(m_coll, oid.data());
-    if(vec.empty())
-        ec = db::error(m_db);
-    return vec;
+    const auto meta = c_ejdb::metadb(m_db.get());
+    if(meta.empty()) {
+        state->info_stale = true;
+        ec = error();
+        return nullptr;
+    }
+    auto info = read_info(meta);
+    if(!info) {
+        state->info_stale = true;
+        ec = errc::invalid_metadata;
+        return nullptr;
+    }
+    state->db_info = std::move(info);
+    return state->db_info;
 }
 
 /*!
- * \param oid OID of the document to fetch.
- * \return Document corresponding to \p oid. Or empty vector if \p oid has no match.
- *
  * \throws std::system_error with appropriate error code and message on failure.
+ * \sa info(std::error_code&) const
  */
-std::vector<char> collection::load_document(std::array<char, 12> oid) const {
+std::shared_ptr<const db_info> db::info() const {
     std::error_code ec;
-    auto doc = load_document(oid, ec);
+    auto i = info(ec);
+    assert(static_cast<bool>(i) == !ec);
     if(ec)
-        throw std::system_error(ec, "could not load document");
-    return doc;
+        throw std::system_error(ec, "could not get database info");
+    return i;
 }
 
 /*!
- * \param oid OID of the document to remove.
- * \param[out] ec Set to an appropriate error code on failure.
- * \return true on success, false on failure.
+ * \brief Runs \p task for each index in [0, \p count) on up to \p threads threads.
+ *
+ * \p done is called on the calling thread with each index and the error returned by \p task, in order of completion.
+ * Should \p done throw, no further tasks are started, and the exception is rethrown once running tasks complete.
  */
-bool collection::remove_document(std::array<char, 12> oid, std::error_code& ec) noexcept {
-    if(m_coll == nullptr) {
+template <typename Task, typename Done>
+static void parallel_for_each(size_t count, unsigned threads, Task&& task, Done&& done) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::pair<size_t, std::error_code>> finished;
+    std::atomic<size_t> next{0};
+    size_t active = std::max<size_t>(std::min<size_t>(threads, count), 1u);
+
+    const auto worker = [&] {
+        for(size_t i; (i = next++) < count;) {
+            std::error_code ec;
+            try {
+                ec = task(i);
+            } catch(...) {
+                ec = errc::import_export_error;
+            }
+            std::lock_guard<std::mutex> lock{mutex};
+            finished.emplace_back(i, ec);
+            cv.notify_one();
+        }
+        std::lock_guard<std::mutex> lock{mutex};
+        --active;
+        cv.notify_one();
+    };
+    std::vector<std::thread> pool;
+    for(size_t i = 0, n = active; i < n; ++i)
+        pool.emplace_back(worker);
+
+    std::exception_ptr error;
+    std::unique_lock<std::mutex> lock{mutex};
+    while(true) {
+        cv.wait(lock, [&] { return !finished.empty() || active == 0; });
+        if(finished.empty())
+            break;
+        const auto f = finished.front();
+        finished.pop_front();
+        lock.unlock();
+        if(!error) {
+            try {
+                done(f.first, f.second);
+            } catch(...) {
+                error = std::current_exception();
+                next = count;
+            }
+        }
+        lock.lock();
+    }
+    lock.unlock();
+    for(auto&& t : pool)
+        t.join();
+    if(error)
+        std::rethrow_exception(error);
+}
+
+/*!
+ * Each collection is written to `<path>/<name>.bson` or `<path>/<name>.json`, with its options and indexes written to
+ * `<path>/<name>-meta.json`.
+ * Collections are exported concurrently on up to export_options::threads threads.
+ * Export of the remaining collections continues after one fails.
+ *
+ * \param path Directory to write to. Created if it doesn't exist.
+ * \param collections Names of collections to export. All collections are exported when empty.
+ * \param options Format, concurrency and progress callback.
+ * \param[out] ec Set to the first error on failure.
+ * \return true on success, false on failure.
+ */
+bool db::export_to(const std::string& path, const std::vector<std::string>& collections,
+                   const export_options& options, std::error_code& ec) const {
+    if(!m_db) {
+        ec = error();
+        return false;
+    }
+    auto names = collections;
+    if(names.empty()) {
+        const auto state = state_of(m_db);
+        std::shared_lock<std::shared_timed_mutex> lock{state->registry_mutex};
+        for(auto&& c : state->collections)
+            names.push_back(c.first.to_string());
+    }
+
+    const auto flags = static_cast<std::underlying_type<export_format>::type>(options.format);
+    const auto threads = options.threads != 0 ? options.threads : std::max(std::thread::hardware_concurrency(), 1u);
+    size_t completed{0};
+    parallel_for_each(names.size(), threads,
+                      [&](size_t i) -> std::error_code {
+                          if(c_ejdb::exportdb(m_db.get(), path.c_str(), {names[i]}, flags))
+                              return {};
+                          const auto err = error();
+                          return err ? err : errc::import_export_error;
+                      },
+                      [&](size_t i, const std::error_code& err) {
+                          if(err && !ec)
+                              ec = err;
+                          if(options.progress)
+                              options.progress(transfer_progress{names[i], ++completed, names.size(), err});
+                      });
+    return !ec;
+}
+
+/*!
+ * \throws std::system_error with appropriate error code and message on failure.
+ * \sa export_to(const std::string&,const std::vector<std::string>&,const export_options&,std::error_code&) const
+ */
+void db::export_to(const std::string& path, const std::vector<std::string>& collections,
+                   const export_options& options) const {
+    std::error_code ec;
+    auto r = export_to(path, collections, options, ec);
+    (void)r;
+    assert(r == !ec);
+    if(ec)
+        throw std::system_error(ec, "could not export database");
+}
+
+//! Returns the error code corresponding to errno.
+static std::error_code errno_code() noexcept { return {errno, std::generic_category()}; }
+
+//! Closes a file descriptor on destruction.
+struct fd_closer {
+    //! Destructor.
+    ~fd_closer() {
+        if(fd >= 0)
+            ::close(fd);
+    }
+    //! File descriptor to close.
+    int fd;
+};
+
+/*!
+ * \brief Copies the file \p from to \p to.
+ *
+ * Where supported, the copy is a reflink, sharing the extents of \p from, which takes constant time.
+ * Otherwise the data is copied in the kernel with `copy_file_range`, or failing that, with `read` and `write`.
+ */
+static std::error_code clone_file(const std::string& from, const std::string& to) {
+    const fd_closer in{::open(from.c_str(), O_RDONLY | O_CLOEXEC)};
+    if(in.fd < 0)
+        return errno_code();
+    struct stat st;
+    if(::fstat(in.fd, &st) != 0)
+        return errno_code();
+    const fd_closer out{::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 0777)};
+    if(out.fd < 0)
+        return errno_code();
+
+    bool copied{false};
+#ifdef FICLONE
+    copied = ::ioctl(out.fd, FICLONE, in.fd) == 0;
+#endif
+#ifdef SYS_copy_file_range
+    // continues from the current offsets of both files, which are advanced as data is copied
+    for(auto remaining = st.st_size; !copied;) {
+        const auto n =
+            ::syscall(SYS_copy_file_range, in.fd, nullptr, out.fd, nullptr, static_cast<size_t>(remaining), 0u);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP)
+            return errno_code();
+        if(n <= 0)
+            break;
+        remaining -= n;
+        copied = remaining <= 0;
+    }
+#endif
+    std::array<char, 1 << 16> buf;
+    while(!copied) {
+        const auto n = ::read(in.fd, buf.data(), buf.size());
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return errno_code();
+        copied = n == 0;
+        for(ssize_t written = 0; written < n;) {
+            const auto w = ::write(out.fd, buf.data() + written, static_cast<size_t>(n - written));
+            if(w < 0 && errno != EINTR)
+                return errno_code();
+            written += std::max<ssize_t>(w, 0);
+        }
+    }
+    if(::fsync(out.fd) != 0)
+        return errno_code();
+    return {};
+}
+
+//! Releases the collection locks taken by db::snapshot on destruction.
+struct collection_locks {
+    //! Destructor.
+    ~collection_locks() {
+        for(auto coll : colls)
+            c_ejdb::unlockcoll(coll);
+    }
+    //! Locked collections.
+    std::vector<EJCOLL*> colls;
+};
+
+/*!
+ * Each collection is locked in turn, as EJDB does for modifications, and flushed to disk.
+ * The database's metadata, collection and index files are then copied to \p dest_dir before the locks are released,
+ * so the copy is consistent across collections.
+ * Operations on the database's collections are blocked while locked, until the copy completes, and creation or removal
+ * of collections is blocked throughout.
+ *
+ * On filesystems supporting reflinks, e.g. Btrfs and XFS, copies share the extents of the original files, so take
+ * constant time, regardless of the size of the database.
+ * Elsewhere, files are copied in full while operations are blocked.
+ *
+ * The copy can be opened as a database at `<dest_dir>/<name>`, where `<name>` is the filename of this database.
+ *
+ * \param dest_dir Directory to copy files to. Created if it doesn't exist. Existing files are overwritten.
+ * \param[out] ec Set to an appropriate error code on failure.
+ *        Set to std::errc::device_or_resource_busy when a transaction is in progress on any collection, and
+ *        std::errc::invalid_argument when \p dest_dir is the database's own directory.
+ * \return true on success, false on failure.
+ */
+bool db::snapshot(const std::string& dest_dir, std::error_code& ec) const {
+    if(!m_db) {
+        ec = error();
+        return false;
+    }
+    if(::mkdir(dest_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        ec = errno_code();
+        return false;
+    }
+    const auto path = c_ejdb::dbpath(m_db.get());
+    const auto sep = path.rfind('/');
+    const auto dir = sep == std::string::npos ? std::string{"."} : path.substr(0, sep);
+    const auto base = sep == std::string::npos ? path : path.substr(sep + 1);
+
+    struct stat dest_st, dir_st;
+    if(::stat(dest_dir.c_str(), &dest_st) != 0 || ::stat(dir.c_str(), &dir_st) != 0) {
+        ec = errno_code();
+        return false;
+    }
+    if(dest_st.st_dev == dir_st.st_dev && dest_st.st_ino == dir_st.st_ino) {
+        ec = std::make_error_code(std::errc::invalid_argument); // would truncate the files being copied
+        return false;
+    }
+
+    const auto state = state_of(m_db);
+    std::lock_guard<std::shared_timed_mutex> registry_lock{state->registry_mutex};
+    collection_locks locks;
+    // collection files are named "<base>_<collection>", and their index files "<base>_<collection>.idx.<...>"
+    std::vector<std::string> prefixes;
+    for(auto coll : c_ejdb::getcolls(m_db.get())) {
+        prefixes.push_back(base + '_' + c_ejdb::collection_name(coll));
+        if(!c_ejdb::lockcoll(coll)) {
+            ec = std::make_error_code(std::errc::resource_unavailable_try_again);
+            return false;
+        }
+        locks.colls.push_back(coll);
+        if(c_ejdb::intran_locked(coll)) {
+            ec = std::make_error_code(std::errc::device_or_resource_busy);
+            return false;
+        }
+        if(!c_ejdb::synccoll_locked(coll)) {
+            ec = error();
+            return false;
+        }
+    }
+    if(!c_ejdb::syncmeta(m_db.get())) {
+        ec = error();
+        return false;
+    }
+
+    // the metadata file, and the collection and index files of the collections locked
+    const auto is_db_file = [&](const std::string& name) {
+        if(name == base)
+            return true;
+        return std::any_of(prefixes.begin(), prefixes.end(), [&](const std::string& prefix) {
+            static const std::string idx{".idx."};
+            return name.compare(0, prefix.size(), prefix) == 0 &&
+                   (name.size() == prefix.size() || name.compare(prefix.size(), idx.size(), idx) == 0);
+        });
+    };
+    const std::unique_ptr<DIR, int (*)(DIR*)> entries{::opendir(dir.c_str()), &::closedir};
+    if(!entries) {
+        ec = errno_code();
+        return false;
+    }
+    while(const auto entry = ::readdir(entries.get())) {
+        const std::string name{entry->d_name};
+        if(!is_db_file(name))
+            continue;
+        if(name.size() > 4 && name.compare(name.size() - 4, 4, ".wal") == 0)
+            continue;
+        struct stat st;
+        if(::stat((dir + '/' + name).c_str(), &st) != 0) {
+            ec = errno_code();
+            return false;
+        }
+        if(!S_ISREG(st.st_mode))
+            continue;
+        ec = clone_file(dir + '/' + name, dest_dir + '/' + name);
+        if(ec)
+            return false;
+    }
+    return true;
+}
+
+/*!
+ * \throws std::system_error with appropriate error code and message on failure.
+ * \sa snapshot(const std::string&,std::error_code&) const
+ */
+void db::snapshot(const std::string& dest_dir) const {
+    std::error_code ec;
+    auto r = snapshot(dest_dir, ec);
+    (void)r;
+    assert(r == !ec);
+    if(ec)
+        throw std::system_error(ec, "could not snapshot database");
+}
+
+//! Position in the change log up to which a replica has been updated by db::replicate_to.
+struct replication_checkpoint {
+    //! \sa db_state::change_log_epoch
+    uint64_t epoch;
+    //! Sequence number of the last change applied.
+    uint64_t seq;
+};
+
+//! Reads the checkpoint at \p path, or returns std::experimental::nullopt if there is none.
+static std::experimental::optional<replication_checkpoint> read_checkpoint(const std::string& path) {
+    std::ifstream is{path};
+    replication_checkpoint checkpoint;
+    if(!(is >> checkpoint.epoch >> checkpoint.seq))
+        return std::experimental::nullopt;
+    return checkpoint;
+}
+
+//! Durably replaces the checkpoint at \p path, via a temporary file renamed over it.
+static std::error_code write_checkpoint(const std::string& path, replication_checkpoint checkpoint) {
+    const auto tmp = path + ".tmp";
+    const auto contents = std::to_string(checkpoint.epoch) + ' ' + std::to_string(checkpoint.seq) + '\n';
+    {
+        const fd_closer out{::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)};
+        if(out.fd < 0)
+            return errno_code();
+        for(size_t written = 0; written < contents.size();) {
+            const auto w = ::write(out.fd, contents.data() + written, contents.size() - written);
+            if(w < 0 && errno != EINTR)
+                return errno_code();
+            written += static_cast<size_t>(std::max<ssize_t>(w, 0));
+        }
+        if(::fsync(out.fd) != 0)
+            return errno_code();
+    }
+    if(::rename(tmp.c_str(), path.c_str()) != 0)
+        return errno_code();
+    return {};
+}
+
+//! Returns \p doc with an `_id` of \p oid, replacing any other `_id`.
+static std::vector<char> with_oid(const std::vector<char>& doc, const std::array<char, 12>& oid) {
+    const auto id = detail::bson_find(doc, "_id");
+    if(id && id->type == detail::bson_type::oid && std::equal(oid.begin(), oid.end(), id->value))
+        return doc;
+    detail::bson_builder b;
+    b.append_oid("_id", oid.data());
+    detail::bson_for_each(doc.data(), doc.size(), [&](const detail::bson_element& e) {
+        if(e.name != "_id")
+            b.append(e);
+        return true;
+    });
+    return b.finish();
+}
+
+/*!
+ * \brief Writes to the collections of a replica in transactions, committed once a batch is complete.
+ *
+ * Batches are of a single collection, so that each is committed atomically.
+ * Transactions still in progress on destruction, i.e. after a failure, are aborted.
+ */
+struct replica_writer {
+    explicit replica_writer(db& replica) noexcept : m_replica(replica) {}
+
+    ~replica_writer() {
+        for(auto coll : m_in_transaction)
+            coll->transaction().abort();
+    }
+
+    //! Returns the replica's collection named \p name, within a transaction, creating it if necessary.
+    collection* get(const std::string& name, std::error_code& ec) {
+        auto it = m_collections.find(name);
+        if(it == m_collections.end()) {
+            auto coll = m_replica.create_collection(name, ec);
+            if(ec)
+                return nullptr;
+            it = m_collections.emplace(name, std::move(coll)).first;
+        }
+        auto coll = &it->second;
+        if(std::find(m_in_transaction.begin(), m_in_transaction.end(), coll) == m_in_transaction.end()) {
+            if(!coll->transaction().start()) {
+                ec = m_replica.error();
+                return nullptr;
+            }
+            m_in_transaction.push_back(coll);
+        }
+        return coll;
+    }
+
+    //! Commits the transaction of every collection written to since the last commit.
+    bool commit(std::error_code& ec) {
+        while(!m_in_transaction.empty()) {
+            const auto coll = m_in_transaction.back();
+            m_in_transaction.pop_back();
+            if(!coll->transaction().commit()) {
+                ec = m_replica.error();
+                return false;
+            }
+        }
+        return true;
+    }
+
+  private:
+    db& m_replica;
+    // nodes are stable, as transaction_t refers to its collection
+    std::unordered_map<std::string, collection> m_collections;
+    std::vector<collection*> m_in_transaction;
+};
+
+/*!
+ * \brief Copies every collection of \p source, with their indexes and documents, to \p replica.
+ *
+ * Each collection is copied while no transaction is in progress on it, and with writes to it held back, so that the
+ * copy reflects exactly the changes recorded up to the sequence number appended to \p copied with its name.
+ * Documents are copied in transactions of \p batch_size documents.
+ */
+bool db::copy_collections(db source, db& replica, size_t batch_size,
+                          std::vector<std::pair<std::string, uint64_t>>& copied, std::error_code& ec) {
+    const auto info = source.info(ec);
+    if(!info)
+        return false;
+    auto all = source.create_query(detail::bson_builder{}.finish(), ec);
+    if(ec)
+        return false;
+    const auto state = state_of(source.m_db);
+    // lets transactions on the collection copied begin
+    struct copying_guard {
+        ~copying_guard() {
+            {
+                std::lock_guard<std::mutex> lock{state->transaction_mutex};
+                state->copying = nullptr;
+            }
+            state->transaction_cv.notify_all();
+        }
+        db_state* state;
+    };
+    for(auto&& coll_info : info->collections) {
+        auto from = source.get_collection(coll_info.name, ec);
+        if(ec)
+            return false;
+        if(!from) // removed since
+            continue;
+        replica_writer writer{replica};
+        auto to = writer.get(coll_info.name, ec);
+        if(to == nullptr)
+            return false;
+        for(auto&& index : coll_info.indexes)
+            if(!to->set_index(index.field, index.type, ec))
+                return false;
+
+        // transactions on the collection wait until it's copied
+        {
+            std::unique_lock<std::mutex> lock{state->transaction_mutex};
+            state->transaction_cv.wait(lock, [&] {
+                std::lock_guard<std::mutex> change_lock{state->change_mutex};
+                return state->transactions.count(from.m_coll) == 0;
+            });
+            state->copying = from.m_coll;
+        }
+        const copying_guard guard{state};
+        const std::unique_lock<std::shared_timed_mutex> write_lock{state->write_mutex(from.m_coll)};
+        copied.emplace_back(coll_info.name, source.last_change_seq());
+
+        size_t n{0};
+        from.for_each(all, [&](const char* data, size_t size) {
+            if(n > 0 && n % batch_size == 0 && (!writer.commit(ec) || writer.get(coll_info.name, ec) == nullptr))
+                return false;
+            ++n;
+            return static_cast<bool>(to->save_document(std::vector<char>(data, data + size), false, ec));
+        });
+        if(ec || !writer.commit(ec))
+            return false;
+    }
+    return true;
+}
+
+/*!
+ * \brief Notes the successful execution of a query with update operators on \p coll.
+ *
+ * The query is given by \p source and \p ors, and was executed with \p mode and \p hints.
+ */
+static void record_update(db_state* state, EJCOLL* coll, const std::vector<char>& source,
+                          const std::vector<std::vector<char>>& ors, query_search_mode mode,
+                          const std::vector<char>& hints) {
+    state->invalidate_info();
+    state->record_change(coll, change_op::update, nullptr, [&] { return source; }, ors, mode, hints);
+}
+
+//! Applies \p changes to \p replica, within a single transaction on each collection changed.
+bool db::apply_changes(db& replica, std::vector<change>::const_iterator first,
+                       std::vector<change>::const_iterator last, std::error_code& ec) {
+    replica_writer writer{replica};
+    for(; first != last; ++first) {
+        auto coll = writer.get(first->collection, ec);
+        if(coll == nullptr)
+            return false;
+        switch(first->op) {
+            case change_op::save:
+            case change_op::merge:
+                if(!coll->save_document(with_oid(first->document, first->oid), first->op == change_op::merge, ec))
+                    return false;
+                break;
+            case change_op::remove:
+                // already removed when a change is applied again, after a failure to write the checkpoint
+                if(!coll->remove_document(first->oid, ec) && ec != errc::no_record_found)
+                    return false;
+                ec.clear();
+                break;
+            case change_op::update: {
+                auto qry = replica.create_query(first->document, ec);
+                if(ec)
+                    return false;
+                for(auto&& obj : first->ors)
+                    qry |= obj;
+                if(!first->hints.empty())
+                    qry.set_hints(first->hints);
+                if(!qry) {
+                    ec = replica.error();
+                    return false;
+                }
+                // results are unused, so only first_only affects which documents are updated
+                const auto mode = query_search_mode::count_only | (first->mode & query_search_mode::first_only);
+                std::shared_lock<std::shared_timed_mutex> write_lock;
+                if(coll->m_state)
+                    write_lock = coll->m_state->lock_writes(coll->m_coll);
+                uint32_t count{0};
+                const auto list = c_ejdb::qryexecute(coll->m_coll, qry.m_qry.get(), &count,
+                                                     (std::underlying_type<query_search_mode>::type)mode);
+                if(list == nullptr) {
+                    ec = replica.error();
+                    return false;
+                }
+                c_ejdb::qresultdispose(list);
+                if(coll->m_state)
+                    record_update(coll->m_state.get(), coll->m_coll, qry.m_source, qry.m_ors, first->mode,
+                                  first->hints);
+                break;
+            }
+        }
+    }
+    return writer.commit(ec);
+}
+
+/*!
+ * The replica is first brought up to date by copying every collection, with its indexes and documents, in
+ * transactions of options.batch_size documents. This "catch-up" happens on the first replication to \p replica_path,
+ * and whenever changes since the last replication are no longer available, e.g. once this database has been reopened,
+ * or more changes have been made than the change log retains.
+ * Each collection is copied once any transaction in progress on it has ended, with writes to it held back and new
+ * transactions on it waiting until the copy is complete, so that the copy corresponds to a position in the change log.
+ * Changes to the collection after that position are then applied, as below.
+ *
+ * Otherwise, and after catching up, changes recorded in the change log since the last replication are applied, in
+ * transactions of up to options.batch_size changes to a single collection. The replica can therefore be kept up to
+ * date by calling replicate_to periodically, at a cost proportional to the changes made since.
+ *
+ * After each transaction, the sequence number of the last change applied is saved as a checkpoint in
+ * `<replica_path>.checkpoint`, so that replication resumes from there. When catching up, it's first saved once the
+ * changes made to every collection while copying the others have been applied.
+ * Should the checkpoint fail to be saved after a transaction is committed, e.g. as the process exits, the
+ * transaction's changes are applied again by the next replication. Saves and removals are unaffected, but updates
+ * with non-idempotent operators, such as `$inc`, are repeated.
+ *
+ * Updates are replayed with the search mode and hints they were executed with. A document inserted by an `$upsert`
+ * update is given a new OID by each database, so it differs between the replica and this database.
+ *
+ * Changes recorded once replicate_to has read the change log, after copying when catching up, are left to the next
+ * replication.
+ * The replica should not be modified other than by replicate_to.
+ * Removal of collections, and changes of indexes once caught up, are not replicated.
+ *
+ * \param replica_path Path of the replica database. Created if it doesn't exist.
+ * \param options Transaction size.
+ * \param[out] ec Set to an appropriate error code on failure.
+ *        Set to std::errc::operation_not_permitted when the change log is disabled (see set_change_log_capacity).
+ *        Set to std::errc::result_out_of_range when more changes were made while catching up than the change log
+ *        retains.
+ * \return true on success, false on failure.
+ */
+bool db::replicate_to(const std::string& replica_path, const replicate_options& options, std::error_code& ec) const {
+    if(!m_db) {
+        ec = error();
+        return false;
+    }
+    const auto state = state_of(m_db);
+    uint64_t epoch{0};
+    {
+        std::lock_guard<std::mutex> lock{state->change_mutex};
+        if(state->change_capacity == 0) {
+            ec = std::make_error_code(std::errc::operation_not_permitted);
+            return false;
+        }
+        epoch = state->change_log_epoch;
+    }
+    const auto batch_size = std::max<size_t>(options.batch_size, 1);
+    const auto checkpoint_path = replica_path + ".checkpoint";
+    std::lock_guard<std::mutex> replication_lock{state->replication_mutex};
+
+    const auto checkpoint = read_checkpoint(checkpoint_path);
+    auto catch_up = !checkpoint || checkpoint->epoch != epoch;
+    auto seq = catch_up ? 0 : checkpoint->seq;
+    std::vector<change> changes;
+    if(!catch_up) {
+        changes = changes_since(seq, ec);
+        catch_up = ec == std::errc::result_out_of_range;
+        if(ec && !catch_up)
+            return false;
+        ec.clear();
+    }
+
+    db replica;
+    auto mode = db_mode::read | db_mode::write | db_mode::create;
+    if(catch_up) {
+        // until the copy is complete
+        ::unlink(checkpoint_path.c_str());
+        mode = mode | db_mode::truncate;
+    }
+    if(!replica.open(replica_path, mode, ec))
+        return false;
+
+    // no checkpoint is valid before every copied collection's changes up to its copy are passed
+    uint64_t copied_seq{0};
+    if(catch_up) {
+        // changes to each collection from when it was copied are applied below, as well as changes to collections
+        // created since they were listed
+        seq = last_change_seq();
+        std::vector<std::pair<std::string, uint64_t>> copied;
+        if(!copy_collections(*this, replica, batch_size, copied, ec))
+            return false;
+        changes = changes_since(seq, ec);
+        if(ec)
+            return false;
+        const auto in_copy = [&](const change& c) {
+            const auto it =
+                std::find_if(copied.begin(), copied.end(), [&](auto&& p) { return p.first == c.collection; });
+            return it != copied.end() && c.seq <= it->second;
+        };
+        changes.erase(std::remove_if(changes.begin(), changes.end(), in_copy), changes.end());
+        for(auto&& p : copied)
+            copied_seq = std::max(copied_seq, p.second);
+    }
+
+    try {
+        bool checkpointed{!catch_up};
+        for(auto it = changes.cbegin(); it != changes.cend();) {
+            auto last = it;
+            while(last != changes.cend() && last->collection == it->collection &&
+                  static_cast<size_t>(std::distance(it, last)) < batch_size)
+                ++last;
+            if(!apply_changes(replica, it, last, ec))
+                return false;
+            it = last;
+            seq = std::prev(it)->seq;
+            if(seq < copied_seq)
+                continue;
+            ec = write_checkpoint(checkpoint_path, {epoch, seq});
+            if(ec)
+                return false;
+            checkpointed = true;
+        }
+        if(!checkpointed) {
+            ec = write_checkpoint(checkpoint_path, {epoch, std::max(seq, copied_seq)});
+            if(ec)
+                return false;
+        }
+    } catch(const std::system_error& e) {
+        ec = e.code();
+        return false;
+    }
+    return true;
+}
+
+/*!
+ * \throws std::system_error with appropriate error code and message on failure.
+ * \sa replicate_to(const std::string&,const replicate_options&,std::error_code&) const
+ */
+void db::replicate_to(const std::string& replica_path, const replicate_options& options) const {
+    std::error_code ec;
+    auto r = replicate_to(replica_path, options, ec);
+    (void)r;
+    assert(r == !ec);
+    if(ec)
+        throw std::system_error(ec, "could not replicate database");
+}
+
+//! Returns the names of collections exported to the directory \p path in \p format, sorted.
+static std::vector<std::string> exported_collections(const std::string& path, export_format format) {
+    std::vector<std::string> names;
+    const std::unique_ptr<DIR, int (*)(DIR*)> dir{::opendir(path.c_str()), &::closedir};
+    if(!dir)
+        return names;
+    const std::string ext{format == export_format::json ? ".json" : ".bson"};
+    static const std::string meta_suffix{"-meta.json"};
+    while(const auto entry = ::readdir(dir.get())) {
+        const std::string name{entry->d_name};
+        const auto ends_with = [&](const std::string& suffix) {
+            return name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+        };
+        if(ends_with(ext) && !ends_with(meta_suffix))
+            names.push_back(name.substr(0, name.size() - ext.size()));
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+/*!
+ * Reads files written by export_to.
+ * Collections which don't exist are created, along with their indexes.
+ *
+ * EJDB holds the database's write lock during an import, so collections are imported one at a time, rather than
+ * concurrently as in export_to.
+ * Import of the remaining collections continues after one fails.
+ *
+ * With import_mode::replace, existing collections are recreated, so any ejdb::collection objects referring to them
+ * must be reacquired via get_collection. Caps set by collection::set_cap on replaced collections are cleared.
+ *
+ * Imported documents aren't recorded in the change log. Instead, the next replicate_to catches up by copying every
+ * collection, as it does after the change log is enabled.
+ *
+ * \param path Directory to read from.
+ * \param collections Names of collections to import. All collections found in \p path are imported when empty.
+ * \param options Format, import mode and progress callback.
+ * \param[out] ec Set to the first error on failure.
+ * \return true on success, false on failure.
+ */
+bool db::import_from(const std::string& path, const std::vector<std::string>& collections,
+                     const import_options& options, std::error_code& ec) {
+    if(!m_db) {
+        ec = error();
+        return false;
+    }
+    const auto names = collections.empty() ? exported_collections(path, options.format) : collections;
+    const auto flags = static_cast<std::underlying_type<export_format>::type>(options.format) |
+                       static_cast<std::underlying_type<import_mode>::type>(options.mode);
+
+    const auto state = state_of(m_db);
+    if(!names.empty()) {
+        std::lock_guard<std::mutex> lock{state->change_mutex};
+        if(state->change_capacity != 0)
+            state->renew_change_log_epoch();
+    }
+    for(size_t i = 0; i < names.size(); ++i) {
+        std::error_code err;
+        {
+            std::lock_guard<std::shared_timed_mutex> lock{state->registry_mutex};
+            const auto it = state->collections.find(names[i]);
+            const auto replaced = options.mode == import_mode::replace && it != state->collections.end() ? it->second
+                                                                                                         : nullptr;
+            if(!c_ejdb::importdb(m_db.get(), path.c_str(), {names[i]}, flags)) {
+                err = error();
+                if(!err)
+                    err = errc::import_export_error;
+            }
+            // the collection may have been created or replaced
+            state->collections.clear();
+            for(auto coll : c_ejdb::getcolls(m_db.get()))
+                state->register_collection(coll);
+            if(replaced != nullptr) {
+                // as in remove_collection, its address may be reused by a new collection
+                std::lock_guard<std::mutex> capped_lock{state->capped_mutex};
+                state->capped.erase(replaced);
+                state->any_capped.store(!state->capped.empty(), std::memory_order_relaxed);
+            }
+        }
+        state->invalidate_info();
+        if(err && !ec)
+            ec = err;
+        if(options.progress)
+            options.progress(transfer_progress{names[i], i + 1, names.size(), err});
+    }
+    return !ec;
+}
+
+/*!
+ * \throws std::system_error with appropriate error code and message on failure.
+ * \sa import_from(const std::string&,const std::vector<std::string>&,const import_options&,std::error_code&)
+ */
+void db::import_from(const std::string& path, const std::vector<std::string>& collections,
+                     const import_options& options) {
+    std::error_code ec;
+    auto r = import_from(path, collections, options, ec);
+    (void)r;
+    assert(r == !ec);
+    if(ec)
+        throw std::system_error(ec, "could not import database");
+}
+
+/*!
+ * Queries without a `$fields` projection (see query::project) whose results exceed \p bytes in total are rejected
+ * before any documents are copied out of EJDB, causing collection::execute_query to throw.
+ *
+ * \param bytes Maximum total size of unprojected query results. Zero (the default) disables the limit.
+ */
+void db::set_unprojected_result_limit(size_t bytes) noexcept {
+    if(auto state = state_of(m_db))
+        state->unprojected_result_limit.store(bytes, std::memory_order_relaxed);
+}
+
+/*!
+ * \return Maximum total size of unprojected query results, or zero if unlimited.
+ * \sa set_unprojected_result_limit
+ */
+size_t db::unprojected_result_limit() const noexcept {
+    const auto state = state_of(m_db);
+    return state ? state->unprojected_result_limit.load(std::memory_order_relaxed) : 0u;
+}
+
+/*!
+ * Statistics are only recorded when built with `EJPP_STATS` defined. Otherwise, all statistics are zero.
+ *
+ * \return Statistics of operations on this db and its collections, merged from all threads.
+ */
+db_stats db::stats() const {
+    db_stats ret;
+#ifdef EJPP_STATS
+    const auto state = state_of(m_db);
+    if(state == nullptr)
+        return ret;
+    const std::array<latency_histogram*, stat_op_count> hists{
+        {&ret.save, &ret.load, &ret.remove, &ret.query, &ret.sync, &ret.commit}};
+
+    std::lock_guard<std::mutex> lock{state->stats_mutex};
+    for(auto&& thread : state->threads) {
+        const auto& stats = *thread.second;
+        for(size_t op = 0; op < stat_op_count; ++op) {
+            auto& hist = *hists[op];
+            for(size_t i = 0; i < latency_histogram::bucket_count; ++i)
+                hist.buckets[i] += stats.buckets[op][i].load(std::memory_order_relaxed);
+            hist.total_ns += stats.total_ns[op].load(std::memory_order_relaxed);
+            hist.max_ns = std::max(hist.max_ns, stats.max_ns[op].load(std::memory_order_relaxed));
+        }
+        ret.bytes_read += stats.bytes_read.load(std::memory_order_relaxed);
+        ret.bytes_written += stats.bytes_written.load(std::memory_order_relaxed);
+    }
+#endif // EJPP_STATS
+    return ret;
+}
+
+/*!
+ * Queries executing for longer than \p threshold are recorded, along with their collection, BSON documents, result
+ * count and EJDB's execution log. These are retained in a log of limited size (see set_slow_query_capacity), or
+ * passed to the function set by set_slow_query_handler.
+ *
+ * While enabled, EJDB's execution log is captured for every query, as whether a query is slow can't be known until
+ * it has executed. When disabled, queries are unaffected.
+ *
+ * \param threshold Execution time above which queries are recorded. Zero (the default) disables the slow query log.
+ */
+void db::set_slow_query_threshold(std::chrono::nanoseconds threshold) noexcept {
+    if(auto state = state_of(m_db))
+        state->slow_query_threshold.store(static_cast<int64_t>(threshold.count()), std::memory_order_relaxed);
+}
+
+/*!
+ * \return Execution time above which queries are recorded, or zero if the slow query log is disabled.
+ * \sa set_slow_query_threshold
+ */
+std::chrono::nanoseconds db::slow_query_threshold() const noexcept {
+    const auto state = state_of(m_db);
+    return std::chrono::nanoseconds{state ? state->slow_query_threshold.load(std::memory_order_relaxed) : 0};
+}
+
+/*!
+ * When full, the oldest query is discarded to make room for the newest.
+ *
+ * \param capacity Maximum number of queries retained. Default = 64.
+ */
+void db::set_slow_query_capacity(size_t capacity) {
+    const auto state = state_of(m_db);
+    if(state == nullptr)
+        return;
+    std::lock_guard<std::mutex> lock{state->slow_query_mutex};
+    state->slow_query_capacity = capacity;
+    while(state->slow_queries.size() > capacity)
+        state->slow_queries.pop_front();
+}
+
+/*!
+ * \p handler is called from the thread executing the query, after execution, and must not throw.
+ *
+ * \param handler Function to pass slow queries to. An empty function restores the slow query log.
+ */
+void db::set_slow_query_handler(std::function<void(const slow_query&)> handler) {
+    const auto state = state_of(m_db);
+    if(state == nullptr)
+        return;
+    std::lock_guard<std::mutex> lock{state->slow_query_mutex};
+    state->slow_query_handler = std::move(handler);
+}
+
+/*!
+ * \return Queries retained in the slow query log, oldest first.
+ * \sa set_slow_query_threshold
+ */
+std::vector<slow_query> db::slow_queries() const {
+    const auto state = state_of(m_db);
+    if(state == nullptr)
+        return {};
+    std::lock_guard<std::mutex> lock{state->slow_query_mutex};
+    return {state->slow_queries.begin(), state->slow_queries.end()};
+}
+
+/*!
+ * Saves, merges and removals of documents, and executions of queries with update operators, are recorded with
+ * increasing sequence numbers, so that consumers can follow changes by polling changes_since with the last sequence
+ * number seen. Changes made within a transaction are recorded when it's committed, and never if it's aborted.
+ *
+ * When full, the oldest change is discarded to make room for the newest. When disabled, writes are unaffected.
+ *
+ * \param capacity Maximum number of changes retained. Zero (the default) disables the change log.
+ */
+void db::set_change_log_capacity(size_t capacity) {
+    const auto state = state_of(m_db);
+    if(state == nullptr)
+        return;
+    std::lock_guard<std::mutex> lock{state->change_mutex};
+    if(state->change_capacity == 0 && capacity != 0)
+        state->renew_change_log_epoch();
+    state->change_capacity = capacity;
+    state->change_log_enabled.store(capacity != 0, std::memory_order_relaxed);
+    while(state->changes.size() > capacity)
+        state->changes.pop_front();
+}
+
+/*!
+ * \param seq Sequence number of the last change seen, or zero for every retained change.
+ * \param[out] ec Set to std::errc::result_out_of_range when changes after \p seq have been discarded from the
+ *                change log, in which case consumers must resynchronise by other means, e.g. db::snapshot.
+ * \return Changes with sequence numbers greater than \p seq, oldest first.
+ */
+std::vector<change> db::changes_since(uint64_t seq, std::error_code& ec) const {
+    const auto state = state_of(m_db);
+    if(state == nullptr) {
+        ec = std::make_error_code(std::errc::operation_not_permitted);
+        return {};
+    }
+    std::lock_guard<std::mutex> lock{state->change_mutex};
+    const auto last = state->last_change_seq.load(std::memory_order_relaxed);
+    const auto first = state->changes.empty() ? last + 1 : state->changes.front().seq;
+    if(seq + 1 < first) {
+        ec = std::make_error_code(std::errc::result_out_of_range);
+        return {};
+    }
+    if(seq >= last)
+        return {};
+    // sequence numbers are contiguous
+    return {std::next(state->changes.begin(), static_cast<std::ptrdiff_t>(seq + 1 - first)), state->changes.end()};
+}
+
+/*!
+ * \throws std::system_error with std::errc::result_out_of_range when changes after \p seq have been discarded.
+ */
+std::vector<change> db::changes_since(uint64_t seq) const {
+    std::error_code ec;
+    auto ret = changes_since(seq, ec);
+    if(ec)
+        throw std::system_error(ec, "could not read change log");
+    return ret;
+}
+
+/*!
+ * Changes held back by a transaction in progress are not yet numbered.
+ */
+uint64_t db::last_change_seq() const noexcept {
+    const auto state = state_of(m_db);
+    return state ? state->last_change_seq.load(std::memory_order_acquire) : 0;
+}
+
+/*!
+ * Replaced tracers are retained until the db is destroyed, as operations in progress on other threads may still be
+ * using them.
+ *
+ * \param t Tracer to be notified of operations, or nullptr to disable tracing.
+ */
+void db::set_tracer(std::shared_ptr<tracer> t) {
+    const auto state = state_of(m_db);
+    if(state == nullptr)
+        return;
+    std::lock_guard<std::mutex> lock{state->tracer_mutex};
+    if(t && std::find(state->tracers.begin(), state->tracers.end(), t) == state->tracers.end())
+        state->tracers.push_back(t);
+    state->active_tracer.store(t.get(), std::memory_order_release);
+}
+
+//! \return The tracer set by set_tracer, or nullptr if none is set.
+std::shared_ptr<tracer> db::get_tracer() const {
+    const auto state = state_of(m_db);
+    if(state == nullptr)
+        return nullptr;
+    std::lock_guard<std::mutex> lock{state->tracer_mutex};
+    const auto active = state->active_tracer.load(std::memory_order_relaxed);
+    const auto it = std::find_if(state->tracers.begin(), state->tracers.end(),
+                                 [active](auto&& t) { return t.get() == active; });
+    return it != state->tracers.end() ? *it : nullptr;
+}
+
+//! Writes \p str to \p os as a Prometheus label value, escaping backslashes, quotes and newlines.
+static void write_label_value(std::ostream& os, std::experimental::string_view str) {
+    os << '"';
+    for(auto c : str) {
+        if(c == '\\' || c == '"')
+            os << '\\' << c;
+        else if(c == '\n')
+            os << "\\n";
+        else
+            os << c;
+    }
+    os << '"';
+}
+
+//! Writes the HELP and TYPE lines of a Prometheus metric.
+static void write_metric_header(std::ostream& os, const char* name, const char* type, const char* help) {
+    os << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n';
+}
+
+//! Returns the name of an index type, as used in metric labels.
+static const char* index_type_name(index_mode type) noexcept {
+    switch(type) {
+        case index_mode::number:
+            return "number";
+        case index_mode::string:
+            return "string";
+        case index_mode::istring:
+            return "istring";
+        case index_mode::array:
+            return "array";
+        default:
+            return "";
+    }
+}
+
+//! Writes per-collection and per-index metrics from \p info.
+static void write_info_metrics(std::ostream& os, const db_info& info) {
+    const auto write_label = [&](const collection_info& coll) {
+        os << "{collection=";
+        write_label_value(os, coll.name);
+    };
+    const auto write_index_label = [&](const collection_info& coll, const index_info& idx) {
+        write_label(coll);
+        os << ",field=";
+        write_label_value(os, idx.field);
+        os << ",type=\"" << index_type_name(idx.type) << '"';
+    };
+
+    write_metric_header(os, "ejdb_file_bytes", "gauge", "Size of the database metadata file.");
+    os << "ejdb_file_bytes " << info.file_size << '\n';
+    write_metric_header(os, "ejdb_collection_records", "gauge", "Number of records in a collection.");
+    for(auto&& coll : info.collections) {
+        write_label(coll);
+        os << "} " << coll.records << '\n';
+    }
+    write_metric_header(os, "ejdb_collection_file_bytes", "gauge", "Size of a collection's data file.");
+    for(auto&& coll : info.collections) {
+        write_label(coll);
+        os << "} " << coll.file_size << '\n';
+    }
+    write_metric_header(os, "ejdb_index_records", "gauge", "Number of records in an index.");
+    for(auto&& coll : info.collections) {
+        for(auto&& idx : coll.indexes) {
+            write_index_label(coll, idx);
+            os << "} " << idx.records << '\n';
+        }
+    }
+    write_metric_header(os, "ejdb_index_file_bytes", "gauge", "Size of an index file.");
+    for(auto&& coll : info.collections) {
+        for(auto&& idx : coll.indexes) {
+            write_index_label(coll, idx);
+            os << "} " << idx.file_size << '\n';
+        }
+    }
+}
+
+#ifdef EJPP_STATS
+//! Writes operation counts and latency summaries from \p stats.
+static void write_stats_metrics(std::ostream& os, const db_stats& stats) {
+    const std::array<std::pair<const char*, const latency_histogram*>, stat_op_count> ops{{{"save", &stats.save},
+                                                                                         {"load", &stats.load},
+                                                                                         {"remove", &stats.remove},
+                                                                                         {"query", &stats.query},
+                                                                                         {"sync", &stats.sync},
+                                                                                         {"commit", &stats.commit}}};
+    static constexpr std::array<double, 5> quantiles{{0.5, 0.9, 0.95, 0.99, 0.999}};
+
+    write_metric_header(os, "ejpp_operations_total", "counter", "Number of operations performed.");
+    for(auto&& op : ops)
+        os << "ejpp_operations_total{op=\"" << op.first << "\"} " << op.second->count() << '\n';
+
+    write_metric_header(os, "ejpp_operation_latency_seconds", "summary", "Latency of operations.");
+    for(auto&& op : ops) {
+        for(auto q : quantiles)
+            os << "ejpp_operation_latency_seconds{op=\"" << op.first << "\",quantile=\"" << q << "\"} "
+               << op.second->percentile(q * 100) / 1e9 << '\n';
+        os << "ejpp_operation_latency_seconds_sum{op=\"" << op.first << "\"} " << op.second->total_ns / 1e9 << '\n';
+        os << "ejpp_operation_latency_seconds_count{op=\"" << op.first << "\"} " << op.second->count() << '\n';
+    }
+
+    write_metric_header(os, "ejpp_read_bytes_total", "counter", "Size of documents loaded or returned by queries.");
+    os << "ejpp_read_bytes_total " << stats.bytes_read << '\n';
+    write_metric_header(os, "ejpp_written_bytes_total", "counter", "Size of documents saved.");
+    os << "ejpp_written_bytes_total " << stats.bytes_written << '\n';
+}
+#endif // EJPP_STATS
+
+/*!
+ * Metrics include the number of records and file sizes of each collection and index, from info().
+ * When built with `EJPP_STATS` defined, operation counts, latency quantiles and bytes read/written, from stats(), are
+ * also included.
+ *
+ * Nothing is written to \p os on failure.
+ *
+ * \param os Stream to write metrics to.
+ * \param[out] ec Set to an appropriate error code on failure.
+ * \return true on success, false on failure.
+ */
+bool db::export_metrics(std::ostream& os, std::error_code& ec) const {
+    const auto i = info(ec);
+    if(!i)
+        return false;
+
+    std::ostringstream out;
+    out.imbue(std::locale::classic());
+    write_info_metrics(out, *i);
+#ifdef EJPP_STATS
+    write_stats_metrics(out, stats());
+#endif // EJPP_STATS
+
+    os << out.str();
+    if(!os) {
+        ec = std::make_error_code(std::errc::io_error);
+        return false;
+    }
+    return true;
+}
+
+/*!
+ * \throws std::system_error with appropriate error code and message on failure.
+ * \sa export_metrics(std::ostream&,std::error_code&) const
+ */
+void db::export_metrics(std::ostream& os) const {
+    std::error_code ec;
+    auto r = export_metrics(os, ec);
+    (void)r;
+    assert(r == !ec);
+    if(ec)
+        throw std::system_error(ec, "could not export metrics");
+}
+
+collection::collection(std::weak_ptr<EJDB> db, EJCOLL* coll, std::experimental::string_view name) noexcept
+    : m_db(db), m_coll(coll), m_name(name), m_state(shared_state_of(db.lock())) {}
+
+collection::collection(const collection& other) noexcept
+    : m_db(other.m_db), m_coll(other.m_coll), m_name(other.m_name), m_state(other.m_state) {}
+
+collection& collection::operator=(const collection& other) noexcept {
+    m_db = other.m_db;
+    m_coll = other.m_coll;
+    m_name = other.m_name;
+    m_state = other.m_state;
+    m_transaction = transaction_t{this};
+    return *this;
+}
+
+collection::operator bool() const noexcept { return !m_db.expired() && m_coll != nullptr; }
+
+/*!
+ * \brief collection::save_document
+ * \param data BSON document to be saved.
+ * \param[out] ec Set to an appropriate error code on failure.
+ * \return OID of saved document on success, std::experimental::nullopt on failure.
+ */
+std::experimental::optional<std::array<char, 12>> collection::save_document(const std::vector<char>& data,
+                                                                            std::error_code& ec) {
+    return save_document(data, false, ec);
+}
+
+/*!
+ * \brief Reads the OIDs and sizes of every document in \p coll into \p capped, in order of OID.
+ *
+ * OIDs begin with their creation time in seconds, so this approximates insertion order.
+ */
+static bool index_capped(EJDB* db, EJCOLL* coll, db_state::capped_collection& capped) {
+    static constexpr std::array<char, 5> empty{{5, 0, 0, 0, 0}};
+    const std::unique_ptr<EJQ, void (*)(EJQ*)> qry{c_ejdb::createquery(db, empty.data()), &c_ejdb::querydel};
+    if(!qry)
+        return false;
+    uint32_t count{0};
+    const std::unique_ptr<TCLIST, void (*)(TCLIST*)> list{c_ejdb::qryexecute(coll, qry.get(), &count, 0),
+                                                          &c_ejdb::qresultdispose};
+    if(!list)
+        return false;
+
+    std::vector<std::pair<std::array<char, 12>, uint64_t>> docs;
+    docs.reserve(count);
+    int size{0};
+    for(uint32_t i = 0; i < count; ++i) {
+        const auto data = static_cast<const char*>(c_ejdb::qresultbsondata(list.get(), static_cast<int>(i), &size));
+        const auto id = data ? detail::bson_find(data, static_cast<size_t>(size), "_id") : std::experimental::nullopt;
+        if(!id || id->type != detail::bson_type::oid)
+            continue;
+        docs.emplace_back();
+        std::copy_n(id->value, 12, docs.back().first.begin());
+        docs.back().second = static_cast<uint64_t>(size);
+    }
+    std::sort(docs.begin(), docs.end(), [](auto&& a, auto&& b) {
+        return std::lexicographical_compare(a.first.begin(), a.first.end(), b.first.begin(), b.first.end(),
+                                            [](char x, char y) { return uint8_t(x) < uint8_t(y); });
+    });
+
+    capped.order.clear();
+    capped.sizes.clear();
+    capped.bytes = 0;
+    capped.undo.clear();
+    for(auto&& doc : docs) {
+        capped.order.push_back(doc.first);
+        capped.sizes.emplace(doc.first, doc.second);
+        capped.bytes += doc.second;
+    }
+    return true;
+}
+
+//! Pops the oldest documents from \p capped until it's within its limits, returning their OIDs and sizes.
+static std::vector<std::pair<std::array<char, 12>, uint64_t>> select_evictions(db_state::capped_collection& capped) {
+    std::vector<std::pair<std::array<char, 12>, uint64_t>> evicted;
+    const auto& opts = capped.options;
+    const auto over_bytes = [&] { return opts.max_bytes > 0 && capped.bytes > opts.max_bytes; };
+    auto max_documents = capped.sizes.size();
+    if(opts.max_documents > 0 && capped.sizes.size() > opts.max_documents)
+        max_documents = opts.max_documents - std::min<uint64_t>(opts.eviction_batch, opts.max_documents) + 1;
+    else if(!over_bytes())
+        return evicted;
+
+    using order_change = db_state::capped_collection::order_change;
+    while(!capped.order.empty() && (capped.sizes.size() > max_documents || over_bytes())) {
+        const auto oid = capped.order.front();
+        const auto it = capped.sizes.find(oid);
+        if(it != capped.sizes.end()) // else already removed
+            evicted.emplace_back(oid, it->second);
+        capped.change(oid, std::experimental::nullopt, order_change::popped_front);
+    }
+    return evicted;
+}
+
+/*!
+ * \brief Removes the documents \p evicted, with their sizes, from \p coll, in a single transaction unless one is in
+ *        progress already.
+ *
+ * Removals are recorded in the change log, so that replicas evict the same documents.
+ * Documents that fail to be removed are put back at the front of the collection's order, to be evicted by later
+ * saves.
+ */
+static void evict(EJCOLL* coll, db_state* state,
+                  std::vector<std::pair<std::array<char, 12>, uint64_t>> evicted) noexcept {
+    if(evicted.empty())
+        return;
+    // begun without capped_mutex held, as another thread's transaction may need it to finish
+    const auto own_transaction = !state->owns_transaction(coll) && state->begin_transaction(coll);
+    // documents that failed to be removed are moved to the front, in order
+    auto failed_end = evicted.begin();
+    for(auto&& doc : evicted) {
+        const auto write_lock = state->lock_writes(coll);
+        if(c_ejdb::rmbson(coll, doc.first.data()))
+            state->record_change(coll, change_op::remove, doc.first.data(), [] { return std::vector<char>{}; });
+        else
+            *failed_end++ = doc;
+    }
+    if(own_transaction && !state->end_transaction(coll, true))
+        failed_end = evicted.end();
+    state->invalidate_info();
+    if(failed_end == evicted.begin())
+        return;
+
+    std::lock_guard<std::mutex> lock{state->capped_mutex};
+    const auto it = state->capped.find(coll);
+    if(it == state->capped.end())
+        return;
+    auto& capped = it->second;
+    try {
+        // newest first, leaving the oldest at the front
+        for(auto doc = std::make_reverse_iterator(failed_end); doc != evicted.rend(); ++doc)
+            if(capped.sizes.count(doc->first) == 0) // else saved again since
+                capped.change(doc->first, doc->second, db_state::capped_collection::order_change::pushed_front);
+    } catch(...) {
+        // out of memory, left untracked
+    }
+}
+
+/*!
+ * \brief Accounts for \p doc, saved to \p coll with \p oid, if \p coll is capped, evicting documents as necessary.
+ *
+ * The size of a merged document is reread when limited by size, as merging may have grown or shrunk it.
+ * Sizes are of documents as stored, i.e. including `_id`, consistently with index_capped.
+ */
+static void capped_saved(EJCOLL* coll, db_state* state, const std::array<char, 12>& oid, const std::vector<char>& doc,
+                         bool merge) noexcept {
+    if(!state->any_capped.load(std::memory_order_relaxed))
+        return;
+    std::vector<std::pair<std::array<char, 12>, uint64_t>> evicted;
+    try {
+        std::lock_guard<std::mutex> lock{state->capped_mutex};
+        const auto it = state->capped.find(coll);
+        if(it == state->capped.end())
+            return;
+        auto& capped = it->second;
+        // EJDB adds an _id element when absent: its type, name and OID
+        auto size = static_cast<uint64_t>(doc.size()) + (detail::bson_find(doc, "_id") ? 0 : 1 + 4 + 12);
+        if(merge && capped.options.max_bytes > 0)
+            size = c_ejdb::loadbson(coll, oid.data()).size();
+        using order_change = db_state::capped_collection::order_change;
+        capped.change(oid, size, capped.sizes.count(oid) ? order_change::none : order_change::pushed_back);
+        evicted = select_evictions(capped);
+    } catch(...) {
+        return; // left to be evicted by later saves
+    }
+    evict(coll, state, std::move(evicted));
+}
+
+//! Accounts for the removal of the document \p oid from \p coll, if \p coll is capped.
+static void capped_removed(EJCOLL* coll, db_state* state, const std::array<char, 12>& oid) noexcept {
+    if(!state->any_capped.load(std::memory_order_relaxed))
+        return;
+    std::lock_guard<std::mutex> lock{state->capped_mutex};
+    const auto it = state->capped.find(coll);
+    if(it == state->capped.end())
+        return;
+    auto& capped = it->second;
+    if(capped.sizes.count(oid) == 0)
+        return;
+    try {
+        capped.change(oid, std::experimental::nullopt);
+    } catch(...) {
+        return; // out of memory, left to be evicted
+    }
+    // compact removed documents once they outnumber the rest, keeping removal amortised O(1)
+    // not within a transaction, whose undo relies on the order being otherwise unchanged
+    if(!capped.in_transaction && capped.order.size() > 2 * capped.sizes.size() + 64)
+        capped.order.erase(std::remove_if(capped.order.begin(), capped.order.end(),
+                                          [&](auto&& o) { return capped.sizes.count(o) == 0; }),
+                           capped.order.end());
+}
+
+/*!
+ * \brief Removes documents matching \p qdoc from \p coll in a transaction.
+ *
+ * Only the `_id` of matching documents is read, as projected by \p hints. Each document is then removed and recorded in
+ * the change log by OID, so that replicas remove exactly the same documents rather than rerunning the query, and
+ * accounted for if \p coll is capped.
+ * Implements collection::remove_where and TTL sweeps.
+ *
+ * \param qdoc Query object, without update operators.
+ * \param hints Query hints, including a `$max` bounding the number of documents removed, and `$fields` projecting
+ *        `_id` only.
+ * \param join_transaction Whether to remove within a transaction the calling thread has in progress on \p coll, or
+ *        else in a transaction begun once any other thread's has ended, rather than failing when one is in progress.
+ * \return Number of documents removed, or std::experimental::nullopt on failure, in which case the transaction is
+ *         aborted.
+ */
+static std::experimental::optional<uint32_t> drop_matching(const std::shared_ptr<EJDB>& db, db_state* state,
+                                                           EJCOLL* coll, const std::vector<char>& qdoc,
+                                                           const std::vector<char>& hints, bool join_transaction) {
+    const std::unique_ptr<EJQ, void (*)(EJQ*)> qry{c_ejdb::createquery(db.get(), qdoc.data()), &c_ejdb::querydel};
+    if(!qry || c_ejdb::queryhints(db.get(), qry.get(), hints.data()) == nullptr)
+        return std::experimental::nullopt;
+
+    bool in_transaction{false};
+    {
+        std::lock_guard<std::mutex> lock{state->change_mutex};
+        const auto it = state->transactions.find(coll);
+        if(it != state->transactions.end()) {
+            if(!join_transaction)
+                return std::experimental::nullopt;
+            in_transaction = it->second == std::this_thread::get_id();
+        }
+    }
+    if(!in_transaction && !state->begin_transaction(coll))
+        return std::experimental::nullopt;
+    const auto fail = [&] {
+        if(!in_transaction)
+            state->end_transaction(coll, false);
+        return std::experimental::nullopt;
+    };
+
+    uint32_t count{0};
+    const std::unique_ptr<TCLIST, void (*)(TCLIST*)> list{c_ejdb::qryexecute(coll, qry.get(), &count, 0),
+                                                          &c_ejdb::qresultdispose};
+    if(!list)
+        return fail();
+    uint32_t removed{0};
+    int size{0};
+    for(uint32_t i = 0; i < count; ++i) {
+        const auto data = static_cast<const char*>(c_ejdb::qresultbsondata(list.get(), static_cast<int>(i), &size));
+        const auto id = data ? detail::bson_find(data, static_cast<size_t>(size), "_id") : std::experimental::nullopt;
+        if(!id || id->type != detail::bson_type::oid)
+            continue;
+        std::array<char, 12> oid;
+        std::copy_n(id->value, oid.size(), oid.begin());
+        {
+            const auto write_lock = state->lock_writes(coll);
+            if(!c_ejdb::rmbson(coll, oid.data()))
+                return fail();
+            state->record_change(coll, change_op::remove, oid.data(), [] { return std::vector<char>{}; });
+        }
+        capped_removed(coll, state, oid);
+        ++removed;
+    }
+    if(!in_transaction && !state->end_transaction(coll, true))
+        return std::experimental::nullopt;
+    if(removed > 0)
+        state->invalidate_info();
+    return removed;
+}
+
+//! Returns the collection named \p name from the registry, or nullptr if there is none.
+static EJCOLL* registered_collection(db_state* state, const std::string& name) {
+    std::shared_lock<std::shared_timed_mutex> lock{state->registry_mutex};
+    const auto it = state->collections.find(name);
+    return it != state->collections.end() ? it->second : nullptr;
+}
+
+/*!
+ * \brief Removes up to options.batch_size expired documents from \p ttl's collection, in a transaction.
+ *
+ * Documents are found by a query on the indexed date field, with an absolute cutoff.
+ *
+ * \return Number of documents removed, or std::experimental::nullopt when the sweep can't continue, e.g. the
+ *         collection has been removed, or a transaction is in progress on it.
+ */
+static std::experimental::optional<uint32_t> sweep_batch(const std::shared_ptr<EJDB>& db, db_state* state,
+                                                         const db_state::ttl_collection& ttl) {
+    if(!c_ejdb::isopen(db.get()))
+        return std::experimental::nullopt;
+    const auto coll = registered_collection(state, ttl.collection);
+    if(coll == nullptr)
+        return std::experimental::nullopt;
+
+    const auto cutoff = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            (std::chrono::system_clock::now() - ttl.ttl).time_since_epoch())
+                            .count();
+    const auto qdoc = detail::bson_builder{}
+                          .begin_document(ttl.field)
+                          .append_date("$lt", static_cast<int64_t>(cutoff))
+                          .end()
+                          .finish();
+    const auto hints = detail::bson_builder{}
+                           .append("$max", static_cast<int32_t>(ttl.options.batch_size))
+                           .begin_document("$fields")
+                           .append("_id", 1)
+                           .end()
+                           .finish();
+    return drop_matching(db, state, coll, qdoc, hints, false);
+}
+
+/*!
+ * \brief Body of the TTL sweeper thread, sweeping each of db_state::ttl_collections as it falls due.
+ *
+ * Only holds \p weak locked during each batch, so as not to keep the db open.
+ */
+static void run_sweeper(std::weak_ptr<EJDB> weak, db_state* state) {
+    std::unique_lock<std::mutex> lock{state->sweeper_mutex};
+    while(!state->sweeper_stopping) {
+        const auto now = std::chrono::steady_clock::now();
+        auto next = std::chrono::steady_clock::time_point::max();
+        auto due = state->ttl_collections.end();
+        for(auto it = state->ttl_collections.begin(); it != state->ttl_collections.end(); ++it) {
+            if(it->next_sweep <= now) {
+                due = it;
+                break;
+            }
+            next = std::min(next, it->next_sweep);
+        }
+        if(due == state->ttl_collections.end()) {
+            if(next == std::chrono::steady_clock::time_point::max())
+                state->sweeper_cv.wait(lock);
+            else
+                state->sweeper_cv.wait_until(lock, next);
+            continue;
+        }
+        due->next_sweep = now + due->options.sweep_interval;
+        const auto ttl = *due;
+
+        // stops between batches once collection::clear_ttl is called
+        const auto cleared = [&] {
+            return std::none_of(state->ttl_collections.begin(), state->ttl_collections.end(),
+                                [&](auto&& t) { return t.collection == ttl.collection; });
+        };
+
+        while(!state->sweeper_stopping && !cleared()) {
+            state->sweeping = ttl.collection;
+            lock.unlock();
+            std::experimental::optional<uint32_t> removed;
+            if(const auto db = weak.lock())
+                removed = sweep_batch(db, state, ttl);
+            else
+                return; // db deleted, having stopped the sweeper
+            lock.lock();
+            state->sweeping.clear();
+            state->sweeper_cv.notify_all(); // for clear_ttl
+            if(!removed || *removed < ttl.options.batch_size)
+                break;
+            state->sweeper_cv.wait_for(lock, ttl.options.batch_interval,
+                                       [&] { return state->sweeper_stopping || cleared(); });
+        }
+    }
+}
+
+/*!
+ * \brief Saves \p doc to \p coll. Implements collection::save_document and pinned_collection::save_document.
+ *
+ * \param db Parent db of \p coll, only used to report errors.
+ */
+template <typename DbPtr>
+static std::experimental::optional<std::array<char, 12>> save_document_impl(EJCOLL* coll, db_state* state,
+                                                                            const DbPtr& db,
+                                                                            const std::vector<char>& doc, bool merge,
+                                                                            std::error_code& ec) {
+    if(coll == nullptr) {
+        ec = std::make_error_code(std::errc::operation_not_permitted);
+        return std::experimental::nullopt;
+    }
+
+    op_timer timer{state, stat_op::save};
+    trace_scope trace{state, trace_op::save, coll, &ec};
+    std::array<char, 12> oid;
+    int err{0};
+    auto write_lock = state->lock_writes(coll);
+    const auto r = c_ejdb::savebson(coll, doc, oid.data(), merge, &err);
+    if(!r) {
+        if(err)
+            ec = make_error_code((ejdb::errc)err);
+        else
+            ec = db::error(db);
+        return std::experimental::nullopt;
+    }
+    state->invalidate_info();
+    state->record_change(coll, merge ? change_op::merge : change_op::save, oid.data(), [&] { return doc; });
+    write_lock.unlock(); // taken again by any evictions
+    capped_saved(coll, state, oid, doc, merge);
+    timer.written(doc.size());
+    trace.bytes(doc.size());
+    return oid;
+}
+
+/*!
+ * \param doc BSON document to be saved.
+ * \param merge Whether or not to merge with an existing, matching document.
+ * \param[out] ec Set to an appropriate error code on failure.
+ * \return OID of saved document on success, std::experimental::nullopt on failure.
+ */
+std::experimental::optional<std::array<char, 12>> collection::save_document(const std::vector<char>& doc, bool merge,
+                                                                            std::error_code& ec) {
+    return save_document_impl(m_coll, m_state.get(), m_db, doc, merge, ec);
+}
+
+/*!
+ * \param data BSON document to be saved.
+ * \param merge Whether or not to merge with an existing, matching document. Default = false.
+ * \return OID of saved document.
+ *
+ * \throws std::system_error with appropriate error code and message on failure.
+ */
+std::array<char, 12> collection::save_document(const std::vector<char>& data, bool merge) {
+    std::error_code ec;
+    auto oid = save_document(data, merge, ec);
+    assert(static_cast<bool>(oid) == !ec);
+    if(ec)
+        throw std::system_error(ec, "could not save document");
+    return *oid;
+}
+
+/*!
+ * Documents are saved within a transaction on the collection, so that either all or, on failure, none of them are
+ * saved, or within the transaction the calling thread already has in progress on it, if any, which is then left to the
+ * caller to abort.
+ *
+ * Documents with an `_id`, e.g. one from an oid_generator, are saved with it; others are given one by EJDB.
+ *
+ * \param docs BSON documents to be saved.
+ * \param merge Whether or not to merge with existing, matching documents.
+ * \param[out] ec Set to an appropriate error code on failure.
+ * \return OIDs of the saved documents, in the order of \p docs, on success, or an empty vector on failure.
+ */
+std::vector<std::array<char, 12>> collection::save_documents(const std::vector<std::vector<char>>& docs, bool merge,
+                                                             std::error_code& ec) {
+    auto db = m_db.lock();
+    if(!db || m_coll == nullptr) {
+        ec = std::make_error_code(std::errc::operation_not_permitted);
+        return {};
+    }
+    if(docs.empty())
+        return {};
+    const auto in_transaction = m_state->owns_transaction(m_coll);
+    if(!in_transaction && !m_transaction.start()) {
+        ec = db::error(db);
+        return {};
+    }
+
+    std::vector<std::array<char, 12>> oids;
+    oids.reserve(docs.size());
+    for(auto&& doc : docs) {
+        const auto oid = save_document_impl(m_coll, m_state.get(), m_db, doc, merge, ec);
+        if(!oid) {
+            if(!in_transaction)
+                m_transaction.abort();
+            return {};
+        }
+        oids.push_back(*oid);
+    }
+    if(!in_transaction && !m_transaction.commit()) {
+        ec = db::error(db);
+        return {};
+    }
+    return oids;
+}
+
+/*!
+ * \param docs BSON documents to be saved.
+ * \param merge Whether or not to merge with existing, matching documents. Default = false.
+ * \return OIDs of the saved documents, in the order of \p docs.
+ *
+ * \throws std::system_error with appropriate error code and message on failure.
+ */
+std::vector<std::array<char, 12>> collection::save_documents(const std::vector<std::vector<char>>& docs, bool merge) {
+    std::error_code ec;
+    auto oids = save_documents(docs, merge, ec);
+    if(ec)
+        throw std::system_error(ec, "could not save documents");
+    return oids;
+}
+
+//! Writes the BSON ObjectId of \p time, \p unique and the low 24 bits of \p counter to \p oid.
+static void make_oid(std::array<char, 12>& oid, uint32_t time, const std::array<char, 5>& unique,
+                     uint32_t counter) noexcept {
+    for(size_t i = 0; i < 4; ++i)
+        oid[i] = static_cast<char>(time >> (24 - i * 8));
+    std::copy(unique.begin(), unique.end(), oid.begin() + 4);
+    for(size_t i = 0; i < 3; ++i)
+        oid[9 + i] = static_cast<char>(counter >> (16 - i * 8));
+}
+
+//! Returns the current time in seconds since the epoch, as stored in OIDs.
+static uint32_t oid_time() noexcept {
+    const auto now = std::chrono::system_clock::now().time_since_epoch();
+    return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(now).count());
+}
+
+oid_generator::oid_generator() {
+    std::random_device rd;
+    std::uniform_int_distribution<uint32_t> dist;
+    for(auto&& c : m_unique)
+        c = static_cast<char>(dist(rd));
+    m_counter.store(dist(rd), std::memory_order_relaxed);
+}
+
+/*!
+ * OIDs are unique as long as no more than 2^24 are generated by a generator within a second.
+ */
+std::array<char, 12> oid_generator::next() noexcept {
+    std::array<char, 12> oid;
+    make_oid(oid, oid_time(), m_unique, m_counter.fetch_add(1, std::memory_order_relaxed));
+    return oid;
+}
+
+/*!
+ * The counter is advanced by \p n in a single atomic operation, and the time is read once, so the cost per OID is
+ * that of filling in its bytes. OIDs of a batch are consecutive, and so in ascending order unless the counter wraps.
+ *
+ * \param n Number of OIDs to generate.
+ * \return \p n new OIDs.
+ */
+std::vector<std::array<char, 12>> oid_generator::generate(size_t n) {
+    std::vector<std::array<char, 12>> oids(n);
+    if(n == 0)
+        return oids;
+    const auto time = oid_time();
+    auto counter = m_counter.fetch_add(static_cast<uint32_t>(n), std::memory_order_relaxed);
+    for(auto&& oid : oids)
+        make_oid(oid, time, m_unique, counter++);
+    return oids;
+}
+
+//! Loads a document from \p coll. Implements collection::load_document and pinned_collection::load_document.
+template <typename DbPtr>
+static std::vector<char> load_document_impl(EJCOLL* coll, db_state* state, const DbPtr& db, std::array<char, 12> oid,
+                                            std::error_code& ec) {
+    if(coll == nullptr) {
+        ec = std::make_error_code(std::errc::operation_not_permitted);
+        return {};
+    }
+
+    op_timer timer{state, stat_op::load};
+    trace_scope trace{state, trace_op::load, coll, &ec};
+    auto vec = c_ejdb::loadbson(coll, oid.data());
+    if(vec.empty())
+        ec = db::error(db);
+    timer.read(vec.size());
+    trace.bytes(vec.size());
+    return vec;
+}
+
+/*!
+ * \param oid OID of the document to fetch.
+ * \param[out] ec Set to an appropriate error code on failure.
+ * \return Document corresponding to \p oid on success, empty vector on failure or if \p oid has no match.
+ */
+std::vector<char> collection::load_document(std::array<char, 12> oid, std::error_code& ec) const {
+    return load_document_impl(m_coll, m_state.get(), m_db, oid, ec);
+}
+
+/*!
+ * \param oid OID of the document to fetch.
+ * \return Document corresponding to \p oid. Or empty vector if \p oid has no match.
+ *
+ * \throws std::system_error with appropriate error code and message on failure.
+ */
+std::vector<char> collection::load_document(std::array<char, 12> oid) const {
+    std::error_code ec;
+    auto doc = load_document(oid, ec);
+    if(ec)
+        throw std::system_error(ec, "could not load document");
+    return doc;
+}
+
+//! Removes a document from \p coll. Implements collection::remove_document and pinned_collection::remove_document.
+template <typename DbPtr>
+static bool remove_document_impl(EJCOLL* coll, db_state* state, const DbPtr& db, std::array<char, 12> oid,
+                                 std::error_code& ec) noexcept {
+    if(coll == nullptr) {
         ec = std::make_error_code(std::errc::operation_not_permitted);
         return false;
     }
-    const auto r = c_ejdb::rmbson(m_coll, oid.data());
+    op_timer timer{state, stat_op::remove};
+    trace_scope trace{state, trace_op::remove, coll, &ec};
+    const auto write_lock = state->lock_writes(coll);
+    const auto r = c_ejdb::rmbson(coll, oid.data());
     if(!r)
-        ec = db::error(m_db);
+        ec = db::error(db);
+    else {
+        state->invalidate_info();
+        state->record_change(coll, change_op::remove, oid.data(), [] { return std::vector<char>{}; });
+        capped_removed(coll, state, oid);
+    }
     return r;
 }
 
+/*!
+ * \param oid OID of the document to remove.
+ * \param[out] ec Set to an appropriate error code on failure.
+ * \return true on success, false on failure.
+ */
+bool collection::remove_document(std::array<char, 12> oid, std::error_code& ec) noexcept {
+    return remove_document_impl(m_coll, m_state.get(), m_db, oid, ec);
+}
+
 /*!
  * \param oid OID of the document to remove.
  *
@@ -537,9 +3263,12 @@ bool collection::set_index(const std::string& ipath, index_mode flags, std::erro
         ec = std::make_error_code(std::errc::operation_not_permitted);
         return false;
     }
+    trace_scope trace{m_state.get(), trace_op::set_index, m_coll, &ec};
     const auto r = c_ejdb::setindex(m_coll, ipath.c_str(), (std::underlying_type<index_mode>::type)flags);
     if(!r)
         ec = db::error(m_db);
+    else
+        m_state->invalidate_info();
     return r;
 }
 
@@ -559,33 +3288,209 @@ void collection::set_index(const std::string& ipath, index_mode flags) {
         throw std::system_error(ec, std::string("could not set index for field ") + ipath);
 }
 
+/*!
+ * Documents whose field \p ipath holds a BSON date more than \p ttl before the current time are removed by a
+ * background thread, shared by every collection of the db, which is started by the first call.
+ * With a \p ttl of zero, \p ipath holds the time at which each document expires.
+ * Documents without a date in \p ipath are never removed.
+ *
+ * \p ipath is given a number index, so that expired documents can be found without scanning the collection.
+ * Every options.sweep_interval, expired documents are removed in transactions of at most options.batch_size documents,
+ * pausing for options.batch_interval between each, so that other operations on the collection aren't starved.
+ * A sweep is skipped while a transaction is in progress on the collection.
+ *
+ * The setting lasts until clear_ttl is called, or the db is closed, and must be repeated each time the db is opened.
+ * Calling again replaces the previous setting.
+ *
+ * \param ipath Field holding the date of each document.
+ * \param ttl Age beyond which documents are removed.
+ * \param options Pacing of removals.
+ * \param[out] ec Set to an appropriate error code on failure.
+ * \return true on success, false on failure.
+ */
+bool collection::set_ttl(const std::string& ipath, std::chrono::seconds ttl, const ttl_options& options,
+                         std::error_code& ec) {
+    auto db = m_db.lock();
+    if(!db || m_coll == nullptr) {
+        ec = std::make_error_code(std::errc::operation_not_permitted);
+        return false;
+    }
+    if(!set_index(ipath, index_mode::number, ec))
+        return false;
+
+    std::lock_guard<std::mutex> lock{m_state->sweeper_mutex};
+    if(m_state->sweeper_stopping) {
+        ec = std::make_error_code(std::errc::operation_not_permitted);
+        return false;
+    }
+    auto it = std::find_if(m_state->ttl_collections.begin(), m_state->ttl_collections.end(),
+                           [&](auto&& t) { return t.collection == m_name; });
+    db_state::ttl_collection entry{m_name.to_string(), ipath, ttl, options, std::chrono::steady_clock::now()};
+    entry.options.batch_size = std::min<uint32_t>(std::max<uint32_t>(options.batch_size, 1),
+                                                  std::numeric_limits<int32_t>::max());
+    if(it != m_state->ttl_collections.end())
+        *it = std::move(entry);
+    else
+        m_state->ttl_collections.push_back(std::move(entry));
+    if(!m_state->sweeper.joinable())
+        m_state->sweeper = std::thread{&run_sweeper, std::weak_ptr<EJDB>{db}, m_state.get()};
+    m_state->sweeper_cv.notify_all();
+    return true;
+}
+
+/*!
+ * \throws std::system_error with appropriate error code and message on failure.
+ * \sa set_ttl(const std::string&,std::chrono::seconds,const ttl_options&,std::error_code&)
+ */
+void collection::set_ttl(const std::string& ipath, std::chrono::seconds ttl, const ttl_options& options) {
+    std::error_code ec;
+    auto r = set_ttl(ipath, ttl, options, ec);
+    (void)r;
+    assert(r == !ec);
+    if(ec)
+        throw std::system_error(ec, std::string("could not set TTL for field ") + ipath);
+}
+
+/*!
+ * Once saving a document takes the collection beyond either limit, the oldest documents are removed until it's within
+ * both, in a single transaction, or within the transaction the saving thread has in progress on the collection, if
+ * any.
+ * When max_documents is exceeded, options.eviction_batch documents are removed at once, so that only one save in
+ * every eviction_batch pays for eviction.
+ *
+ * The collection's documents are tracked in insertion order in memory, so that saves and evictions take O(1) amortised
+ * time. Existing documents are read once by this call, ordered by OID, which begins with the time of creation.
+ * Sizes are those of documents as saved, so changes by queries with update operators aren't accounted for.
+ * Removal of the oldest documents doesn't depend on any index.
+ *
+ * The limits last until clear_cap is called, or the db is closed, and must be set again each time the db is opened.
+ * Calling again replaces the previous limits, evicting documents if the new limits are already exceeded.
+ *
+ * \param options Limits on the number and total size of documents, and the size of eviction batches.
+ * \param[out] ec Set to an appropriate error code on failure.
+ * \return true on success, false on failure.
+ */
+bool collection::set_cap(const cap_options& options, std::error_code& ec) {
+    auto db = m_db.lock();
+    if(!db || m_coll == nullptr) {
+        ec = std::make_error_code(std::errc::operation_not_permitted);
+        return false;
+    }
+    std::vector<std::pair<std::array<char, 12>, uint64_t>> evicted;
+    {
+        std::lock_guard<std::mutex> lock{m_state->capped_mutex};
+        db_state::capped_collection capped;
+        capped.options = options;
+        capped.options.eviction_batch = std::max<uint32_t>(options.eviction_batch, 1);
+        if(!index_capped(db.get(), m_coll, capped)) {
+            ec = db::error(db);
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> change_lock{m_state->change_mutex};
+            capped.in_transaction = m_state->transactions.count(m_coll) > 0;
+        }
+        evicted = select_evictions(capped);
+        m_state->capped[m_coll] = std::move(capped);
+        m_state->any_capped.store(true, std::memory_order_relaxed);
+    }
+    evict(m_coll, m_state.get(), std::move(evicted));
+    return true;
+}
+
+/*!
+ * \throws std::system_error with appropriate error code and message on failure.
+ * \sa set_cap(const cap_options&,std::error_code&)
+ */
+void collection::set_cap(const cap_options& options) {
+    std::error_code ec;
+    auto r = set_cap(options, ec);
+    (void)r;
+    assert(r == !ec);
+    if(ec)
+        throw std::system_error(ec, "could not cap collection");
+}
+
+void collection::clear_cap() noexcept {
+    if(!m_state)
+        return;
+    std::lock_guard<std::mutex> lock{m_state->capped_mutex};
+    m_state->capped.erase(m_coll);
+    m_state->any_capped.store(!m_state->capped.empty(), std::memory_order_relaxed);
+}
+
+/*!
+ * The index set by set_ttl is kept.
+ * Waits for a batch of documents being removed from this collection by the sweeper, after which no more are removed.
+ */
+void collection::clear_ttl() noexcept {
+    if(!m_state)
+        return;
+    std::unique_lock<std::mutex> lock{m_state->sweeper_mutex};
+    auto& ttls = m_state->ttl_collections;
+    ttls.erase(std::remove_if(ttls.begin(), ttls.end(), [&](auto&& t) { return t.collection == m_name; }),
+               ttls.end());
+    m_state->sweeper_cv.notify_all();
+    m_state->sweeper_cv.wait(lock, [&] { return m_state->sweeping != m_name || m_state->sweeper_stopping; });
+}
+
 template <query_search_mode flags>
-static detail::query_return_type<flags> execute_query_impl(std::weak_ptr<EJDB> m_db, EJCOLL* m_coll, EJQ* qry);
+static detail::query_return_type<flags> execute_query_impl(const std::shared_ptr<EJDB>& db, EJCOLL* m_coll, EJQ* qry,
+                                                           bool projected, slow_query_context& slow, bool& executed,
+                                                           std::error_code& ec);
+
+/*!
+ * \brief Returns whether the results of an unprojected query exceed the limit set by db::set_unprojected_result_limit.
+ *
+ * Only result sizes are read, so this is checked before any documents are copied.
+ */
+static bool exceeds_unprojected_limit(const std::shared_ptr<EJDB>& db, EJQRESULT list, uint32_t count) {
+    const auto state = state_of(db);
+    const auto limit = state ? state->unprojected_result_limit.load(std::memory_order_relaxed) : 0u;
+    if(limit == 0)
+        return false;
+    size_t total{0};
+    int ns{0};
+    for(uint32_t i = 0; i < count && total <= limit; i++)
+        if(c_ejdb::qresultbsondata(list, i, &ns) != nullptr)
+            total += static_cast<size_t>(ns);
+    return total > limit;
+}
 
 /*!
  * \brief Instantiated with flags == `query_search_mode::normal`. Executes a query in normal mode.
  *
  * \return All records which match the criteria in \p qry.
  *         If collection or \p qry is invalid, an empty vector is returned.
+ *         If \p qry is not projected and the results exceed db::unprojected_result_limit, an empty vector is returned
+ *         and \p ec is set to std::errc::value_too_large.
  *
  * \relatesalso collection
  */
 template <>
-std::vector<std::vector<char>> execute_query_impl<query_search_mode::normal>(std::weak_ptr<EJDB> m_db, EJCOLL* m_coll,
-                                                                             EJQ* qry) {
-    if(m_coll == nullptr || !qry)
-        return {};
-
-    auto db = m_db.lock();
-    if(!db)
+std::vector<std::vector<char>> execute_query_impl<query_search_mode::normal>(const std::shared_ptr<EJDB>& db,
+                                                                             EJCOLL* m_coll, EJQ* qry, bool projected,
+                                                                             slow_query_context& slow, bool& executed,
+                                                                             std::error_code& ec) {
+    executed = false;
+    if(!db || m_coll == nullptr || !qry)
         return {};
 
+    slow.start(state_of(db));
     uint32_t s{0u};
-    const auto list = c_ejdb::qryexecute(m_coll, qry, &s, 0);
+    const auto list = c_ejdb::qryexecute(m_coll, qry, &s, 0, slow.log());
     if(list == nullptr)
         return {};
+    executed = true;
+    slow.finish(s);
     assert(s == static_cast<decltype(s)>(c_ejdb::qresultnum(list)));
 
+    if(!projected && exceeds_unprojected_limit(db, list, s)) {
+        c_ejdb::qresultdispose(list);
+        ec = std::make_error_code(std::errc::value_too_large);
+        return {};
+    }
+
     std::vector<std::vector<char>> vec;
     vec.reserve(s);
     int ns{0};
@@ -610,19 +3515,21 @@ std::vector<std::vector<char>> execute_query_impl<query_search_mode::normal>(std
  * \relatesalso collection
  */
 template <>
-uint32_t execute_query_impl<query_search_mode::count_only>(std::weak_ptr<EJDB> m_db, EJCOLL* m_coll, EJQ* qry) {
-    if(m_coll == nullptr || !qry)
-        return 0;
-
-    auto db = m_db.lock();
-    if(!db)
+uint32_t execute_query_impl<query_search_mode::count_only>(const std::shared_ptr<EJDB>& db, EJCOLL* m_coll, EJQ* qry,
+                                                           bool, slow_query_context& slow, bool& executed,
+                                                           std::error_code&) {
+    executed = false;
+    if(!db || m_coll == nullptr || !qry)
         return 0;
 
+    slow.start(state_of(db));
     uint32_t s{0u};
-    const auto list = c_ejdb::qryexecute(m_coll, qry, &s,
-                                         (std::underlying_type<query_search_mode>::type)query_search_mode::count_only);
+    const auto list = c_ejdb::qryexecute(
+        m_coll, qry, &s, (std::underlying_type<query_search_mode>::type)query_search_mode::count_only, slow.log());
+    executed = list != nullptr;
     if(list != nullptr)
         c_ejdb::qresultdispose(list);
+    slow.finish(s);
     return s;
 }
 
@@ -631,88 +3538,452 @@ uint32_t execute_query_impl<query_search_mode::count_only>(std::weak_ptr<EJDB> m
  *
  * \return Only the first record which matches the criteria in \p qry, or std::experimental::nullopt on failure or if
  *none match.
+ *         If \p qry is not projected and the result exceeds db::unprojected_result_limit, an empty vector is returned
+ *         and \p ec is set to std::errc::value_too_large.
  *
  * \relatesalso collection
  */
 template <>
-std::vector<char> execute_query_impl<query_search_mode::first_only>(std::weak_ptr<EJDB> m_db, EJCOLL* m_coll,
-                                                                    EJQ* qry) {
-    if(m_coll == nullptr || !qry)
-        return {};
-
-    auto db = m_db.lock();
-    if(!db)
+std::vector<char> execute_query_impl<query_search_mode::first_only>(const std::shared_ptr<EJDB>& db, EJCOLL* m_coll,
+                                                                    EJQ* qry, bool projected, slow_query_context& slow,
+                                                                    bool& executed, std::error_code& ec) {
+    executed = false;
+    if(!db || m_coll == nullptr || !qry)
         return {};
 
+    slow.start(state_of(db));
     uint32_t s{0u};
-    const auto list = c_ejdb::qryexecute(m_coll, qry, &s,
-                                         (std::underlying_type<query_search_mode>::type)query_search_mode::first_only);
-    if(list == nullptr || s == 0)
+    const auto list = c_ejdb::qryexecute(
+        m_coll, qry, &s, (std::underlying_type<query_search_mode>::type)query_search_mode::first_only, slow.log());
+    if(list == nullptr)
         return {};
+    executed = true;
+    slow.finish(s);
+    if(s == 0) {
+        c_ejdb::qresultdispose(list);
+        return {};
+    }
     assert(s == static_cast<decltype(s)>(c_ejdb::qresultnum(list)));
     assert(s == 1);
 
+    if(!projected && exceeds_unprojected_limit(db, list, s)) {
+        c_ejdb::qresultdispose(list);
+        ec = std::make_error_code(std::errc::value_too_large);
+        return {};
+    }
+
     int ns{0};
     auto data = reinterpret_cast<const char*>(c_ejdb::qresultbsondata(list, 0, &ns));
     auto doc = std::vector<char>(data, data + ns);
     c_ejdb::qresultdispose(list);
 
-    return std::move(doc);
+    return std::move(doc);
+}
+
+/*!
+ * \brief Instantiated with flags == `query_search_mode::count_only | query_search_mode::first_only`.
+ *        Executes a query in count-only mode, but only counts up to one (1).
+ *
+ * \return One (1) when at least one documents match the criteria in \p qry, otherwise zero (0).
+ *
+ * \relatesalso collection
+ */
+template <>
+uint32_t
+execute_query_impl<query_search_mode::count_only | query_search_mode::first_only>(const std::shared_ptr<EJDB>& db,
+                                                                                  EJCOLL* m_coll, EJQ* qry, bool,
+                                                                                  slow_query_context& slow,
+                                                                                  bool& executed, std::error_code&) {
+    executed = false;
+    if(!db || m_coll == nullptr || !qry)
+        return 0;
+
+    slow.start(state_of(db));
+    uint32_t s{0u};
+    const auto list = c_ejdb::qryexecute(
+        m_coll, qry, &s,
+        (std::underlying_type<query_search_mode>::type)(query_search_mode::count_only | query_search_mode::first_only),
+        slow.log());
+    executed = list != nullptr;
+    if(list != nullptr)
+        c_ejdb::qresultdispose(list);
+    slow.finish(s);
+    return s;
+}
+
+//! Returns the number of documents returned or matched by a query.
+static uint32_t result_count(uint32_t count) noexcept { return count; }
+
+//! \copydoc result_count(uint32_t)
+static uint32_t result_count(const std::vector<char>& doc) noexcept { return doc.empty() ? 0 : 1; }
+
+//! \copydoc result_count(uint32_t)
+static uint32_t result_count(const std::vector<std::vector<char>>& docs) noexcept {
+    return static_cast<uint32_t>(docs.size());
+}
+
+//! Returns the total size of documents in a query result.
+static size_t result_size(uint32_t) noexcept { return 0; }
+
+//! \copydoc result_size(uint32_t)
+static size_t result_size(const std::vector<char>& doc) noexcept { return doc.size(); }
+
+//! \copydoc result_size(uint32_t)
+static size_t result_size(const std::vector<std::vector<char>>& docs) noexcept {
+    size_t ret{0};
+    for(auto&& doc : docs)
+        ret += doc.size();
+    return ret;
+}
+
+/*!
+ * \throws std::system_error with std::errc::value_too_large when \p qry has no `$fields` projection and its results
+ *         exceed db::unprojected_result_limit.
+ * \sa execute_query_impl
+ */
+template <query_search_mode flags> detail::query_return_type<flags> collection::execute_query(const query& qry) {
+    return pin().execute_query<flags>(qry);
+}
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+template detail::query_return_type<query_search_mode::normal>
+collection::execute_query<query_search_mode::normal>(const query& qry);
+
+template detail::query_return_type<query_search_mode::count_only>
+collection::execute_query<query_search_mode::count_only>(const query& qry);
+
+template detail::query_return_type<query_search_mode::first_only>
+collection::execute_query<query_search_mode::first_only>(const query& qry);
+
+template detail::query_return_type<query_search_mode::count_only | query_search_mode::first_only>
+collection::execute_query<query_search_mode::count_only | query_search_mode::first_only>(const query& qry);
+#endif // DOXYGEN_SHOULD_SKIP_THIS
+
+/*!
+ * \throws std::system_error with std::errc::value_too_large when \p qry has no `$fields` projection and its results
+ *         exceed db::unprojected_result_limit.
+ * \sa execute_query_impl
+ */
+template <query_search_mode flags>
+detail::query_return_type<flags> pinned_collection::execute_query(const query& qry) {
+    op_timer timer{m_state, stat_op::query};
+    std::error_code ec;
+    trace_scope trace{m_state, trace_op::query, m_coll, &ec};
+    slow_query_context slow{m_coll, qry.m_source, qry.m_ors, qry.m_applied_hints};
+    bool executed{false};
+    std::shared_lock<std::shared_timed_mutex> write_lock;
+    if(qry.m_updates && m_state)
+        write_lock = m_state->lock_writes(m_coll);
+    auto ret = execute_query_impl<flags>(m_db, m_coll, qry.m_qry.get(), qry.m_projected, slow, executed, ec);
+    if(executed && qry.m_updates && m_state)
+        record_update(m_state, m_coll, qry.m_source, qry.m_ors, flags, qry.m_hints);
+    timer.read(result_size(ret));
+    if(trace) {
+        trace.bytes(result_size(ret));
+        trace.results(result_count(ret));
+    }
+    if(ec)
+        throw std::system_error(ec, "unprojected query result exceeds size limit");
+    return ret;
+}
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+template detail::query_return_type<query_search_mode::normal>
+pinned_collection::execute_query<query_search_mode::normal>(const query& qry);
+
+template detail::query_return_type<query_search_mode::count_only>
+pinned_collection::execute_query<query_search_mode::count_only>(const query& qry);
+
+template detail::query_return_type<query_search_mode::first_only>
+pinned_collection::execute_query<query_search_mode::first_only>(const query& qry);
+
+template detail::query_return_type<query_search_mode::count_only | query_search_mode::first_only>
+pinned_collection::execute_query<query_search_mode::count_only | query_search_mode::first_only>(const query& qry);
+#endif // DOXYGEN_SHOULD_SKIP_THIS
+
+/*!
+ * \throws std::system_error with std::errc::value_too_large when the collection's documents exceed
+ *         db::unprojected_result_limit.
+ */
+std::vector<std::vector<char>> collection::get_all() {
+    auto db = m_db.lock();
+    if(!db)
+        return {};
+    static constexpr std::array<char, 5> vec{{5, 0, 0, 0, 0}}; // empty doc
+    auto q = query{m_db, c_ejdb::createquery(db.get(), vec.data())};
+    return execute_query(q);
+}
+
+//! Functor allowing for the disposal of query results.
+struct qresult_deleter {
+    //! Function call operator.
+    void operator()(TCLIST* ptr) const noexcept { c_ejdb::qresultdispose(ptr); }
+};
+
+/*!
+ * Documents are passed as pointers into the query result, so are only valid for the duration of each call to
+ * \p visitor.
+ * As no documents are copied, db::unprojected_result_limit does not apply.
+ *
+ * \param qry Query to execute.
+ * \param visitor Called with each matching BSON document and its size. Return false to stop iterating.
+ * \return Number of documents passed to \p visitor.
+ */
+uint32_t collection::for_each(const query& qry, const std::function<bool(const char*, size_t)>& visitor) {
+    return pin().for_each(qry, visitor);
+}
+
+//! \copydoc collection::for_each
+uint32_t pinned_collection::for_each(const query& qry, const std::function<bool(const char*, size_t)>& visitor) {
+    if(!m_db || m_coll == nullptr || !qry.m_qry)
+        return 0;
+
+    op_timer timer{m_state, stat_op::query};
+    trace_scope trace{m_state, trace_op::query, m_coll};
+    slow_query_context slow{m_coll, qry.m_source, qry.m_ors, qry.m_applied_hints};
+    slow.start(m_state);
+    uint32_t s{0u};
+    std::shared_lock<std::shared_timed_mutex> write_lock;
+    if(qry.m_updates)
+        write_lock = m_state->lock_writes(m_coll);
+    const std::unique_ptr<TCLIST, qresult_deleter> list{c_ejdb::qryexecute(m_coll, qry.m_qry.get(), &s, 0, slow.log())};
+    if(!list)
+        return 0;
+    if(qry.m_updates) {
+        record_update(m_state, m_coll, qry.m_source, qry.m_ors, query_search_mode::normal, qry.m_hints);
+        write_lock.unlock(); // before calling visitor, which may write
+    }
+    slow.finish(s);
+
+    uint32_t n{0u};
+    int ns{0};
+    for(uint32_t i = 0; i < s; i++) {
+        auto data = reinterpret_cast<const char*>(c_ejdb::qresultbsondata(list.get(), i, &ns));
+        if(data == nullptr)
+            continue;
+        ++n;
+        timer.read(static_cast<size_t>(ns));
+        trace.bytes(static_cast<size_t>(ns));
+        if(!visitor(data, static_cast<size_t>(ns)))
+            break;
+    }
+    trace.results(n);
+    return n;
+}
+
+/*!
+ * OIDs are read from the `_id` of each result in place, so no documents are copied, and
+ * db::unprojected_result_limit does not apply. Results without an ObjectId `_id` are skipped.
+ *
+ * \param qry Query to execute.
+ * \return OIDs of matching documents, in the order of the query's results.
+ */
+std::vector<std::array<char, 12>> collection::find_ids(const query& qry) { return pin().find_ids(qry); }
+
+//! \copydoc collection::find_ids
+std::vector<std::array<char, 12>> pinned_collection::find_ids(const query& qry) {
+    if(!m_db || m_coll == nullptr || !qry.m_qry)
+        return {};
+
+    op_timer timer{m_state, stat_op::query};
+    trace_scope trace{m_state, trace_op::query, m_coll};
+    slow_query_context slow{m_coll, qry.m_source, qry.m_ors, qry.m_applied_hints};
+    slow.start(m_state);
+    uint32_t s{0u};
+    std::shared_lock<std::shared_timed_mutex> write_lock;
+    if(qry.m_updates)
+        write_lock = m_state->lock_writes(m_coll);
+    const std::unique_ptr<TCLIST, qresult_deleter> list{c_ejdb::qryexecute(m_coll, qry.m_qry.get(), &s, 0, slow.log())};
+    if(!list)
+        return {};
+    if(qry.m_updates)
+        record_update(m_state, m_coll, qry.m_source, qry.m_ors, query_search_mode::normal, qry.m_hints);
+    slow.finish(s);
+
+    std::vector<std::array<char, 12>> ids;
+    ids.reserve(s);
+    int ns{0};
+    for(uint32_t i = 0; i < s; i++) {
+        auto data = reinterpret_cast<const char*>(c_ejdb::qresultbsondata(list.get(), i, &ns));
+        const auto id = data ? detail::bson_find(data, static_cast<size_t>(ns), "_id") : std::experimental::nullopt;
+        if(!id || id->type != detail::bson_type::oid)
+            continue;
+        ids.emplace_back();
+        std::copy_n(id->value, ids.back().size(), ids.back().begin());
+    }
+    timer.read(ids.size() * sizeof(ids[0]));
+    trace.bytes(ids.size() * sizeof(ids[0]));
+    trace.results(static_cast<uint32_t>(ids.size()));
+    return ids;
 }
 
 /*!
- * \brief Instantiated with flags == `query_search_mode::count_only | query_search_mode::first_only`.
- *        Executes a query in count-only mode, but only counts up to one (1).
+ * Finding the match and saving happen within a transaction on the collection, or within the transaction the calling
+ * thread already has in progress on it, if any. As EJDB allows only one transaction on a collection at a time,
+ * concurrent upserts are serialised, and can't both insert a document for the same match.
+ * Saves outside of a transaction are not excluded.
  *
- * \return One (1) when at least one documents match the criteria in \p qry, otherwise zero (0).
+ * Only the `_id` of the matching document is read; no documents are copied.
  *
- * \relatesalso collection
+ * \param match Query selecting the document to update. Only the first match is updated.
+ * \param data BSON document to be saved. Any `_id` is replaced by that of the matching document.
+ * \param merge Whether to merge \p data into the matching document, rather than replacing it.
+ * \param[out] ec Set to an appropriate error code on failure.
+ * \return OID of the saved document, and whether it was inserted, on success, or std::experimental::nullopt on
+ *         failure, in which case the transaction is aborted.
  */
-template <>
-uint32_t execute_query_impl<query_search_mode::count_only | query_search_mode::first_only>(std::weak_ptr<EJDB> m_db,
-                                                                                           EJCOLL* m_coll, EJQ* qry) {
-    if(m_coll == nullptr || !qry)
-        return 0;
-
+std::experimental::optional<upsert_result> collection::upsert(const query& match, const std::vector<char>& data,
+                                                              bool merge, std::error_code& ec) {
     auto db = m_db.lock();
-    if(!db)
-        return 0;
+    if(!db || m_coll == nullptr || !match.m_qry) {
+        ec = std::make_error_code(std::errc::operation_not_permitted);
+        return std::experimental::nullopt;
+    }
+    const auto in_transaction = m_state->owns_transaction(m_coll);
+    if(!in_transaction && !m_transaction.start()) {
+        ec = db::error(db);
+        return std::experimental::nullopt;
+    }
+    const auto fail = [&] {
+        if(!in_transaction)
+            m_transaction.abort();
+        return std::experimental::nullopt;
+    };
 
-    uint32_t s{0u};
-    const auto list = c_ejdb::qryexecute(
-        m_coll, qry, &s,
-        (std::underlying_type<query_search_mode>::type)(query_search_mode::count_only | query_search_mode::first_only));
-    if(list != nullptr)
-        c_ejdb::qresultdispose(list);
-    return s;
+    std::experimental::optional<std::array<char, 12>> matched;
+    {
+        op_timer timer{m_state.get(), stat_op::query};
+        trace_scope trace{m_state.get(), trace_op::query, m_coll, &ec};
+        slow_query_context slow{m_coll, match.m_source, match.m_ors, match.m_applied_hints};
+        slow.start(m_state.get());
+        uint32_t count{0};
+        const std::unique_ptr<TCLIST, qresult_deleter> list{c_ejdb::qryexecute(
+            m_coll, match.m_qry.get(), &count,
+            (std::underlying_type<query_search_mode>::type)query_search_mode::first_only, slow.log())};
+        if(!list) {
+            ec = db::error(db);
+            return fail();
+        }
+        slow.finish(count);
+        int size{0};
+        const auto doc = count > 0 ? static_cast<const char*>(c_ejdb::qresultbsondata(list.get(), 0, &size)) : nullptr;
+        const auto id = doc ? detail::bson_find(doc, static_cast<size_t>(size), "_id") : std::experimental::nullopt;
+        if(id && id->type == detail::bson_type::oid) {
+            matched.emplace();
+            std::copy_n(id->value, 12, matched->begin());
+        }
+        trace.results(matched ? 1 : 0);
+    }
+
+    const auto oid = matched ? save_document_impl(m_coll, m_state.get(), m_db, with_oid(data, *matched), merge, ec)
+                             : save_document_impl(m_coll, m_state.get(), m_db, data, merge, ec);
+    if(!oid)
+        return fail();
+    if(!in_transaction && !m_transaction.commit()) {
+        ec = db::error(db);
+        return std::experimental::nullopt;
+    }
+    return upsert_result{*oid, !matched};
 }
 
-//! \sa execute_query_impl
-template <query_search_mode flags> detail::query_return_type<flags> collection::execute_query(const query& qry) {
-    return execute_query_impl<flags>(m_db, m_coll, qry.m_qry.get());
+/*!
+ * \throws std::system_error with appropriate error code and message on failure.
+ * \sa upsert(const query&,const std::vector<char>&,bool,std::error_code&)
+ */
+upsert_result collection::upsert(const query& match, const std::vector<char>& data, bool merge) {
+    std::error_code ec;
+    auto r = upsert(match, data, merge, ec);
+    assert(static_cast<bool>(r) == !ec);
+    if(ec)
+        throw std::system_error(ec, "could not upsert document");
+    return *r;
 }
 
-#ifndef DOXYGEN_SHOULD_SKIP_THIS
-template detail::query_return_type<query_search_mode::normal>
-collection::execute_query<query_search_mode::normal>(const query& qry);
+static std::vector<char> fold_ors(const std::vector<char>& source, const std::vector<std::vector<char>>& ors);
 
-template detail::query_return_type<query_search_mode::count_only>
-collection::execute_query<query_search_mode::count_only>(const query& qry);
+/*!
+ * Only the `_id` of each matching document is copied out of EJDB, and each removal is recorded in the change log by
+ * OID, as by remove_document.
+ * They are removed in batches of \p batch_size, each in its own transaction, so that other operations on the
+ * collection can proceed between batches, or within the transaction the calling thread already has in progress on the
+ * collection, if any.
+ *
+ * Any update operators of \p qry, and its `$max`, `$skip` or `$fields` hints, are ignored.
+ *
+ * \param qry Query selecting the documents to remove.
+ * \param batch_size Maximum number of documents removed in each transaction.
+ * \param[out] ec Set to an appropriate error code on failure.
+ * \return Number of documents removed, including those removed by batches completed before any failure.
+ */
+uint64_t collection::remove_where(const query& qry, uint32_t batch_size, std::error_code& ec) {
+    auto db = m_db.lock();
+    if(!db || m_coll == nullptr || !qry.m_qry) {
+        ec = std::make_error_code(std::errc::operation_not_permitted);
+        return 0;
+    }
+    op_timer timer{m_state.get(), stat_op::remove};
+    trace_scope trace{m_state.get(), trace_op::remove, m_coll, &ec};
 
-template detail::query_return_type<query_search_mode::first_only>
-collection::execute_query<query_search_mode::first_only>(const query& qry);
+    const auto source = fold_ors(qry.m_source, qry.m_ors);
+    detail::bson_builder qdoc;
+    detail::bson_for_each(source.data(), source.size(), [&](const detail::bson_element& e) {
+        if(!is_update_operator(e.name))
+            qdoc.append(e);
+        return true;
+    });
 
-template detail::query_return_type<query_search_mode::count_only | query_search_mode::first_only>
-collection::execute_query<query_search_mode::count_only | query_search_mode::first_only>(const query& qry);
-#endif // DOXYGEN_SHOULD_SKIP_THIS
+    batch_size = std::min<uint32_t>(std::max<uint32_t>(batch_size, 1), std::numeric_limits<int32_t>::max());
+    detail::bson_builder hints;
+    detail::bson_for_each(qry.m_hints.data(), qry.m_hints.size(), [&](const detail::bson_element& e) {
+        if(e.name != "$max" && e.name != "$skip" && e.name != "$fields")
+            hints.append(e);
+        return true;
+    });
+    hints.append("$max", static_cast<int32_t>(batch_size)).begin_document("$fields").append("_id", 1).end();
 
-std::vector<std::vector<char>> collection::get_all() {
-    auto db = m_db.lock();
-    if(!db)
+    const auto qbson = qdoc.finish();
+    const auto hbson = hints.finish();
+    uint64_t removed{0};
+    for(;;) {
+        const auto n = drop_matching(db, m_state.get(), m_coll, qbson, hbson, true);
+        if(!n) {
+            ec = db::error(db);
+            if(!ec)
+                ec = errc::query_error;
+            break;
+        }
+        removed += *n;
+        if(*n < batch_size)
+            break;
+    }
+    trace.results(static_cast<uint32_t>(std::min<uint64_t>(removed, std::numeric_limits<uint32_t>::max())));
+    return removed;
+}
+
+/*!
+ * \throws std::system_error with appropriate error code and message on failure.
+ * \sa remove_where(const query&,uint32_t,std::error_code&)
+ */
+uint64_t collection::remove_where(const query& qry, uint32_t batch_size) {
+    std::error_code ec;
+    const auto r = remove_where(qry, batch_size, ec);
+    if(ec)
+        throw std::system_error(ec, "could not remove documents");
+    return r;
+}
+
+/*!
+ * \param filter BSON query object selecting the documents to page through.
+ * \param sort_key Field path of a numeric field to order documents by. Should be indexed with index_mode::number.
+ * \param page_size Maximum number of documents per page.
+ * \param descending Whether to order documents by descending \p sort_key. Default = false.
+ * \return paged_query associated with this collection, or an invalid paged_query if this collection is invalid.
+ */
+paged_query collection::paginate(const std::vector<char>& filter, const std::string& sort_key, uint32_t page_size,
+                                 bool descending) const {
+    if(m_coll == nullptr)
         return {};
-    static constexpr std::array<char, 5> vec{{5, 0, 0, 0, 0}}; // empty doc
-    auto q = query{m_db, c_ejdb::createquery(db.get(), vec.data())};
-    return execute_query(q);
+    return {m_db, m_coll, filter, sort_key, page_size, descending};
 }
 
 /*!
@@ -724,6 +3995,8 @@ bool collection::sync(std::error_code& ec) noexcept {
         ec = std::make_error_code(std::errc::operation_not_permitted);
         return false;
     }
+    op_timer timer{m_state.get(), stat_op::sync};
+    trace_scope trace{m_state.get(), trace_op::sync, m_coll, &ec};
     const auto r = c_ejdb::syncoll(m_coll);
     if(!r)
         ec = db::error(m_db);
@@ -742,14 +4015,200 @@ void collection::sync() {
         throw std::system_error(ec, "could not sync collection");
 }
 
-std::string collection::name() const {
-    if(m_coll == nullptr)
+std::string collection::name() const { return m_name.to_string(); }
+
+/*!
+ * The name is interned by the parent db, so the view remains valid for as long as the collection, or any other object
+ * referring to the same db, exists.
+ *
+ * \return Name of the collection, or an empty view for an invalid collection.
+ */
+std::experimental::string_view collection::name_view() const noexcept { return m_name; }
+
+/*!
+ * \return A pinned_collection referring to this collection, or an invalid pinned_collection if the parent db has
+ *         expired.
+ */
+pinned_collection collection::pin() const noexcept {
+    auto db = m_db.lock();
+    if(!db || m_coll == nullptr)
         return {};
-    return c_ejdb::collection_name(m_coll);
+    const auto state = m_state.get();
+    return {std::move(db), m_coll, state};
+}
+
+pinned_collection::pinned_collection(std::shared_ptr<EJDB> db, EJCOLL* coll, db_state* state) noexcept
+    : m_db(std::move(db)), m_coll(coll), m_state(state) {}
+
+pinned_collection::operator bool() const noexcept { return m_db && m_coll != nullptr; }
+
+//! \copydoc collection::save_document(const std::vector<char>&,std::error_code&)
+std::experimental::optional<std::array<char, 12>> pinned_collection::save_document(const std::vector<char>& data,
+                                                                                   std::error_code& ec) {
+    return save_document(data, false, ec);
+}
+
+//! \copydoc collection::save_document(const std::vector<char>&,bool,std::error_code&)
+std::experimental::optional<std::array<char, 12>>
+pinned_collection::save_document(const std::vector<char>& doc, bool merge, std::error_code& ec) {
+    return save_document_impl(m_coll, m_state, m_db, doc, merge, ec);
+}
+
+//! \copydoc collection::save_document(const std::vector<char>&,bool)
+std::array<char, 12> pinned_collection::save_document(const std::vector<char>& data, bool merge) {
+    std::error_code ec;
+    auto oid = save_document(data, merge, ec);
+    assert(static_cast<bool>(oid) == !ec);
+    if(ec)
+        throw std::system_error(ec, "could not save document");
+    return *oid;
+}
+
+//! \copydoc collection::load_document(std::array<char, 12>,std::error_code&) const
+std::vector<char> pinned_collection::load_document(std::array<char, 12> oid, std::error_code& ec) const {
+    return load_document_impl(m_coll, m_state, m_db, oid, ec);
+}
+
+//! \copydoc collection::load_document(std::array<char, 12>) const
+std::vector<char> pinned_collection::load_document(std::array<char, 12> oid) const {
+    std::error_code ec;
+    auto doc = load_document(oid, ec);
+    if(ec)
+        throw std::system_error(ec, "could not load document");
+    return doc;
+}
+
+//! \copydoc collection::remove_document(std::array<char, 12>,std::error_code&)
+bool pinned_collection::remove_document(std::array<char, 12> oid, std::error_code& ec) noexcept {
+    return remove_document_impl(m_coll, m_state, m_db, oid, ec);
+}
+
+//! \copydoc collection::remove_document(std::array<char, 12>)
+void pinned_collection::remove_document(std::array<char, 12> oid) {
+    std::error_code ec;
+    auto r = remove_document(oid, ec);
+    (void)r;
+    assert(static_cast<bool>(r) == !ec);
+    if(ec)
+        throw std::system_error(ec, "could not remove document");
 }
 
 query::query(std::weak_ptr<EJDB> db, EJQ* qry) noexcept : m_db(db), m_qry(qry) {}
 
+/*!
+ * Returns \p source, or `{"$and": [source, {"$or": [ors...]}]}` when there are \p ors, matching the semantics of
+ * `ejdbqueryaddor`: documents must match \p source and any of \p ors.
+ */
+static std::vector<char> fold_ors(const std::vector<char>& source, const std::vector<std::vector<char>>& ors) {
+    if(ors.empty())
+        return source;
+    detail::bson_builder b;
+    b.begin_array("$and").append_document("0", source.data(), source.size());
+    b.begin_document("1").begin_array("$or");
+    for(size_t i = 0; i < ors.size(); ++i)
+        b.append_document(std::to_string(i), ors[i].data(), ors[i].size());
+    b.end().end().end();
+    return b.finish();
+}
+
+/*!
+ * \brief Returns a query object matching both \p lhs and \p rhs.
+ *
+ * The fields of both are concatenated when no field appears in both, so that EJDB can still use an index for any of
+ * them. Otherwise they are combined with `$and`.
+ *
+ * \throws std::system_error with errc::invalid_bson when either document is malformed.
+ */
+static std::vector<char> and_documents(const std::vector<char>& lhs, const std::vector<char>& rhs) {
+    std::vector<std::experimental::string_view> names;
+    auto valid = detail::bson_for_each(lhs.data(), lhs.size(), [&](const detail::bson_element& e) {
+        names.push_back(e.name);
+        return true;
+    });
+    bool collision{false};
+    valid = valid && detail::bson_for_each(rhs.data(), rhs.size(), [&](const detail::bson_element& e) {
+        collision = std::find(names.begin(), names.end(), e.name) != names.end();
+        return !collision;
+    });
+    if(!valid)
+        throw std::system_error(ejdb::errc::invalid_bson, "could not combine queries");
+
+    detail::bson_builder b;
+    if(collision) {
+        b.begin_array("$and");
+        b.append_document("0", lhs.data(), lhs.size()).append_document("1", rhs.data(), rhs.size());
+        b.end();
+    } else {
+        const auto append = [&](const detail::bson_element& e) {
+            b.append(e);
+            return true;
+        };
+        detail::bson_for_each(lhs.data(), lhs.size(), append);
+        detail::bson_for_each(rhs.data(), rhs.size(), append);
+    }
+    return b.finish();
+}
+
+/*!
+ * Replaces the underlying EJQ with one compiled from \p source and the current hints.
+ * The query is left unchanged on failure.
+ *
+ * \throws std::system_error with an ejdb::errc when the query could not be compiled.
+ */
+void query::recompile(std::vector<char> source) {
+    auto db = m_db.lock();
+    if(!db)
+        return;
+    std::error_code ec;
+    trace_scope trace{state_of(db), trace_op::compile_query, &ec};
+    std::unique_ptr<EJQ, eqry_deleter> qry{c_ejdb::createquery(db.get(), source.data())};
+    if(!qry) {
+        ec = db::error(m_db);
+        throw std::system_error(ec, "could not combine queries");
+    }
+    std::swap(m_qry, qry);
+    m_updates = has_update_operators(source);
+    m_source = std::move(source);
+    m_ors.clear();
+    if(!m_hints.empty() || !m_projection.empty())
+        apply_hints();
+}
+
+/*!
+ * Combines the source BSON of this query with \p obj, then compiles the result once.
+ * When neither have fields in common, and this query has no `$or` operands, fields are simply concatenated. Otherwise
+ * the two are combined via `$and`.
+ *
+ * \throws std::system_error with std::errc::operation_not_permitted when query is null.
+ * \throws std::system_error with an ejdb::errc when the combined query is invalid.
+ */
+query& query::operator&=(const std::vector<char>& obj) & {
+    if(!m_qry)
+        throw std::system_error(make_error_code(std::errc::operation_not_permitted), "null query");
+    recompile(and_documents(fold_ors(m_source, m_ors), obj));
+    return *this;
+}
+
+//! \copydoc operator&=(const std::vector<char>&)&
+query&& query::operator&=(const std::vector<char>& obj) && { return std::move(*this &= obj); }
+
+/*!
+ * Combines the source BSON of this query with that of \p qry, including any `$or` operands of either, then compiles the
+ * result once. Hints of \p qry are ignored.
+ *
+ * \throws std::system_error with std::errc::operation_not_permitted when either query is null.
+ * \throws std::system_error with an ejdb::errc when the combined query is invalid.
+ */
+query& query::operator&=(query qry) & {
+    if(!m_qry || !qry.m_qry)
+        throw std::system_error(make_error_code(std::errc::operation_not_permitted), "null query");
+    recompile(and_documents(fold_ors(m_source, m_ors), fold_ors(qry.m_source, qry.m_ors)));
+    return *this;
+}
+
+//! \copydoc operator&=(query)&
+query&& query::operator&=(query qry) && { return std::move(*this &= std::move(qry)); }
+
 /*!
  * \throws std::system_error with std::errc::operation_not_permitted when query is null.
  */
@@ -763,6 +4222,10 @@ query& query::operator|=(const std::vector<char>& obj) & {
     auto q = c_ejdb::queryaddor(db.get(), m_qry.get(), obj.data());
     if(q != m_qry.get())
         m_qry.reset(q);
+    if(q != nullptr) {
+        m_ors.push_back(obj);
+        m_updates = m_updates || has_update_operators(obj);
+    }
 
     return *this;
 }
@@ -772,6 +4235,21 @@ query& query::operator|=(const std::vector<char>& obj) & {
  */
 query&& query::operator|=(const std::vector<char>& obj) && { return std::move(*this |= obj); }
 
+/*!
+ * Adds the source BSON of \p qry, combined with any of its `$or` operands, as a single `$or` operand of this query.
+ * The already compiled query is extended in place, rather than recompiled. Hints of \p qry are ignored.
+ *
+ * \throws std::system_error with std::errc::operation_not_permitted when either query is null.
+ */
+query& query::operator|=(query qry) & {
+    if(!qry.m_qry)
+        throw std::system_error(make_error_code(std::errc::operation_not_permitted), "null query");
+    return *this |= fold_ors(qry.m_source, qry.m_ors);
+}
+
+//! \copydoc operator|=(query)&
+query&& query::operator|=(query qry) && { return std::move(*this |= std::move(qry)); }
+
 /*!
  * EJDB's hints documentation follows.
  *
@@ -797,20 +4275,234 @@ query&& query::operator|=(const std::vector<char>& obj) && { return std::move(*t
  */
 query& query::set_hints(const std::vector<char>& obj) & {
     assert(m_qry);
+    m_hints = obj;
+    apply_hints();
+    return *this;
+}
+
+query&& query::set_hints(const std::vector<char>& obj) && { return std::move(set_hints(obj)); }
+
+/*!
+ * Generates a `$fields` hint including only \p fields, e.g.
+ * \code qry.project({"a", "b.c"}) \endcode
+ * is equivalent to the hint
+ * \code {"$fields": {"a": 1, "b.c": 1}} \endcode
+ *
+ * The projection is kept separately from hints given to set_hints, replacing any `$fields` hint therein, and is
+ * retained when hints are set afterwards.
+ *
+ * \param fields Field paths to include in results. `_id` is always included. An empty list removes the projection.
+ */
+query& query::project(const std::vector<std::string>& fields) & {
+    assert(m_qry);
+    m_projection = fields;
+    apply_hints();
+    return *this;
+}
+
+//! \copydoc project(const std::vector<std::string>&)&
+query&& query::project(const std::vector<std::string>& fields) && { return std::move(project(fields)); }
+
+//! \copydoc project(const std::vector<std::string>&)&
+query& query::project(std::initializer_list<std::string> fields) & {
+    return project(std::vector<std::string>(fields));
+}
+
+//! \copydoc project(const std::vector<std::string>&)&
+query&& query::project(std::initializer_list<std::string> fields) && { return std::move(project(fields)); }
+
+/*!
+ * \return true if results of this query are restricted by a `$fields` hint, either via project or set_hints.
+ */
+bool query::is_projected() const noexcept { return m_projected; }
+
+//! Combines hints from set_hints with the projection from project and passes them to EJDB.
+void query::apply_hints() {
     auto db = m_db.lock();
     if(!db)
-        return *this;
-    auto q = c_ejdb::queryhints(db.get(), m_qry.get(), obj.data());
+        return;
+
+    bool has_fields{false};
+    std::vector<char> composed;
+    if(m_projection.empty()) {
+        has_fields = static_cast<bool>(detail::bson_find(m_hints, "$fields"));
+    } else {
+        detail::bson_builder b;
+        detail::bson_for_each(m_hints.data(), m_hints.size(), [&](const detail::bson_element& e) {
+            if(e.name != "$fields")
+                b.append(e);
+            return true;
+        });
+        b.begin_document("$fields");
+        for(auto&& field : m_projection)
+            b.append(field, int32_t{1});
+        b.end();
+        composed = b.finish();
+        has_fields = true;
+    }
+
+    static constexpr std::array<char, 5> empty{{5, 0, 0, 0, 0}};
+    m_applied_hints = !composed.empty() ? std::move(composed) : m_hints;
+    const char* hints = !m_applied_hints.empty() ? m_applied_hints.data() : empty.data();
+    auto q = c_ejdb::queryhints(db.get(), m_qry.get(), hints);
     if(q != m_qry.get())
         m_qry.reset(q);
-
-    return *this;
+    m_projected = has_fields;
 }
 
-query&& query::set_hints(const std::vector<char>& obj) && { return std::move(set_hints(obj)); }
-
 query::operator bool() const noexcept { return !m_db.expired() && m_qry != nullptr; }
 
+page_token::page_token(std::vector<char> data) noexcept : m_data(std::move(data)) {}
+
+page_token::operator bool() const noexcept { return !m_data.empty(); }
+
+const std::vector<char>& page_token::data() const noexcept { return m_data; }
+
+paged_query::paged_query(std::weak_ptr<EJDB> db, EJCOLL* coll, std::vector<char> filter, std::string sort_key,
+                         uint32_t page_size, bool descending)
+    : m_db(std::move(db)),
+      m_coll(coll),
+      m_filter(std::move(filter)),
+      m_sort_key(std::move(sort_key)),
+      m_page_size(page_size),
+      m_descending(descending) {}
+
+paged_query::operator bool() const noexcept { return !m_db.expired() && m_coll != nullptr; }
+
+/*!
+ * The first page is fetched with the filter unchanged. Following pages add a predicate continuing after the sort key
+ * value and OID held by \p from: documents with a following sort key value, or the same value and a greater OID.
+ *
+ * \param from Position of the page to fetch. A default constructed page_token refers to the first page.
+ * \param[out] ec Set to an appropriate error code on failure.
+ *                 Set to std::errc::invalid_argument when \p from is malformed, or the last document of the page has
+ *                 a non-numeric sort key, and errc::invalid_field_path when it has no sort key or OID at all.
+ * \return The requested page. page::next is only set when the page is full and no error occurred.
+ */
+paged_query::page paged_query::fetch(const page_token& from, std::error_code& ec) const {
+    if(m_coll == nullptr || m_page_size == 0) {
+        ec = std::make_error_code(std::errc::operation_not_permitted);
+        return {};
+    }
+    auto db = m_db.lock();
+    if(!db) {
+        ec = std::make_error_code(std::errc::operation_not_permitted);
+        return {};
+    }
+
+    std::experimental::optional<detail::bson_element> last, last_oid;
+    if(from) {
+        last = detail::bson_find(from.m_data, "k");
+        last_oid = detail::bson_find(from.m_data, "o");
+        if(!last || !last->as_number() || !last_oid || last_oid->type != detail::bson_type::oid) {
+            ec = std::make_error_code(std::errc::invalid_argument);
+            return {};
+        }
+    }
+
+    std::vector<char> qdoc;
+    if(!last)
+        qdoc = m_filter;
+    else {
+        bool collision{false};
+        const auto valid = detail::bson_for_each(m_filter.data(), m_filter.size(), [&](const detail::bson_element& e) {
+            collision = e.name == m_sort_key || e.name == "$or" || e.name == "$and";
+            return !collision;
+        });
+        if(!valid) {
+            ec = ejdb::errc::invalid_bson;
+            return {};
+        }
+        // {sort_key: {$gte: k}, $or: [{sort_key: {$gt: k}}, {_id: {$gt: o}}]}, the first kept for the index
+        const auto after = [&](detail::bson_builder& b) -> detail::bson_builder& {
+            b.begin_document(m_sort_key).append(m_descending ? "$lte" : "$gte", *last).end();
+            b.begin_array("$or");
+            b.begin_document("0").begin_document(m_sort_key).append(m_descending ? "$lt" : "$gt", *last).end().end();
+            b.begin_document("1").begin_document("_id").append_oid("$gt", last_oid->value).end().end();
+            return b.end();
+        };
+        detail::bson_builder b;
+        if(collision) {
+            // can't have the same key twice; combine with $and instead
+            b.begin_array("$and").append_document("0", m_filter.data(), m_filter.size());
+            after(b.begin_document("1")).end();
+            b.end();
+        } else {
+            detail::bson_for_each(m_filter.data(), m_filter.size(), [&](const detail::bson_element& e) {
+                b.append(e);
+                return true;
+            });
+            after(b);
+        }
+        qdoc = b.finish();
+    }
+
+    const auto dir = static_cast<int32_t>(m_descending ? -1 : 1);
+    const auto hints = detail::bson_builder{}
+                           .begin_document("$orderby")
+                           .append(m_sort_key, dir)
+                           .append("_id", int32_t{1})
+                           .end()
+                           .append("$max", static_cast<int32_t>(m_page_size))
+                           .finish();
+
+    query qry{m_db, c_ejdb::createquery(db.get(), qdoc.data())};
+    if(!qry.m_qry || c_ejdb::queryhints(db.get(), qry.m_qry.get(), hints.data()) == nullptr) {
+        ec = db::error(m_db);
+        return {};
+    }
+
+    const auto state = state_of(db);
+    op_timer timer{state, stat_op::query};
+    trace_scope trace{state, trace_op::query, m_coll, &ec};
+    slow_query_context slow{m_coll, qdoc, qry.m_ors, hints};
+    bool executed{false};
+    auto docs = execute_query_impl<query_search_mode::normal>(db, m_coll, qry.m_qry.get(), false, slow, executed, ec);
+    if(ec)
+        return {};
+    timer.read(result_size(docs));
+    trace.bytes(result_size(docs));
+    trace.results(result_count(docs));
+
+    page ret;
+    ret.documents = std::move(docs);
+    if(ret.documents.size() < m_page_size)
+        return ret;
+
+    const auto& back = ret.documents.back();
+    const auto v = detail::bson_find(back, m_sort_key);
+    const auto oid = detail::bson_find(back, "_id");
+    if(!v || !oid || oid->type != detail::bson_type::oid) {
+        ec = ejdb::errc::invalid_field_path;
+        return ret;
+    }
+    if(!v->as_number()) {
+        ec = std::make_error_code(std::errc::invalid_argument);
+        return ret;
+    }
+
+    detail::bson_builder token;
+    token.append("k", *v).append_oid("o", oid->value);
+    ret.next = page_token{token.finish()};
+
+    return ret;
+}
+
+/*!
+ * \param from Position of the page to fetch. A default constructed page_token refers to the first page.
+ * \return The requested page.
+ *
+ * \throws std::system_error with appropriate error code and message on failure.
+ * \sa fetch(const page_token&,std::error_code&) const
+ */
+paged_query::page paged_query::fetch(const page_token& from) const {
+    std::error_code ec;
+    auto ret = fetch(from, ec);
+    if(ec)
+        throw std::system_error(ec, "could not fetch page");
+    return ret;
+}
+
 //! The category type used for all EJDB errors.
 class error_category : public std::error_category {
   public:
@@ -843,7 +4535,13 @@ collection::transaction_t::transaction_t(collection* coll) noexcept : m_collecti
  */
 bool collection::transaction_t::start() noexcept {
     auto db = m_db.lock();
-    return db && c_ejdb::isopen(db.get()) && m_collection && *m_collection && c_ejdb::tranbegin(m_collection->m_coll);
+    trace_scope trace{m_collection ? m_collection->m_state.get() : nullptr, trace_op::begin_transaction,
+                      m_collection ? m_collection->m_coll : nullptr};
+    const auto r = db && c_ejdb::isopen(db.get()) && m_collection && *m_collection &&
+                   m_collection->m_state->begin_transaction(m_collection->m_coll);
+    if(!r && trace)
+        trace.error(db::error(m_db));
+    return r;
 }
 
 /*!
@@ -854,7 +4552,16 @@ bool collection::transaction_t::start() noexcept {
  */
 bool collection::transaction_t::abort() noexcept {
     auto db = m_db.lock();
-    return db && c_ejdb::isopen(db.get()) && m_collection && *m_collection && c_ejdb::tranabort(m_collection->m_coll);
+    trace_scope trace{m_collection ? m_collection->m_state.get() : nullptr, trace_op::abort_transaction,
+                      m_collection ? m_collection->m_coll : nullptr};
+    // also rolls back saves and evictions of a capped collection
+    const auto r = db && c_ejdb::isopen(db.get()) && m_collection && *m_collection &&
+                   m_collection->m_state->end_transaction(m_collection->m_coll, false);
+    if(!r && trace)
+        trace.error(db::error(m_db));
+    if(r)
+        m_collection->m_state->invalidate_info(); // rolled back changes
+    return r;
 }
 
 /*!
@@ -865,7 +4572,14 @@ bool collection::transaction_t::abort() noexcept {
  */
 bool collection::transaction_t::commit() noexcept {
     auto db = m_db.lock();
-    return db && c_ejdb::isopen(db.get()) && m_collection && *m_collection && c_ejdb::trancommit(m_collection->m_coll);
+    const auto state = m_collection ? m_collection->m_state.get() : nullptr;
+    op_timer timer{state, stat_op::commit};
+    trace_scope trace{state, trace_op::commit_transaction, m_collection ? m_collection->m_coll : nullptr};
+    const auto r = db && c_ejdb::isopen(db.get()) && m_collection && *m_collection &&
+                   state->end_transaction(m_collection->m_coll, true);
+    if(!r && trace)
+        trace.error(db::error(m_db));
+    return r;
 }
 
 /*!
@@ -15,9 +15,18 @@
 **  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 **************************************************************************/
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <set>
+#include <sstream>
+#include <thread>
+
 #define private public
+#include <ejpp/bson.hpp>
 #include <ejpp/ejdb.hpp>
 #include <jbson/builder.hpp>
+#include <jbson/document.hpp>
 
 #include <gtest/gtest.h>
 
@@ -109,3 +118,1143 @@ TEST(ApiTest, ErrorTest1) {
     ASSERT_NO_THROW(EXPECT_EQ(1u, coll.get_all().size()));
     EXPECT_NO_THROW(coll.remove_document(oid));
 }
+
+TEST(ApiTest, PagedQuery) {
+    ejdb::db jb;
+    ASSERT_NO_THROW(jb.open("db_api_paging", ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create |
+                                                 ejdb::db_mode::truncate));
+
+    EXPECT_FALSE(static_cast<bool>(ejdb::paged_query{}));
+    EXPECT_THROW(ejdb::paged_query{}.fetch(), std::system_error);
+
+    ejdb::collection coll;
+    ASSERT_NO_THROW(coll = jb.create_collection("paged"));
+    ASSERT_NO_THROW(coll.set_index("n", ejdb::index_mode::number));
+
+    // pairs of documents share a sort key value
+    for(int32_t i = 0; i < 25; ++i)
+        ASSERT_NO_THROW(coll.save_document(jbson::document(jbson::builder("n", i / 2)).data()));
+
+    const std::vector<char> all_docs{{5, 0, 0, 0, 0}};
+    auto pq = coll.paginate(all_docs, "n", 4);
+    ASSERT_TRUE(static_cast<bool>(pq));
+
+    std::set<std::vector<char>> seen;
+    int32_t prev{-1};
+    int pages{0};
+    ejdb::page_token token;
+    do {
+        ejdb::paged_query::page page;
+        // round-trip through the serialised form, as a resuming client would
+        ASSERT_NO_THROW(page = pq.fetch(ejdb::page_token{token.data()}));
+        ASSERT_LE(page.documents.size(), 4u);
+        for(auto&& doc : page.documents) {
+            auto n = jbson::document(doc).find("n")->value<int32_t>();
+            EXPECT_LE(prev, n);
+            prev = n;
+            EXPECT_TRUE(seen.insert(doc).second);
+        }
+        token = page.next;
+        ++pages;
+    } while(token);
+
+    EXPECT_EQ(25u, seen.size());
+    EXPECT_EQ(7, pages);
+    EXPECT_EQ(12, prev);
+
+    // a document tied with the last of a page, but ordered before it, doesn't cause documents to be repeated
+    const auto first = pq.fetch();
+    ASSERT_TRUE(static_cast<bool>(first.next));
+    std::array<char, 12> low{};
+    low.back() = 1;
+    ASSERT_NO_THROW(
+        coll.save_document(ejdb::detail::bson_builder{}.append_oid("_id", low.data()).append("n", 1).finish()));
+    ejdb::paged_query::page second;
+    ASSERT_NO_THROW(second = pq.fetch(first.next));
+    ASSERT_EQ(4u, second.documents.size());
+    for(auto&& doc : second.documents)
+        EXPECT_LT(1, jbson::document(doc).find("n")->value<int32_t>());
+
+    std::error_code ec;
+    auto page = pq.fetch(ejdb::page_token{std::vector<char>{{5, 0, 0, 0, 0}}}, ec);
+    EXPECT_EQ(std::make_error_code(std::errc::invalid_argument), ec);
+    EXPECT_TRUE(page.documents.empty());
+}
+
+TEST(ApiTest, Projection) {
+    ejdb::db jb;
+    ASSERT_NO_THROW(jb.open("db_api_projection", ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create |
+                                                     ejdb::db_mode::truncate));
+
+    ejdb::collection coll;
+    ASSERT_NO_THROW(coll = jb.create_collection("projected"));
+    ASSERT_NO_THROW(coll.save_document(
+        jbson::document(jbson::builder("a", 1)("b", jbson::element_type::document_element,
+                                               jbson::builder("c", 2)("d", 3))("e", "some long string value"))
+            .data()));
+
+    ejdb::query qry;
+    ASSERT_NO_THROW(qry = jb.create_query(std::vector<char>{{5, 0, 0, 0, 0}}));
+    EXPECT_FALSE(qry.is_projected());
+
+    EXPECT_EQ(0u, jb.unprojected_result_limit());
+    jb.set_unprojected_result_limit(16);
+    EXPECT_EQ(16u, jb.unprojected_result_limit());
+    EXPECT_THROW(coll.execute_query(qry), std::system_error);
+    EXPECT_THROW(coll.get_all(), std::system_error);
+    // counting copies no documents
+    EXPECT_NO_THROW(EXPECT_EQ(1u, coll.execute_query<ejdb::query_search_mode::count_only>(qry)));
+
+    ASSERT_NO_THROW(qry.project({"a", "b.c"}));
+    EXPECT_TRUE(qry.is_projected());
+
+    std::vector<std::vector<char>> res;
+    ASSERT_NO_THROW(res = coll.execute_query(qry));
+    ASSERT_EQ(1u, res.size());
+    {
+        jbson::document doc(res.front());
+        EXPECT_NE(doc.end(), doc.find("a"));
+        EXPECT_NE(doc.end(), doc.find("b"));
+        EXPECT_EQ(doc.end(), doc.find("e"));
+    }
+
+    // hints set afterwards retain the projection
+    ASSERT_NO_THROW(qry.set_hints(jbson::document(jbson::builder("$max", 1)).data()));
+    EXPECT_TRUE(qry.is_projected());
+
+    ASSERT_NO_THROW(qry.project({}));
+    EXPECT_FALSE(qry.is_projected());
+    EXPECT_THROW(coll.execute_query(qry), std::system_error);
+
+    jb.set_unprojected_result_limit(0);
+    EXPECT_NO_THROW(EXPECT_EQ(1u, coll.execute_query(qry).size()));
+}
+
+TEST(ApiTest, QueryComposition) {
+    ejdb::db jb;
+    ASSERT_NO_THROW(jb.open("db_api_composition", ejdb::db_mode::read | ejdb::db_mode::write |
+                                                      ejdb::db_mode::create | ejdb::db_mode::truncate));
+
+    ejdb::collection coll;
+    ASSERT_NO_THROW(coll = jb.create_collection("composed"));
+    for(int32_t i = 0; i < 10; ++i)
+        ASSERT_NO_THROW(coll.save_document(jbson::document(jbson::builder("a", i)("b", i % 2)).data()));
+
+    const auto count = [&](const ejdb::query& qry) {
+        return coll.execute_query<ejdb::query_search_mode::count_only>(qry);
+    };
+    const auto gt = [](int32_t v) {
+        return jbson::document(jbson::builder("$gt", v));
+    };
+
+    EXPECT_THROW(ejdb::query() &= std::vector<char>{}, std::system_error);
+    EXPECT_THROW(ejdb::query() &= ejdb::query(), std::system_error);
+    EXPECT_THROW(ejdb::query() |= ejdb::query(), std::system_error);
+
+    ejdb::query qry;
+    // disjoint fields are concatenated
+    ASSERT_NO_THROW(qry = jb.create_query(jbson::document(jbson::builder("b", 0)).data()));
+    ASSERT_NO_THROW(qry &= jbson::document(jbson::builder("a", jbson::element_type::document_element, gt(3))).data());
+    EXPECT_EQ(3u, count(qry)); // 4, 6, 8
+
+    // common fields are combined with $and
+    ASSERT_NO_THROW(qry &= jb.create_query(
+                        jbson::document(jbson::builder("a", jbson::element_type::document_element, gt(5))).data()));
+    EXPECT_EQ(2u, count(qry)); // 6, 8
+
+    // $or operands restrict the query to documents matching any of them
+    ASSERT_NO_THROW(qry |= jb.create_query(jbson::document(jbson::builder("a", 6)).data()));
+    ASSERT_NO_THROW(qry |= jbson::document(jbson::builder("a", 1)).data());
+    EXPECT_EQ(1u, count(qry)); // 6
+
+    // $and with a query having $or operands keeps both restricted by their $or operands
+    ejdb::query qry2;
+    ASSERT_NO_THROW(qry2 = jb.create_query(jbson::document(jbson::builder("b", 0)).data()));
+    ASSERT_NO_THROW(qry2 |= jbson::document(jbson::builder("a", 6)).data());
+    ASSERT_NO_THROW(qry2 |= jbson::document(jbson::builder("a", 8)).data());
+    EXPECT_EQ(2u, count(qry2)); // 6, 8
+    ASSERT_NO_THROW(qry &= std::move(qry2));
+    EXPECT_EQ(1u, count(qry)); // 6
+
+    // $or with a query having $or operands adds it as a single operand
+    ejdb::query qry3, qry4;
+    ASSERT_NO_THROW(qry3 = jb.create_query(jbson::document(jbson::builder("b", 1)).data()));
+    ASSERT_NO_THROW(qry4 = jb.create_query(
+                        jbson::document(jbson::builder("a", jbson::element_type::document_element, gt(2))).data()));
+    ASSERT_NO_THROW(qry4 |= jbson::document(jbson::builder("a", 3)).data());
+    ASSERT_NO_THROW(qry3 |= std::move(qry4));
+    EXPECT_EQ(1u, count(qry3)); // 3
+
+    // hints survive recompilation
+    ASSERT_NO_THROW(qry.set_hints(jbson::document(jbson::builder("$max", 1)).data()));
+    ASSERT_NO_THROW(qry &= jbson::document(jbson::builder("b", jbson::element_type::document_element, gt(-1))).data());
+    EXPECT_EQ(1u, coll.execute_query(qry).size());
+}
+
+TEST(ApiTest, LatencyHistogram) {
+    using ejdb::latency_histogram;
+    for(uint64_t v = 0; v < (1u << 16); ++v) {
+        const auto i = latency_histogram::bucket_index(v);
+        ASSERT_LT(i, latency_histogram::bucket_count);
+        ASSERT_LE(v, latency_histogram::bucket_upper_bound(i));
+        if(i > 0)
+            ASSERT_GT(v, latency_histogram::bucket_upper_bound(i - 1));
+    }
+    EXPECT_EQ(latency_histogram::bucket_count - 1, latency_histogram::bucket_index(~uint64_t{0}));
+    // the overflow bucket is separate from the highest sub-bucket below it
+    const auto overflow = uint64_t{1} << latency_histogram::max_magnitude;
+    EXPECT_EQ(latency_histogram::bucket_count - 1, latency_histogram::bucket_index(overflow));
+    EXPECT_EQ(latency_histogram::bucket_count - 2, latency_histogram::bucket_index(overflow - 1));
+    EXPECT_EQ(overflow - 1, latency_histogram::bucket_upper_bound(latency_histogram::bucket_count - 2));
+    EXPECT_GT(overflow - 1, latency_histogram::bucket_upper_bound(latency_histogram::bucket_count - 3));
+
+    latency_histogram hist;
+    EXPECT_EQ(0u, hist.percentile(50));
+    for(uint64_t v = 1; v <= 1000; ++v) {
+        ++hist.buckets[latency_histogram::bucket_index(v * 1000)];
+        hist.total_ns += v * 1000;
+    }
+    hist.max_ns = 1000000;
+    EXPECT_EQ(1000u, hist.count());
+    EXPECT_DOUBLE_EQ(500500.0, hist.mean());
+    // within the relative error of a sub-bucket
+    EXPECT_NEAR(500000.0, static_cast<double>(hist.percentile(50)), 500000.0 / 16);
+    EXPECT_NEAR(990000.0, static_cast<double>(hist.percentile(99)), 990000.0 / 16);
+    EXPECT_EQ(1000000u, hist.percentile(100));
+}
+
+TEST(ApiTest, Stats) {
+    ejdb::db jb;
+    EXPECT_EQ(0u, jb.stats().save.count());
+
+    ASSERT_NO_THROW(jb.open("db_api_stats", ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create |
+                                                ejdb::db_mode::truncate));
+    ejdb::collection coll;
+    ASSERT_NO_THROW(coll = jb.create_collection("stats"));
+
+    const auto doc = jbson::document(jbson::builder("a", 1)).data();
+    std::array<char, 12> oid;
+    ASSERT_NO_THROW(oid = coll.save_document(doc));
+    std::vector<char> loaded;
+    ASSERT_NO_THROW(loaded = coll.load_document(oid));
+    ASSERT_NO_THROW(coll.execute_query(jb.create_query(jbson::document(jbson::builder("a", 1)).data())));
+    ASSERT_NO_THROW(coll.remove_document(oid));
+    ASSERT_NO_THROW(jb.sync());
+
+    const auto stats = jb.stats();
+#ifdef EJPP_STATS
+    EXPECT_EQ(1u, stats.save.count());
+    EXPECT_EQ(1u, stats.load.count());
+    EXPECT_EQ(1u, stats.query.count());
+    EXPECT_EQ(1u, stats.remove.count());
+    EXPECT_EQ(1u, stats.sync.count());
+    EXPECT_EQ(0u, stats.commit.count());
+    EXPECT_EQ(doc.size(), stats.bytes_written);
+    EXPECT_EQ(2 * loaded.size(), stats.bytes_read);
+    EXPECT_GT(stats.save.total_ns, 0u);
+
+    // merged across threads
+    std::thread([&]() { coll.load_document(oid); }).join();
+    EXPECT_EQ(2u, jb.stats().load.count());
+#else
+    EXPECT_EQ(0u, stats.save.count());
+    EXPECT_EQ(0u, stats.bytes_written);
+#endif
+}
+
+TEST(ApiTest, SlowQueryLog) {
+    ejdb::db jb;
+    ASSERT_NO_THROW(jb.open("db_api_slow", ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create |
+                                               ejdb::db_mode::truncate));
+    ejdb::collection coll;
+    ASSERT_NO_THROW(coll = jb.create_collection("slow"));
+    for(int32_t i = 0; i < 10; ++i)
+        ASSERT_NO_THROW(coll.save_document(jbson::document(jbson::builder("a", i)).data()));
+
+    const auto qdoc = jbson::document(jbson::builder("a", 1)).data();
+    const auto hints = jbson::document(jbson::builder("$max", 5)).data();
+    ejdb::query qry;
+    ASSERT_NO_THROW(qry = jb.create_query(qdoc));
+    ASSERT_NO_THROW(qry.set_hints(hints));
+
+    // disabled by default
+    EXPECT_EQ(std::chrono::nanoseconds::zero(), jb.slow_query_threshold());
+    ASSERT_NO_THROW(coll.execute_query(qry));
+    EXPECT_TRUE(jb.slow_queries().empty());
+
+    // every query exceeds 1ns
+    jb.set_slow_query_threshold(std::chrono::nanoseconds{1});
+    EXPECT_EQ(std::chrono::nanoseconds{1}, jb.slow_query_threshold());
+    ASSERT_NO_THROW(coll.execute_query(qry));
+    auto slow = jb.slow_queries();
+    ASSERT_EQ(1u, slow.size());
+    EXPECT_EQ("slow", slow[0].collection);
+    EXPECT_EQ(qdoc, slow[0].query);
+    EXPECT_EQ(hints, slow[0].hints);
+    EXPECT_TRUE(slow[0].ors.empty());
+    EXPECT_EQ(1u, slow[0].result_count);
+    EXPECT_GT(slow[0].elapsed.count(), 0);
+    EXPECT_FALSE(slow[0].log.empty());
+
+    // bounded, dropping the oldest
+    jb.set_slow_query_capacity(2);
+    ASSERT_NO_THROW(coll.execute_query<ejdb::query_search_mode::count_only>(jb.create_query(
+        jbson::document(jbson::builder("a", jbson::element_type::document_element,
+                                       jbson::document(jbson::builder("$gt", 7)))).data())));
+    ASSERT_NO_THROW(coll.execute_query<ejdb::query_search_mode::first_only>(qry));
+    slow = jb.slow_queries();
+    ASSERT_EQ(2u, slow.size());
+    EXPECT_EQ(2u, slow[0].result_count);
+    EXPECT_EQ(1u, slow[1].result_count);
+
+    // handler replaces the log
+    std::vector<std::string> handled;
+    jb.set_slow_query_handler([&](const ejdb::slow_query& q) { handled.push_back(q.collection); });
+    ASSERT_NO_THROW(coll.execute_query(qry));
+    EXPECT_EQ(1u, handled.size());
+    EXPECT_EQ(2u, jb.slow_queries().size());
+
+    // hints are logged as executed, including any projection
+    std::vector<char> logged_hints;
+    jb.set_slow_query_handler([&](const ejdb::slow_query& q) { logged_hints = q.hints; });
+    ASSERT_NO_THROW(qry.project({"a"}));
+    ASSERT_NO_THROW(coll.execute_query(qry));
+    const auto fields = ejdb::detail::bson_find(logged_hints, "$fields.a");
+    ASSERT_TRUE(static_cast<bool>(fields));
+    EXPECT_EQ(1.0, *fields->as_number());
+    EXPECT_TRUE(static_cast<bool>(ejdb::detail::bson_find(logged_hints, "$max")));
+
+    // disabled again
+    jb.set_slow_query_threshold(std::chrono::nanoseconds::zero());
+    logged_hints.clear();
+    ASSERT_NO_THROW(coll.execute_query(qry));
+    EXPECT_TRUE(logged_hints.empty());
+}
+
+namespace {
+
+struct recording_tracer : ejdb::tracer {
+    struct record {
+        ejdb::trace_op op;
+        std::string collection;
+        size_t bytes;
+        uint32_t results;
+        std::error_code error;
+    };
+
+    void begin(ejdb::trace_event& event) noexcept override {
+        ++begun;
+        event.context = this;
+    }
+
+    void end(ejdb::trace_event& event) noexcept override {
+        EXPECT_EQ(this, event.context);
+        records.push_back({event.op, event.collection.to_string(), event.bytes, event.results, event.error});
+    }
+
+    int begun{0};
+    std::vector<record> records;
+};
+
+} // namespace
+
+TEST(ApiTest, Tracer) {
+    ejdb::db jb;
+    ASSERT_NO_THROW(jb.open("db_api_trace", ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create |
+                                                ejdb::db_mode::truncate));
+    EXPECT_EQ(nullptr, jb.get_tracer());
+    auto tracer = std::make_shared<recording_tracer>();
+    jb.set_tracer(tracer);
+    EXPECT_EQ(tracer, jb.get_tracer());
+
+    ejdb::collection coll;
+    ASSERT_NO_THROW(coll = jb.create_collection("traced"));
+    const auto doc = jbson::document(jbson::builder("a", 1)).data();
+    std::array<char, 12> oid;
+    ASSERT_NO_THROW(oid = coll.save_document(doc));
+    std::vector<char> loaded;
+    ASSERT_NO_THROW(loaded = coll.load_document(oid));
+    ejdb::query qry;
+    ASSERT_NO_THROW(qry = jb.create_query(doc));
+    ASSERT_NO_THROW(coll.execute_query(qry));
+    {
+        ejdb::unique_transaction trans{coll.transaction()};
+        trans.commit();
+    }
+    std::error_code ec;
+    EXPECT_FALSE(jb.remove_collection("in.valid", false, ec)); // names may not contain dots
+
+    using op = ejdb::trace_op;
+    const auto& r = tracer->records;
+    ASSERT_EQ(8u, r.size());
+    EXPECT_EQ(static_cast<int>(r.size()), tracer->begun);
+    EXPECT_EQ(op::create_collection, r[0].op);
+    EXPECT_EQ("traced", r[0].collection);
+    EXPECT_EQ(op::save, r[1].op);
+    EXPECT_EQ("traced", r[1].collection);
+    EXPECT_EQ(doc.size(), r[1].bytes);
+    EXPECT_EQ(op::load, r[2].op);
+    EXPECT_EQ(loaded.size(), r[2].bytes);
+    EXPECT_EQ(op::compile_query, r[3].op);
+    EXPECT_TRUE(r[3].collection.empty());
+    EXPECT_EQ(op::query, r[4].op);
+    EXPECT_EQ(1u, r[4].results);
+    EXPECT_EQ(loaded.size(), r[4].bytes);
+    EXPECT_EQ(op::begin_transaction, r[5].op);
+    EXPECT_EQ(op::commit_transaction, r[6].op);
+    EXPECT_FALSE(static_cast<bool>(r[6].error));
+    EXPECT_EQ(op::remove_collection, r[7].op);
+    EXPECT_EQ(ec, r[7].error);
+    EXPECT_TRUE(static_cast<bool>(r[7].error));
+
+    jb.set_tracer(nullptr);
+    EXPECT_EQ(nullptr, jb.get_tracer());
+    ASSERT_NO_THROW(coll.load_document(oid));
+    EXPECT_EQ(8u, r.size());
+}
+
+TEST(ApiTest, PinnedCollection) {
+    std::error_code ec;
+    ejdb::pinned_collection invalid = ejdb::collection{}.pin();
+    EXPECT_FALSE(static_cast<bool>(invalid));
+    EXPECT_FALSE(invalid.save_document(jbson::document().data(), ec));
+    EXPECT_EQ(std::errc::operation_not_permitted, ec);
+
+    const auto doc = jbson::document(jbson::builder("a", 1)).data();
+    ejdb::pinned_collection pinned;
+    ejdb::query qry;
+    {
+        ejdb::db jb;
+        ASSERT_NO_THROW(jb.open("db_api_pinned", ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create |
+                                                     ejdb::db_mode::truncate));
+        ejdb::collection coll;
+        ASSERT_NO_THROW(coll = jb.create_collection("pinned"));
+        pinned = coll.pin();
+        EXPECT_TRUE(static_cast<bool>(pinned));
+        ASSERT_NO_THROW(qry = jb.create_query(doc));
+    }
+    // the db is kept alive by the pinned collection
+    std::array<char, 12> oid;
+    ASSERT_NO_THROW(oid = pinned.save_document(doc));
+    std::vector<char> loaded;
+    ASSERT_NO_THROW(loaded = pinned.load_document(oid));
+    EXPECT_FALSE(loaded.empty());
+
+    EXPECT_EQ(1u, pinned.execute_query<ejdb::query_search_mode::count_only>(qry));
+    EXPECT_EQ(1u, pinned.for_each(qry, [](const char*, size_t) { return true; }));
+
+    ASSERT_NO_THROW(pinned.remove_document(oid));
+    EXPECT_TRUE(pinned.load_document(oid, ec).empty());
+}
+
+TEST(ApiTest, CollectionRegistry) {
+    ejdb::db jb;
+    ASSERT_NO_THROW(jb.open("db_api_registry", ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create |
+                                                   ejdb::db_mode::truncate));
+    ejdb::collection a, b;
+    ASSERT_NO_THROW(a = jb.create_collection("a"));
+    ASSERT_NO_THROW(b = jb.create_collection("b"));
+    EXPECT_EQ("a", a.name_view());
+    EXPECT_EQ("b", b.name());
+    EXPECT_EQ(2u, jb.get_collections().size());
+
+    // lookups return the interned name
+    auto found = jb.get_collection("a");
+    ASSERT_TRUE(static_cast<bool>(found));
+    EXPECT_EQ(a.name_view().data(), found.name_view().data());
+    EXPECT_EQ(a.m_coll, found.m_coll);
+
+    const auto name = b.name_view();
+    ASSERT_NO_THROW(jb.remove_collection("b", true));
+    EXPECT_FALSE(static_cast<bool>(jb.get_collection("b")));
+    EXPECT_EQ(1u, jb.get_collections().size());
+    EXPECT_EQ("b", name); // still valid after removal
+
+    // copies sharing the handle no longer find collections once closed
+    const ejdb::db copy{jb};
+    ASSERT_NO_THROW(jb.close());
+    EXPECT_FALSE(static_cast<bool>(copy.get_collection("a")));
+    EXPECT_TRUE(copy.get_collections().empty());
+    ASSERT_NO_THROW(jb.open("db_api_registry", ejdb::db_mode::read | ejdb::db_mode::write));
+    found = jb.get_collection("a");
+    ASSERT_TRUE(static_cast<bool>(found));
+    EXPECT_EQ("a", found.name_view());
+    EXPECT_FALSE(static_cast<bool>(jb.get_collection("b")));
+}
+
+TEST(ApiTest, Info) {
+    ejdb::db jb;
+    std::error_code ec;
+    EXPECT_EQ(nullptr, jb.info(ec));
+    EXPECT_EQ(std::errc::operation_not_permitted, ec);
+
+    ASSERT_NO_THROW(jb.open("db_api_info", ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create |
+                                               ejdb::db_mode::truncate));
+    ejdb::collection coll;
+    ASSERT_NO_THROW(coll = jb.create_collection("described"));
+    std::shared_ptr<const ejdb::db_info> info;
+    ASSERT_NO_THROW(info = jb.info());
+    ASSERT_NE(nullptr, info);
+    EXPECT_FALSE(info->file.empty());
+    EXPECT_LT(0u, info->file_size);
+    const auto find = [](const ejdb::db_info& i, const std::string& name) {
+        return std::find_if(i.collections.begin(), i.collections.end(), [&](auto&& c) { return c.name == name; });
+    };
+    auto it = find(*info, "described");
+    ASSERT_NE(info->collections.end(), it);
+    EXPECT_EQ(0, it->records);
+    EXPECT_TRUE(it->indexes.empty());
+
+    // unchanged db returns the cached description
+    EXPECT_EQ(info, jb.info());
+
+    std::array<char, 12> oid;
+    ASSERT_NO_THROW(oid = coll.save_document(jbson::document(jbson::builder("a", 1)).data()));
+    ASSERT_NO_THROW(coll.set_index("a", ejdb::index_mode::number));
+    auto updated = jb.info();
+    EXPECT_NE(info, updated);
+    it = find(*updated, "described");
+    ASSERT_NE(updated->collections.end(), it);
+    EXPECT_EQ(1, it->records);
+    ASSERT_EQ(1u, it->indexes.size());
+    EXPECT_EQ("a", it->indexes[0].field);
+    EXPECT_EQ(ejdb::index_mode::number, it->indexes[0].type);
+    EXPECT_EQ(1, it->indexes[0].records);
+    EXPECT_EQ(updated, jb.info());
+
+    ASSERT_NO_THROW(coll.remove_document(oid));
+    it = find(*jb.info(), "described");
+    EXPECT_EQ(0, it->records);
+
+    ASSERT_NO_THROW(jb.remove_collection("described", true));
+    updated = jb.info();
+    EXPECT_EQ(updated->collections.end(), find(*updated, "described"));
+}
+
+TEST(ApiTest, ExportMetrics) {
+    ejdb::db jb;
+    std::ostringstream os;
+    std::error_code ec;
+    EXPECT_FALSE(jb.export_metrics(os, ec));
+    EXPECT_EQ(std::errc::operation_not_permitted, ec);
+    EXPECT_TRUE(os.str().empty());
+
+    ASSERT_NO_THROW(jb.open("db_api_metrics", ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create |
+                                                  ejdb::db_mode::truncate));
+    ejdb::collection coll;
+    ASSERT_NO_THROW(coll = jb.create_collection("metered"));
+    ASSERT_NO_THROW(coll.set_index("a", ejdb::index_mode::number));
+    for(int i = 0; i < 3; ++i)
+        ASSERT_NO_THROW(coll.save_document(jbson::document(jbson::builder("a", i)).data()));
+    ASSERT_NO_THROW(jb.sync());
+
+    ASSERT_NO_THROW(jb.export_metrics(os));
+    const auto text = os.str();
+    EXPECT_NE(std::string::npos, text.find("# TYPE ejdb_collection_records gauge\n"));
+    EXPECT_NE(std::string::npos, text.find("ejdb_collection_records{collection=\"metered\"} 3\n"));
+    EXPECT_NE(std::string::npos, text.find("ejdb_collection_file_bytes{collection=\"metered\"} "));
+    EXPECT_NE(std::string::npos, text.find("ejdb_index_file_bytes{collection=\"metered\",field=\"a\""));
+    EXPECT_EQ(std::string::npos, text.find("ejdb_collection_file_bytes{collection=\"metered\"} 0\n"));
+#ifdef EJPP_STATS
+    EXPECT_NE(std::string::npos, text.find("ejpp_operations_total{op=\"save\"} 3\n"));
+    EXPECT_NE(std::string::npos, text.find("ejpp_operation_latency_seconds{op=\"save\",quantile=\"0.99\"} "));
+#else
+    EXPECT_EQ(std::string::npos, text.find("ejpp_operations_total"));
+#endif // EJPP_STATS
+}
+
+TEST(ApiTest, ExportImport) {
+    ejdb::db jb;
+    ASSERT_NO_THROW(jb.open("db_api_export", ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create |
+                                                 ejdb::db_mode::truncate));
+    for(auto name : {"exp1", "exp2", "exp3"}) {
+        auto coll = jb.create_collection(name);
+        ASSERT_NO_THROW(coll.set_index("a", ejdb::index_mode::number));
+        for(int i = 0; i < 10; ++i)
+            ASSERT_NO_THROW(coll.save_document(jbson::document(jbson::builder("a", i)).data()));
+    }
+
+    for(auto format : {ejdb::export_format::bson, ejdb::export_format::json}) {
+        std::vector<ejdb::transfer_progress> progress;
+        ejdb::export_options opts;
+        opts.format = format;
+        opts.threads = 2;
+        opts.progress = [&](const ejdb::transfer_progress& p) { progress.push_back(p); };
+        ASSERT_NO_THROW(jb.export_to("db_api_export_dir", {}, opts));
+        ASSERT_EQ(3u, progress.size());
+        std::set<std::string> names;
+        for(size_t i = 0; i < progress.size(); ++i) {
+            EXPECT_EQ(i + 1, progress[i].completed);
+            EXPECT_EQ(3u, progress[i].total);
+            EXPECT_FALSE(static_cast<bool>(progress[i].error));
+            names.insert(progress[i].collection);
+        }
+        EXPECT_EQ((std::set<std::string>{"exp1", "exp2", "exp3"}), names);
+
+        ejdb::db imported;
+        ASSERT_NO_THROW(imported.open("db_api_import", ejdb::db_mode::read | ejdb::db_mode::write |
+                                                           ejdb::db_mode::create | ejdb::db_mode::truncate));
+        progress.clear();
+        ejdb::import_options iopts;
+        iopts.format = format;
+        iopts.progress = opts.progress;
+        ASSERT_NO_THROW(imported.import_from("db_api_export_dir", {}, iopts));
+        ASSERT_EQ(3u, progress.size());
+        EXPECT_EQ("exp1", progress[0].collection);
+        EXPECT_EQ(3u, progress[2].completed);
+
+        auto coll = imported.get_collection("exp2");
+        ASSERT_TRUE(static_cast<bool>(coll));
+        EXPECT_EQ(10u, coll.get_all().size());
+        EXPECT_EQ(3u, imported.get_collections().size());
+    }
+
+    // replacing drops caps, and the next replication copies the imported collection
+    std::remove("db_api_export_replica.checkpoint");
+    jb.set_change_log_capacity(100);
+    auto exp1 = jb.get_collection("exp1");
+    for(int i = 10; i < 13; ++i)
+        ASSERT_NO_THROW(exp1.save_document(jbson::document(jbson::builder("a", i)).data()));
+    ASSERT_NO_THROW(jb.replicate_to("db_api_export_replica"));
+    ejdb::cap_options cap;
+    cap.max_documents = 13;
+    ASSERT_NO_THROW(exp1.set_cap(cap));
+    ejdb::import_options replace;
+    replace.format = ejdb::export_format::json;
+    replace.mode = ejdb::import_mode::replace;
+    ASSERT_NO_THROW(jb.import_from("db_api_export_dir", {"exp1"}, replace));
+    exp1 = jb.get_collection("exp1");
+    for(int i = 10; i < 15; ++i)
+        ASSERT_NO_THROW(exp1.save_document(jbson::document(jbson::builder("a", i)).data()));
+    EXPECT_EQ(15u, exp1.get_all().size());
+    ASSERT_NO_THROW(jb.replicate_to("db_api_export_replica"));
+    {
+        ejdb::db replica;
+        ASSERT_NO_THROW(replica.open("db_api_export_replica", ejdb::db_mode::read));
+        EXPECT_EQ(15u, replica.get_collection("exp1").get_all().size());
+    }
+
+    std::error_code ec;
+    EXPECT_FALSE(ejdb::db{}.export_to("db_api_export_dir", {}, {}, ec));
+    EXPECT_EQ(std::errc::operation_not_permitted, ec);
+}
+
+TEST(ApiTest, Snapshot) {
+    ejdb::db jb;
+    ASSERT_NO_THROW(jb.open("db_api_snapshot", ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create |
+                                                   ejdb::db_mode::truncate));
+    ejdb::collection coll;
+    ASSERT_NO_THROW(coll = jb.create_collection("snap"));
+    ASSERT_NO_THROW(coll.set_index("a", ejdb::index_mode::number));
+    for(int i = 0; i < 10; ++i)
+        ASSERT_NO_THROW(coll.save_document(jbson::document(jbson::builder("a", i)).data()));
+
+    // a sibling database sharing the prefix of this one's files
+    ejdb::db sibling;
+    ASSERT_NO_THROW(sibling.open("db_api_snapshot_other", ejdb::db_mode::read | ejdb::db_mode::write |
+                                                              ejdb::db_mode::create | ejdb::db_mode::truncate));
+    ASSERT_NO_THROW(sibling.create_collection("snap"));
+
+    std::error_code ec;
+    EXPECT_FALSE(jb.snapshot(".", ec));
+    EXPECT_EQ(std::errc::invalid_argument, ec);
+    {
+        ejdb::unique_transaction trans{coll.transaction()};
+        EXPECT_FALSE(jb.snapshot("db_api_snapshot_dir", ec));
+        EXPECT_EQ(std::errc::device_or_resource_busy, ec);
+    }
+    ASSERT_NO_THROW(jb.snapshot("db_api_snapshot_dir"));
+    for(auto name : {"db_api_snapshot_dir/db_api_snapshot_other", "db_api_snapshot_dir/db_api_snapshot_other_snap",
+                     "db_api_snapshot_dir/db_api_snapshot_dir"}) {
+        const std::unique_ptr<FILE, int (*)(FILE*)> file{std::fopen(name, "r"), &std::fclose};
+        EXPECT_FALSE(static_cast<bool>(file)) << name;
+    }
+    // changes after the snapshot aren't in the copy
+    ASSERT_NO_THROW(coll.save_document(jbson::document(jbson::builder("a", 10)).data()));
+
+    ejdb::db copy;
+    ASSERT_NO_THROW(copy.open("db_api_snapshot_dir/db_api_snapshot", ejdb::db_mode::read | ejdb::db_mode::write));
+    auto copied = copy.get_collection("snap");
+    ASSERT_TRUE(static_cast<bool>(copied));
+    EXPECT_EQ(10u, copied.get_all().size());
+    const auto info = copy.info();
+    ASSERT_EQ(1u, info->collections.size());
+    ASSERT_EQ(1u, info->collections[0].indexes.size());
+    EXPECT_EQ(10, info->collections[0].indexes[0].records);
+}
+
+TEST(ApiTest, ChangeFeed) {
+    ejdb::db jb;
+    ASSERT_NO_THROW(jb.open("db_api_changes", ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create |
+                                                  ejdb::db_mode::truncate));
+    ejdb::collection coll;
+    ASSERT_NO_THROW(coll = jb.create_collection("changes"));
+
+    // disabled by default
+    ASSERT_NO_THROW(coll.save_document(jbson::document(jbson::builder("a", 0)).data()));
+    EXPECT_EQ(0u, jb.last_change_seq());
+    EXPECT_TRUE(jb.changes_since(0).empty());
+
+    jb.set_change_log_capacity(4);
+    const auto doc = jbson::document(jbson::builder("a", 1)).data();
+    std::array<char, 12> oid;
+    ASSERT_NO_THROW(oid = coll.save_document(doc));
+    ASSERT_NO_THROW(coll.remove_document(oid));
+    const auto qdoc = jbson::document(jbson::builder("$set", jbson::document(jbson::builder("b", 2)))).data();
+    const auto hints = jbson::document(jbson::builder("$max", 1)).data();
+    ASSERT_NO_THROW(coll.execute_query<ejdb::query_search_mode::count_only>(jb.create_query(qdoc).set_hints(hints)));
+
+    auto changes = jb.changes_since(0);
+    ASSERT_EQ(3u, changes.size());
+    EXPECT_EQ(1u, changes[0].seq);
+    EXPECT_EQ(ejdb::change_op::save, changes[0].op);
+    EXPECT_EQ("changes", changes[0].collection);
+    EXPECT_EQ(oid, changes[0].oid);
+    EXPECT_EQ(doc, changes[0].document);
+    EXPECT_EQ(ejdb::change_op::remove, changes[1].op);
+    EXPECT_EQ(oid, changes[1].oid);
+    EXPECT_EQ(ejdb::change_op::update, changes[2].op);
+    EXPECT_EQ(qdoc, changes[2].document);
+    EXPECT_EQ(ejdb::query_search_mode::count_only, changes[2].mode);
+    EXPECT_EQ(hints, changes[2].hints);
+    EXPECT_EQ(3u, jb.last_change_seq());
+    EXPECT_EQ(1u, jb.changes_since(2).size());
+    EXPECT_TRUE(jb.changes_since(3).empty());
+
+    // recorded on commit only
+    {
+        ejdb::unique_transaction trans{coll.transaction()};
+        ASSERT_NO_THROW(coll.save_document(doc));
+        trans.abort();
+    }
+    EXPECT_EQ(3u, jb.last_change_seq());
+    {
+        ejdb::unique_transaction trans{coll.transaction()};
+        ASSERT_NO_THROW(coll.save_document(doc));
+        ASSERT_NO_THROW(coll.save_document(doc, true));
+        EXPECT_EQ(3u, jb.last_change_seq());
+        trans.commit();
+    }
+    changes = jb.changes_since(3);
+    ASSERT_EQ(2u, changes.size());
+    EXPECT_EQ(ejdb::change_op::save, changes[0].op);
+    EXPECT_EQ(ejdb::change_op::merge, changes[1].op);
+
+    // oldest discarded
+    std::error_code ec;
+    EXPECT_TRUE(jb.changes_since(0, ec).empty());
+    EXPECT_EQ(std::errc::result_out_of_range, ec);
+    EXPECT_EQ(4u, jb.changes_since(1).size());
+
+    // another thread's transaction, begun as this one's commits, is kept apart from it
+    const auto seq = jb.last_change_seq();
+    {
+        ejdb::unique_transaction trans{coll.transaction()};
+        ASSERT_NO_THROW(oid = coll.save_document(doc));
+        auto other = coll;
+        std::thread t{[&] {
+            ejdb::unique_transaction other_trans{other.transaction()};
+            EXPECT_NO_THROW(other.save_document(doc));
+            other_trans.abort();
+        }};
+        std::this_thread::sleep_for(std::chrono::milliseconds{50});
+        trans.commit();
+        t.join();
+    }
+    changes = jb.changes_since(seq);
+    ASSERT_EQ(1u, changes.size());
+    EXPECT_EQ(oid, changes[0].oid);
+}
+
+TEST(ApiTest, Replication) {
+    ejdb::db jb;
+    ASSERT_NO_THROW(jb.open("db_api_primary", ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create |
+                                                  ejdb::db_mode::truncate));
+    std::remove("db_api_replica.checkpoint");
+    ejdb::collection coll;
+    ASSERT_NO_THROW(coll = jb.create_collection("repl"));
+    ASSERT_NO_THROW(coll.set_index("a", ejdb::index_mode::number));
+    std::vector<std::array<char, 12>> oids;
+    for(int i = 0; i < 10; ++i)
+        ASSERT_NO_THROW(oids.push_back(coll.save_document(jbson::document(jbson::builder("a", i)).data())));
+
+    std::error_code ec;
+    EXPECT_FALSE(jb.replicate_to("db_api_replica", {}, ec));
+    EXPECT_EQ(std::errc::operation_not_permitted, ec);
+
+    jb.set_change_log_capacity(100);
+    ejdb::replicate_options opts;
+    opts.batch_size = 3;
+    // catches up by copying
+    ASSERT_NO_THROW(jb.replicate_to("db_api_replica", opts));
+    {
+        ejdb::db replica;
+        ASSERT_NO_THROW(replica.open("db_api_replica", ejdb::db_mode::read));
+        const auto info = replica.info();
+        ASSERT_EQ(1u, info->collections.size());
+        EXPECT_EQ(10, info->collections[0].records);
+        ASSERT_EQ(1u, info->collections[0].indexes.size());
+        EXPECT_EQ("a", info->collections[0].indexes[0].field);
+    }
+
+    // applies changes since
+    ASSERT_NO_THROW(coll.remove_document(oids[0]));
+    const auto doc = jbson::document(jbson::builder("a", 10)).data();
+    std::array<char, 12> oid;
+    ASSERT_NO_THROW(oid = coll.save_document(doc));
+    ASSERT_NO_THROW(coll.execute_query<ejdb::query_search_mode::count_only>(jb.create_query(
+        jbson::document(jbson::builder("$set", jbson::document(jbson::builder("b", 1)))).data())));
+    ASSERT_NO_THROW(coll.save_document(jbson::document(jbson::builder("c", 1)).data(), false));
+    // replayed with the same mode and hints
+    ASSERT_NO_THROW(coll.execute_query<ejdb::query_search_mode::first_only>(jb.create_query(
+        jbson::document(jbson::builder("$set", jbson::document(jbson::builder("d", 1)))).data())));
+    ASSERT_NO_THROW(coll.execute_query<ejdb::query_search_mode::count_only>(
+        jb.create_query(jbson::document(jbson::builder("$set", jbson::document(jbson::builder("e", 1)))).data())
+            .set_hints(jbson::document(jbson::builder("$max", 2)).data())));
+    ASSERT_NO_THROW(jb.replicate_to("db_api_replica", opts));
+    {
+        ejdb::db replica;
+        ASSERT_NO_THROW(replica.open("db_api_replica", ejdb::db_mode::read));
+        auto rcoll = replica.get_collection("repl");
+        ASSERT_TRUE(static_cast<bool>(rcoll));
+        EXPECT_TRUE(rcoll.load_document(oids[0]).empty());
+        EXPECT_FALSE(rcoll.load_document(oid).empty());
+        EXPECT_EQ(11u, rcoll.get_all().size());
+        EXPECT_EQ(10u, rcoll.execute_query<ejdb::query_search_mode::count_only>(
+                           replica.create_query(jbson::document(jbson::builder("b", 1)).data())));
+        EXPECT_EQ(1u, rcoll.execute_query<ejdb::query_search_mode::count_only>(
+                          replica.create_query(jbson::document(jbson::builder("d", 1)).data())));
+        EXPECT_EQ(2u, rcoll.execute_query<ejdb::query_search_mode::count_only>(
+                          replica.create_query(jbson::document(jbson::builder("e", 1)).data())));
+    }
+    // nothing new
+    EXPECT_TRUE(jb.replicate_to("db_api_replica", opts, ec));
+}
+
+TEST(ApiTest, ReplicationCatchUp) {
+    ejdb::db jb;
+    ASSERT_NO_THROW(jb.open("db_api_catch_up", ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create |
+                                                   ejdb::db_mode::truncate));
+    std::remove("db_api_catch_up_replica.checkpoint");
+    jb.set_change_log_capacity(1000000);
+    ejdb::collection bulk, counters;
+    ASSERT_NO_THROW(bulk = jb.create_collection("bulk"));
+    ASSERT_NO_THROW(counters = jb.create_collection("counters"));
+    for(int i = 0; i < 2000; ++i)
+        ASSERT_NO_THROW(bulk.save_document(jbson::document(jbson::builder("a", i)).data()));
+    ASSERT_NO_THROW(counters.save_document(jbson::document(jbson::builder("n", 0)).data()));
+
+    // incremented throughout catching up, each increment reaching the replica exactly once
+    auto inc = jb.create_query(jbson::document(jbson::builder("$inc", jbson::document(jbson::builder("n", 1)))).data());
+    std::atomic<bool> done{false};
+    std::atomic<int> incs{0};
+    std::thread t{[&] {
+        auto other = counters;
+        while(!done) {
+            EXPECT_NO_THROW(other.execute_query<ejdb::query_search_mode::count_only>(inc));
+            ++incs;
+            EXPECT_NO_THROW(bulk.save_document(jbson::document(jbson::builder("a", -1)).data()));
+        }
+    }};
+    while(incs == 0)
+        std::this_thread::yield();
+    ejdb::replicate_options opts;
+    opts.batch_size = 7;
+    EXPECT_NO_THROW(jb.replicate_to("db_api_catch_up_replica", opts));
+    done = true;
+    t.join();
+    ASSERT_NO_THROW(jb.replicate_to("db_api_catch_up_replica", opts));
+
+    const auto value = [](ejdb::collection coll) {
+        const auto docs = coll.get_all();
+        return docs.size() == 1 ? jbson::document(docs[0]).find("n")->value<int32_t>() : -1;
+    };
+    const int n = incs;
+    EXPECT_EQ(n, value(counters));
+    ejdb::db replica;
+    ASSERT_NO_THROW(replica.open("db_api_catch_up_replica", ejdb::db_mode::read));
+    EXPECT_EQ(n, value(replica.get_collection("counters")));
+    EXPECT_EQ(bulk.get_all().size(), replica.get_collection("bulk").get_all().size());
+}
+
+TEST(ApiTest, TimeToLive) {
+    ejdb::db jb;
+    ASSERT_NO_THROW(jb.open("db_api_ttl", ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create |
+                                              ejdb::db_mode::truncate));
+    ejdb::collection coll;
+    ASSERT_NO_THROW(coll = jb.create_collection("sessions"));
+
+    const auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         std::chrono::system_clock::now().time_since_epoch()).count();
+    const auto session = [](int64_t at) { return ejdb::detail::bson_builder{}.append_date("at", at).finish(); };
+    for(int i = 0; i < 5; ++i)
+        ASSERT_NO_THROW(coll.save_document(session(now - 2 * 3600 * 1000)));
+    for(int i = 0; i < 3; ++i)
+        ASSERT_NO_THROW(coll.save_document(session(now)));
+    ASSERT_NO_THROW(coll.save_document(jbson::document(jbson::builder("a", 1)).data()));
+
+    ejdb::ttl_options opts;
+    opts.sweep_interval = std::chrono::milliseconds{10};
+    opts.batch_size = 2;
+    opts.batch_interval = std::chrono::milliseconds{1};
+    ASSERT_NO_THROW(coll.set_ttl("at", std::chrono::hours{1}, opts));
+    for(int i = 0; i < 500 && coll.get_all().size() > 4; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds{10});
+    EXPECT_EQ(4u, coll.get_all().size());
+
+    // waits for any batch in progress, after which nothing more is swept
+    coll.clear_ttl();
+    ASSERT_NO_THROW(coll.save_document(session(now - 2 * 3600 * 1000)));
+    EXPECT_EQ(5u, coll.get_all().size());
+
+    ASSERT_NO_THROW(jb.close());
+    std::error_code ec;
+    EXPECT_FALSE(coll.set_ttl("at", std::chrono::hours{1}, opts, ec));
+    EXPECT_EQ(std::errc::operation_not_permitted, ec);
+}
+
+TEST(ApiTest, CappedCollection) {
+    ejdb::db jb;
+    ASSERT_NO_THROW(jb.open("db_api_capped", ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create |
+                                                 ejdb::db_mode::truncate));
+    ejdb::collection coll;
+    ASSERT_NO_THROW(coll = jb.create_collection("log"));
+    const auto values = [&] {
+        std::set<int32_t> ret;
+        for(auto&& doc : coll.get_all())
+            ret.insert(jbson::document(doc).find("a")->value<int32_t>());
+        return ret;
+    };
+
+    ejdb::cap_options opts;
+    opts.max_documents = 5;
+    opts.eviction_batch = 2;
+    ASSERT_NO_THROW(coll.set_cap(opts));
+    for(int32_t i = 0; i < 10; ++i)
+        ASSERT_NO_THROW(coll.save_document(jbson::document(jbson::builder("a", i)).data()));
+    // evicted two at a time once beyond five
+    EXPECT_EQ((std::set<int32_t>{6, 7, 8, 9}), values());
+
+    // removed documents aren't counted
+    std::array<char, 12> oid;
+    ASSERT_NO_THROW(oid = coll.save_document(jbson::document(jbson::builder("a", 10)).data()));
+    ASSERT_NO_THROW(coll.remove_document(oid));
+    ASSERT_NO_THROW(coll.save_document(jbson::document(jbson::builder("a", 11)).data()));
+    EXPECT_EQ((std::set<int32_t>{6, 7, 8, 9, 11}), values());
+
+    // existing documents evicted oldest first
+    opts.max_documents = 3;
+    opts.eviction_batch = 1;
+    ASSERT_NO_THROW(coll.set_cap(opts));
+    EXPECT_EQ((std::set<int32_t>{8, 9, 11}), values());
+
+    // by size, including the _id added by EJDB
+    const auto size = jbson::document(jbson::builder("a", 0)).data().size() + 17;
+    opts.max_documents = 0;
+    opts.max_bytes = 2 * size;
+    ASSERT_NO_THROW(coll.set_cap(opts));
+    EXPECT_EQ((std::set<int32_t>{9, 11}), values());
+
+    // rolled back by an aborted transaction, evicting the same documents afterwards
+    {
+        ejdb::unique_transaction trans{coll.transaction()};
+        ASSERT_NO_THROW(coll.save_document(jbson::document(jbson::builder("a", 13)).data()));
+        EXPECT_EQ((std::set<int32_t>{11, 13}), values());
+        trans.abort();
+    }
+    EXPECT_EQ((std::set<int32_t>{9, 11}), values());
+    ASSERT_NO_THROW(coll.save_document(jbson::document(jbson::builder("a", 14)).data()));
+    EXPECT_EQ((std::set<int32_t>{11, 14}), values());
+
+    coll.clear_cap();
+    ASSERT_NO_THROW(coll.save_document(jbson::document(jbson::builder("a", 12)).data()));
+    EXPECT_EQ(3u, coll.get_all().size());
+}
+
+TEST(ApiTest, Upsert) {
+    ejdb::db jb;
+    ASSERT_NO_THROW(jb.open("db_api_upsert", ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create |
+                                                 ejdb::db_mode::truncate));
+    ejdb::collection coll;
+    ASSERT_NO_THROW(coll = jb.create_collection("upsert"));
+    const auto match = jb.create_query(jbson::document(jbson::builder("key", "k1")).data());
+
+    ejdb::upsert_result first;
+    ASSERT_NO_THROW(first = coll.upsert(match, jbson::document(jbson::builder("key", "k1")("v", 1)).data()));
+    EXPECT_TRUE(first.inserted);
+    ejdb::upsert_result second;
+    ASSERT_NO_THROW(second = coll.upsert(match, jbson::document(jbson::builder("key", "k1")("v", 2)).data()));
+    EXPECT_FALSE(second.inserted);
+    EXPECT_EQ(first.oid, second.oid);
+    ASSERT_EQ(1u, coll.get_all().size());
+    EXPECT_EQ(2, jbson::document(coll.load_document(first.oid)).find("v")->value<int32_t>());
+
+    // merged, within a transaction in progress
+    {
+        ejdb::unique_transaction trans{coll.transaction()};
+        ASSERT_NO_THROW(second = coll.upsert(match, jbson::document(jbson::builder("w", 3)).data(), true));
+        EXPECT_FALSE(second.inserted);
+        trans.commit();
+    }
+    const auto doc = jbson::document(coll.load_document(first.oid));
+    EXPECT_EQ(2, doc.find("v")->value<int32_t>());
+    EXPECT_EQ(3, doc.find("w")->value<int32_t>());
+
+    // waits for another thread's transaction, rather than joining it and being discarded when it's aborted
+    {
+        ejdb::unique_transaction trans{coll.transaction()};
+        auto other = coll;
+        std::thread t{[&] {
+            const auto k2 = jbson::document(jbson::builder("key", "k2")).data();
+            EXPECT_TRUE(other.upsert(jb.create_query(k2), k2).inserted);
+        }};
+        std::this_thread::sleep_for(std::chrono::milliseconds{50});
+        trans.abort();
+        t.join();
+    }
+    EXPECT_EQ(2u, coll.get_all().size());
+
+    std::error_code ec;
+    EXPECT_FALSE(ejdb::collection{}.upsert(match, {}, false, ec));
+    EXPECT_EQ(std::errc::operation_not_permitted, ec);
+}
+
+TEST(ApiTest, RemoveWhere) {
+    ejdb::db jb;
+    ASSERT_NO_THROW(jb.open("db_api_remove_where", ejdb::db_mode::read | ejdb::db_mode::write |
+                                                       ejdb::db_mode::create | ejdb::db_mode::truncate));
+    ejdb::collection coll;
+    ASSERT_NO_THROW(coll = jb.create_collection("rm"));
+    for(int32_t i = 0; i < 25; ++i)
+        ASSERT_NO_THROW(coll.save_document(jbson::document(jbson::builder("a", i)("b", i % 2)).data()));
+
+    const auto odd = jb.create_query(jbson::document(jbson::builder("b", 1)).data());
+    EXPECT_EQ(12u, coll.remove_where(odd, 5));
+    EXPECT_EQ(13u, coll.get_all().size());
+    EXPECT_EQ(0u, coll.remove_where(odd));
+
+    // within a transaction in progress
+    {
+        ejdb::unique_transaction trans{coll.transaction()};
+        EXPECT_EQ(13u, coll.remove_where(jb.create_query(jbson::document(jbson::builder("b", 0)).data()), 2));
+        trans.abort();
+    }
+    EXPECT_EQ(13u, coll.get_all().size());
+
+    // with $or clauses, which must match alongside the query itself
+    auto ors = jb.create_query(jbson::document(jbson::builder("b", 0)).data());
+    ors |= jbson::document(jbson::builder("a", 0)).data();
+    ors |= jbson::document(jbson::builder("a", 1)).data();
+    ors |= jbson::document(jbson::builder("a", 2)).data();
+    EXPECT_EQ(2u, coll.remove_where(ors, 1));
+    EXPECT_EQ(11u, coll.get_all().size());
+
+    // recorded by OID, so that replicas remove the same documents
+    jb.set_change_log_capacity(100);
+    EXPECT_EQ(11u, coll.remove_where(jb.create_query(jbson::document(jbson::builder("b", 0)).data()), 4));
+    const auto changes = jb.changes_since(0);
+    ASSERT_EQ(11u, changes.size());
+    std::set<std::array<char, 12>> oids;
+    for(auto&& c : changes) {
+        EXPECT_EQ(ejdb::change_op::remove, c.op);
+        oids.insert(c.oid);
+    }
+    EXPECT_EQ(11u, oids.size());
+    EXPECT_TRUE(coll.get_all().empty());
+
+    std::error_code ec;
+    EXPECT_EQ(0u, ejdb::collection{}.remove_where(odd, 1, ec));
+    EXPECT_EQ(std::errc::operation_not_permitted, ec);
+}
+
+TEST(ApiTest, FindIds) {
+    ejdb::db jb;
+    ASSERT_NO_THROW(jb.open("db_api_find_ids", ejdb::db_mode::read | ejdb::db_mode::write | ejdb::db_mode::create |
+                                                   ejdb::db_mode::truncate));
+    ejdb::collection coll;
+    ASSERT_NO_THROW(coll = jb.create_collection("ids"));
+    std::set<std::array<char, 12>> odd;
+    for(int32_t i = 0; i < 10; ++i) {
+        std::array<char, 12> oid;
+        ASSERT_NO_THROW(oid = coll.save_document(jbson::document(jbson::builder("a", i)("b", i % 2)).data()));
+        if(i % 2)
+            odd.insert(oid);
+    }
+
+    auto qry = jb.create_query(jbson::document(jbson::builder("b", 1)).data());
+    const auto ids = coll.find_ids(qry);
+    EXPECT_EQ(odd, (std::set<std::array<char, 12>>(ids.begin(), ids.end())));
+
+    // unaffected by projections excluding other fields
+    ASSERT_NO_THROW(qry.project({"a"}));
+    EXPECT_EQ(ids, coll.find_ids(qry));
+    EXPECT_TRUE(ejdb::collection{}.find_ids(qry).empty());
+}
+
+TEST(ApiTest, OidGenerator) {
+    ejdb::oid_generator gen;
+    const auto before = static_cast<uint32_t>(
+        std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+    const auto oids = gen.generate(100);
+    ASSERT_EQ(100u, oids.size());
+    EXPECT_EQ(100u, (std::set<std::array<char, 12>>(oids.begin(), oids.end())).size());
+    EXPECT_TRUE(gen.generate(0).empty());
+
+    const auto field = [](const std::array<char, 12>& oid, size_t pos, size_t size) {
+        uint32_t v{0};
+        for(size_t i = pos; i < pos + size; ++i)
+            v = (v << 8) | static_cast<uint8_t>(oid[i]);
+        return v;
+    };
+    EXPECT_LE(before, field(oids.front(), 0, 4));
+    for(size_t i = 1; i < oids.size(); ++i) {
+        EXPECT_TRUE(std::equal(oids[i].begin() + 4, oids[i].begin() + 9, oids.front().begin() + 4));
+        EXPECT_EQ((field(oids[i - 1], 9, 3) + 1) & 0xffffff, field(oids[i], 9, 3));
+    }
+    EXPECT_EQ((field(oids.back(), 9, 3) + 1) & 0xffffff, field(gen.next(), 9, 3));
+}
+
+TEST(ApiTest, SaveDocuments) {
+    ejdb::db jb;
+    ASSERT_NO_THROW(jb.open("db_api_save_documents", ejdb::db_mode::read | ejdb::db_mode::write |
+                                                         ejdb::db_mode::create | ejdb::db_mode::truncate));
+    ejdb::collection coll;
+    ASSERT_NO_THROW(coll = jb.create_collection("graph"));
+
+    // a parent and its children, referring to it, built before saving
+    ejdb::oid_generator gen;
+    const auto ids = gen.generate(3);
+    std::vector<std::vector<char>> docs;
+    docs.push_back(ejdb::detail::bson_builder{}.append_oid("_id", ids[0].data()).append("name", "parent").finish());
+    for(size_t i = 1; i < ids.size(); ++i)
+        docs.push_back(ejdb::detail::bson_builder{}
+                           .append_oid("_id", ids[i].data())
+                           .append_oid("parent", ids[0].data())
+                           .finish());
+    docs.push_back(ejdb::detail::bson_builder{}.append("name", "no id").finish());
+
+    std::vector<std::array<char, 12>> oids;
+    ASSERT_NO_THROW(oids = coll.save_documents(docs));
+    ASSERT_EQ(4u, oids.size());
+    EXPECT_TRUE(std::equal(ids.begin(), ids.end(), oids.begin()));
+    EXPECT_FALSE(coll.load_document(oids[3]).empty());
+    const auto child = coll.load_document(ids[1]);
+    const auto parent = ejdb::detail::bson_find(child, "parent");
+    ASSERT_TRUE(static_cast<bool>(parent));
+    EXPECT_TRUE(std::equal(ids[0].begin(), ids[0].end(), parent->value));
+
+    // all or nothing
+    const auto extra = gen.next();
+    std::vector<std::vector<char>> bad;
+    bad.push_back(ejdb::detail::bson_builder{}.append_oid("_id", extra.data()).finish());
+    bad.push_back(ejdb::detail::bson_builder{}.append("_id", "not an oid").finish());
+    std::error_code ec;
+    EXPECT_TRUE(coll.save_documents(bad, false, ec).empty());
+    EXPECT_TRUE(static_cast<bool>(ec));
+    EXPECT_TRUE(coll.load_document(extra, ec).empty());
+    EXPECT_EQ(4u, coll.get_all().size());
+
+    ec.clear();
+    EXPECT_TRUE(ejdb::collection{}.save_documents(docs, false, ec).empty());
+    EXPECT_EQ(std::errc::operation_not_permitted, ec);
+}
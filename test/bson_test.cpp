@@ -0,0 +1,118 @@
+/**************************************************************************
+**  Copyright (C) 2014 Christian Manning
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include <ejpp/bson.hpp>
+
+#include <gtest/gtest.h>
+
+using namespace ejdb::detail;
+
+TEST(BsonTest, EmptyDocument) {
+    auto doc = bson_builder{}.finish();
+    ASSERT_EQ(5u, doc.size());
+    EXPECT_EQ(5, bson_read_int32(doc.data()));
+    EXPECT_EQ('\0', doc.back());
+
+    int n{0};
+    EXPECT_TRUE(bson_for_each(doc.data(), doc.size(), [&](const bson_element&) { return ++n; }));
+    EXPECT_EQ(0, n);
+}
+
+TEST(BsonTest, BuildAndFind) {
+    const char oid[12] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+    auto doc = bson_builder{}
+                   .append_oid("_id", oid)
+                   .append("a", int32_t{42})
+                   .append("b", 2.5)
+                   .append("c", "str")
+                   .begin_document("d")
+                   .append("e", int64_t{-7})
+                   .append_null("f")
+                   .end()
+                   .begin_array("g")
+                   .append("0", true)
+                   .end()
+                   .finish();
+    ASSERT_EQ(static_cast<size_t>(bson_read_int32(doc.data())), doc.size());
+
+    auto e = bson_find(doc, "a");
+    ASSERT_TRUE(static_cast<bool>(e));
+    EXPECT_EQ(bson_type::int32, e->type);
+    EXPECT_EQ(42, bson_read_int32(e->value));
+    EXPECT_EQ(42.0, *e->as_number());
+
+    e = bson_find(doc, "b");
+    ASSERT_TRUE(static_cast<bool>(e));
+    EXPECT_EQ(2.5, *e->as_number());
+
+    e = bson_find(doc, "c");
+    ASSERT_TRUE(static_cast<bool>(e));
+    EXPECT_EQ(bson_type::string, e->type);
+    EXPECT_STREQ("str", e->value + 4);
+    EXPECT_FALSE(static_cast<bool>(e->as_number()));
+
+    EXPECT_EQ("str", *e->as_string());
+    EXPECT_FALSE(static_cast<bool>(bson_find(doc, "a")->as_string()));
+
+    e = bson_find(doc, "d.e");
+    ASSERT_TRUE(static_cast<bool>(e));
+    EXPECT_EQ(-7.0, *e->as_number());
+
+    e = bson_find(doc, "d.f");
+    ASSERT_TRUE(static_cast<bool>(e));
+    EXPECT_EQ(bson_type::null, e->type);
+    EXPECT_EQ(0u, e->size);
+
+    e = bson_find(doc, "g.0");
+    ASSERT_TRUE(static_cast<bool>(e));
+    EXPECT_EQ(bson_type::boolean, e->type);
+
+    e = bson_find(doc, "_id");
+    ASSERT_TRUE(static_cast<bool>(e));
+    EXPECT_EQ(bson_type::oid, e->type);
+    EXPECT_EQ(0, std::memcmp(oid, e->value, 12));
+
+    EXPECT_FALSE(static_cast<bool>(bson_find(doc, "x")));
+    EXPECT_FALSE(static_cast<bool>(bson_find(doc, "a.b")));
+    EXPECT_FALSE(static_cast<bool>(bson_find(doc, "d.x")));
+}
+
+TEST(BsonTest, CopyElement) {
+    auto src = bson_builder{}.append("a", int32_t{1}).append("b", "val").finish();
+    auto b = bson_find(src, "b");
+    ASSERT_TRUE(static_cast<bool>(b));
+
+    auto doc = bson_builder{}.append(*b).append("renamed", *b).finish();
+    auto e1 = bson_find(doc, "b");
+    auto e2 = bson_find(doc, "renamed");
+    ASSERT_TRUE(static_cast<bool>(e1));
+    ASSERT_TRUE(static_cast<bool>(e2));
+    EXPECT_TRUE(e1->value_equals(*b));
+    EXPECT_TRUE(e2->value_equals(*b));
+    EXPECT_EQ(b->raw(), e1->raw());
+}
+
+TEST(BsonTest, Malformed) {
+    auto doc = bson_builder{}.append("a", "value").finish();
+    EXPECT_FALSE(bson_for_each(doc.data(), doc.size() - 1, [](const bson_element&) { return true; }));
+    EXPECT_FALSE(bson_for_each(nullptr, 0, [](const bson_element&) { return true; }));
+
+    // string length exceeds document
+    doc[7] = 100;
+    EXPECT_FALSE(bson_for_each(doc.data(), doc.size(), [](const bson_element&) { return true; }));
+    EXPECT_FALSE(static_cast<bool>(bson_find(doc, "a")));
+}
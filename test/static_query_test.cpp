@@ -0,0 +1,94 @@
+/**************************************************************************
+**  Copyright (C) 2014 Christian Manning
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include <ejpp/static_query.hpp>
+
+#include <gtest/gtest.h>
+
+using namespace ejdb::q::literals;
+using ejdb::detail::bson_builder;
+
+TEST(StaticQueryTest, SingleCondition) {
+    auto expr = "age"_f == 30;
+    static_assert(decltype(expr)::size == 4 + 1 + 4 + 4 + 1, "");
+
+    auto ref = bson_builder{}.append("age", int32_t{30}).finish();
+    EXPECT_EQ(ref, expr.bson());
+
+    auto buf = expr.buffer();
+    EXPECT_EQ(ref, std::vector<char>(buf.begin(), buf.end()));
+}
+
+TEST(StaticQueryTest, Operators) {
+    auto expr = ("a"_f != 1) && ("b"_f > 2u) && ("c"_f >= int64_t{3}) && ("d"_f < 4.5f) && ("e"_f <= 5.5) &&
+                ("f.g"_f == false);
+    auto ref = bson_builder{}
+                   .begin_document("a")
+                   .append("$not", int32_t{1})
+                   .end()
+                   .begin_document("b")
+                   .append("$gt", int64_t{2})
+                   .end()
+                   .begin_document("c")
+                   .append("$gte", int64_t{3})
+                   .end()
+                   .begin_document("d")
+                   .append("$lt", 4.5)
+                   .end()
+                   .begin_document("e")
+                   .append("$lte", 5.5)
+                   .end()
+                   .append("f.g", false)
+                   .finish();
+    EXPECT_EQ(ref, expr.bson());
+}
+
+TEST(StaticQueryTest, Between) {
+    auto expr = "n"_f.between(-1, 1) && ejdb::q::field<'m'>{} == 2;
+    auto ref = bson_builder{}
+                   .begin_document("n")
+                   .begin_array("$bt")
+                   .append("0", int32_t{-1})
+                   .append("1", int32_t{1})
+                   .end()
+                   .end()
+                   .append("m", int32_t{2})
+                   .finish();
+    EXPECT_EQ(ref, expr.bson());
+}
+
+TEST(StaticQueryTest, Oid) {
+    std::array<char, 12> oid{{1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12}};
+    auto expr = "_id"_f == oid;
+    auto ref = bson_builder{}.append_oid("_id", oid.data()).finish();
+    EXPECT_EQ(ref, expr.bson());
+}
+
+TEST(StaticQueryTest, LayoutIsConstant) {
+    using expr_t = decltype("x"_f > 0 && "y"_f == true);
+    constexpr auto layout = expr_t::layout;
+    static_assert(layout[0] == static_cast<char>(expr_t::size), "");
+    static_assert(layout[4] == static_cast<char>(ejdb::detail::bson_type::document), "");
+    static_assert(layout[5] == 'x', "");
+    static_assert(layout[expr_t::size - 1] == '\0', "");
+
+    // values are patched in at runtime
+    auto a = ("x"_f > 0 && "y"_f == true).bson();
+    auto b = ("x"_f > 1 && "y"_f == true).bson();
+    ASSERT_EQ(a.size(), b.size());
+    EXPECT_NE(a, b);
+}
@@ -0,0 +1,177 @@
+/**************************************************************************
+**  Copyright (C) 2014 Christian Manning
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include <ejpp/typed_collection.hpp>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+struct address {
+    std::string street;
+    int number;
+};
+
+struct person {
+    std::array<char, 12> _id;
+    std::string name;
+    int64_t age;
+    double score;
+    bool active;
+    std::experimental::optional<std::string> nickname;
+    std::vector<int> tags;
+    address home;
+};
+
+} // namespace
+
+EJPP_DOCUMENT(address, street, number)
+EJPP_DOCUMENT(person, _id, name, age, score, active, nickname, tags, home)
+
+using namespace ejdb::detail;
+
+TEST(TypedCollectionTest, EncodeLayout) {
+    person p{{{1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12}}, "Jane", 42, 2.5, true, {}, {1, 2, 3}, {"High St", 10}};
+    const auto doc = ejdb::to_bson(p);
+
+    ASSERT_EQ(static_cast<size_t>(bson_read_int32(doc.data())), doc.size());
+    EXPECT_EQ(bson_type::oid, bson_find(doc, "_id")->type);
+    EXPECT_EQ(bson_type::string, bson_find(doc, "name")->type);
+    EXPECT_EQ(bson_type::int64, bson_find(doc, "age")->type);
+    EXPECT_EQ(bson_type::double_, bson_find(doc, "score")->type);
+    EXPECT_EQ(bson_type::boolean, bson_find(doc, "active")->type);
+    EXPECT_FALSE(static_cast<bool>(bson_find(doc, "nickname")));
+    EXPECT_EQ(bson_type::array, bson_find(doc, "tags")->type);
+    EXPECT_EQ(3.0, *bson_find(doc, "tags.2")->as_number());
+    EXPECT_EQ(10.0, *bson_find(doc, "home.number")->as_number());
+
+    // matches the equivalent hand-built document byte for byte
+    const auto expected = bson_builder{}
+                              .append_oid("_id", p._id.data())
+                              .append("name", "Jane")
+                              .append("age", int64_t{42})
+                              .append("score", 2.5)
+                              .append("active", true)
+                              .begin_array("tags")
+                              .append("0", int32_t{1})
+                              .append("1", int32_t{2})
+                              .append("2", int32_t{3})
+                              .end()
+                              .begin_document("home")
+                              .append("street", "High St")
+                              .append("number", int32_t{10})
+                              .end()
+                              .finish();
+    EXPECT_EQ(expected, doc);
+}
+
+TEST(TypedCollectionTest, RoundTrip) {
+    person p{{{1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12}}, "Jane", 42, 2.5, true, {"JJ"}, {}, {"High St", 10}};
+    p.tags.resize(12, 7);
+    const auto doc = ejdb::to_bson(p);
+    const auto q = ejdb::from_bson<person>(doc);
+
+    EXPECT_EQ(p._id, q._id);
+    EXPECT_EQ(p.name, q.name);
+    EXPECT_EQ(p.age, q.age);
+    EXPECT_EQ(p.score, q.score);
+    EXPECT_EQ(p.active, q.active);
+    ASSERT_TRUE(static_cast<bool>(q.nickname));
+    EXPECT_EQ("JJ", *q.nickname);
+    EXPECT_EQ(p.tags, q.tags);
+    EXPECT_EQ(p.home.street, q.home.street);
+    EXPECT_EQ(p.home.number, q.home.number);
+}
+
+TEST(TypedCollectionTest, DecodeLenient) {
+    const auto doc = bson_builder{}
+                         .append("age", 30.0)
+                         .append("score", int32_t{3})
+                         .append_null("nickname")
+                         .append("unknown", "ignored")
+                         .finish();
+    person p{};
+    p.nickname = std::string{"old"};
+    ASSERT_TRUE(decode(doc.data(), doc.size(), p));
+    EXPECT_EQ(30, p.age);
+    EXPECT_EQ(3.0, p.score);
+    EXPECT_FALSE(static_cast<bool>(p.nickname));
+    EXPECT_TRUE(p.name.empty());
+}
+
+TEST(TypedCollectionTest, ZeroOidOmitted) {
+    person p{};
+    const auto doc = ejdb::to_bson(p);
+    EXPECT_FALSE(static_cast<bool>(bson_find(doc, "_id")));
+    EXPECT_EQ(doc.size(), encoded_size(p));
+}
+
+TEST(TypedCollectionTest, DecodeMismatch) {
+    const auto doc = bson_builder{}.append("name", int32_t{1}).finish();
+    person p{};
+    EXPECT_FALSE(decode(doc.data(), doc.size(), p));
+    EXPECT_THROW(ejdb::from_bson<person>(doc), std::system_error);
+}
+
+TEST(TypedCollectionTest, SaveLoadFind) {
+    ejdb::db jb;
+    ASSERT_NO_THROW(jb.open("db_typed_collection", ejdb::db_mode::read | ejdb::db_mode::write |
+                                                       ejdb::db_mode::create | ejdb::db_mode::truncate));
+    ejdb::typed_collection<person> people;
+    ASSERT_NO_THROW(people = ejdb::typed_collection<person>{jb.create_collection("people")});
+    ASSERT_TRUE(static_cast<bool>(people));
+
+    // value-initialised objects are saved as distinct documents
+    person jane{};
+    jane.name = "Jane";
+    jane.age = 42;
+    jane.tags = {1, 2};
+    jane.home = {"High St", 10};
+    person john{};
+    john.name = "John";
+    john.age = 30;
+    std::array<char, 12> jane_id, john_id;
+    ASSERT_NO_THROW(jane_id = people.save(jane));
+    ASSERT_NO_THROW(john_id = people.save(john));
+    EXPECT_NE(jane_id, john_id);
+
+    std::experimental::optional<person> loaded;
+    ASSERT_NO_THROW(loaded = people.load(jane_id));
+    ASSERT_TRUE(static_cast<bool>(loaded));
+    EXPECT_EQ(jane_id, loaded->_id);
+    EXPECT_EQ("Jane", loaded->name);
+    EXPECT_EQ(42, loaded->age);
+    EXPECT_EQ(jane.tags, loaded->tags);
+    EXPECT_EQ("High St", loaded->home.street);
+
+    // saving a loaded object updates its document
+    loaded->age = 43;
+    EXPECT_EQ(jane_id, people.save(*loaded));
+    EXPECT_EQ(43, people.load(jane_id)->age);
+
+    const auto older = jb.create_query(bson_builder{}.begin_document("age").append("$gt", 35).end().finish());
+    std::vector<person> found;
+    ASSERT_NO_THROW(found = people.find(older));
+    ASSERT_EQ(1u, found.size());
+    EXPECT_EQ("Jane", found.front().name);
+    EXPECT_EQ("John", people.find_first(jb.create_query(bson_builder{}.append("age", 30).finish()))->name);
+
+    ASSERT_NO_THROW(people.remove(john_id));
+    std::error_code ec;
+    EXPECT_FALSE(static_cast<bool>(people.load(john_id, ec)));
+    EXPECT_EQ(1u, people.find(jb.create_query(bson_builder{}.finish())).size());
+}